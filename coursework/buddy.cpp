@@ -1,14 +1,23 @@
 /*
  * The Buddy Page Allocator
- * SKELETON IMPLEMENTATION TO BE FILLED IN FOR TASK 2
+ *
+ * Free blocks of each order are kept on unsorted doubly-linked lists, with a bitmap per order so that a block's
+ * buddy is found without walking them.
  */
 
 #include <infos/mm/page-allocator.h>
 #include <infos/mm/mm.h>
 #include <infos/kernel/kernel.h>
 #include <infos/kernel/log.h>
+#include <infos/kernel/cmdline.h>
+#include <infos/kernel/syscall.h>
 #include <infos/util/math.h>
 #include <infos/util/printf.h>
+#include <infos/util/string.h>
+#include <infos/util/lock.h>
+
+#include "smp.h"
+#include "usercopy.h"
 
 using namespace infos::kernel;
 using namespace infos::mm;
@@ -16,12 +25,273 @@ using namespace infos::util;
 
 #define MAX_ORDER	18
 
+/* Set to 1 to cross-check every free bitmap lookup against a walk of the free lists. */
+#define BUDDY_DEBUG	0
+
+/* Free order tag of a page that is not the head of a free block. */
+#define NO_FREE_ORDER	0xff
+
+/* Back-link of the block at the head of a free list. */
+#define NO_PFN		0xffffffffU
+
+/* Orders below this are served from the per-CPU page caches. */
+#define PCP_ORDERS	2
+
+/* Blocks moved between a per-CPU page cache and the free lists at once. */
+#define PCP_BATCH	16
+
+/* A per-CPU page cache is refilled when it falls to the low watermark, and drained when it goes above the high one. */
+#define PCP_LOW		4
+#define PCP_HIGH	64
+
+/* In lazy coalescing mode, blocks of orders below this are not merged with their buddies when freed. */
+#define LAZY_ORDERS	4
+
+/* The most uncoalesced blocks kept of each lazy order - going above this merges the oldest down to half of it. */
+#define LAZY_HIGH	256
+
+/* The most regions memory is split into.  Each region is a power-of-two number of pageblocks with its own lock. */
+#define MAX_REGIONS	MAX_CPUS
+
+/* The most pages one trace record can describe - longer page ranges are recorded as several. */
+#define TRACE_MAX_COUNT	((1U << 20) - 1)
+
+/* The most records the trace ring can be given, i.e. 256 MiB of it. */
+#define TRACE_MAX_RECORDS	(1ULL << 24)
+
+/**
+ * The lifetime classes allocations are grouped by.  Each max-order block of memory (a pageblock) belongs to one
+ * class, and a class allocates from its own pageblocks for as long as it can, so long-lived allocations do not
+ * end up scattered through memory that short-lived ones would otherwise free back into large blocks.
+ */
+enum BuddyAllocClass
+{
+	ALLOC_PINNED = 0,		// lives until it is explicitly freed, e.g. page tables and kernel objects (the default)
+	ALLOC_RECLAIMABLE = 1,	// short-lived, or could be given back under pressure, e.g. user pages
+	NR_ALLOC_CLASSES = 2,
+};
+
+/* When set (pgalloc.placement=lowest), allocations take the lowest-addressed free block instead of the list head. */
+static bool buddy_lowest_address_first;
+
+RegisterCmdLineArgument(BuddyPlacement, "pgalloc.placement") {
+	buddy_lowest_address_first = (strncmp(value, "lowest", 6) == 0);
+}
+
+/* When set (pgalloc.coalesce=lazy), low-order frees are kept uncoalesced until they are needed merged. */
+static bool buddy_lazy_coalescing;
+
+RegisterCmdLineArgument(BuddyCoalesce, "pgalloc.coalesce") {
+	buddy_lazy_coalescing = (strncmp(value, "lazy", 4) == 0);
+}
+
+/* When set (pgalloc.grouping=off), every allocation is treated as the same class, i.e. nothing is grouped. */
+static bool buddy_no_grouping;
+
+RegisterCmdLineArgument(BuddyGrouping, "pgalloc.grouping") {
+	buddy_no_grouping = (strncmp(value, "off", 3) == 0);
+}
+
+/* The number of records in the allocation trace ring (pgalloc.trace=<records>) - zero, the default, turns tracing off. */
+static uint64_t buddy_trace_records;
+
+RegisterCmdLineArgument(BuddyTrace, "pgalloc.trace") {
+	uint64_t n = 0;
+	while (*value >= '0' && *value <= '9') {
+		n = (n * 10) + (*value++ - '0');
+	}
+
+	buddy_trace_records = n;
+}
+
+/* The most regions to split memory into (pgalloc.regions=<n>) - one gives a single lock over everything. */
+static unsigned int buddy_max_regions = MAX_REGIONS;
+
+RegisterCmdLineArgument(BuddyRegions, "pgalloc.regions") {
+	unsigned int n = 0;
+	while (*value >= '0' && *value <= '9') {
+		n = (n * 10) + (*value++ - '0');
+	}
+
+	if (n >= 1 && n <= MAX_REGIONS) buddy_max_regions = n;
+}
+
+/* When set (pgalloc.stress=1), SYS_PGALLOC_STRESS is registered - it lets any program keep the allocator busy for as
+ * long as it likes, so it is only there when asked for, for measuring the allocator. */
+static bool buddy_stress_syscall;
+
+RegisterCmdLineArgument(BuddyStress, "pgalloc.stress") {
+	buddy_stress_syscall = (*value == '1');
+}
+
+/* The syscalls user space reads the allocator statistics through, runs the allocator stress test with, and dumps the
+ * allocation trace with - see infos-user/inc/infos.h. */
+#define SYS_GET_MEMINFO		32
+#define SYS_PGALLOC_STRESS	33
+#define SYS_PGALLOC_TRACE	34
+
+/* SYS_PGALLOC_TRACE flags: write the trace to the debug console, and/or start the next dump from here. */
+#define PGALLOC_TRACE_DUMP	1
+#define PGALLOC_TRACE_RESET	2
+
+/**
+ * A snapshot of the allocator statistics, as copied out by SYS_GET_MEMINFO.  The layout must match struct meminfo
+ * in infos-user/inc/infos.h.
+ */
+struct BuddyMemInfo
+{
+	uint64_t nr_pages;				// pages the allocator manages, free or not
+	uint64_t nr_free_pages;			// pages on the free lists
+	uint64_t nr_cached_pages;		// free pages held in the per-CPU page caches, or left uncoalesced
+	uint64_t splits;
+	uint64_t merges;
+	uint32_t max_order;
+	int32_t largest_free_order;		// -1 if nothing is free
+	uint64_t free_blocks[MAX_ORDER + 1];
+	uint64_t failed_allocs[MAX_ORDER + 1];
+	uint32_t fragmentation[MAX_ORDER + 1];	// unusable free space index for each order, in thousandths
+	uint64_t exact_allocs;			// allocate_pages_exact calls that succeeded
+	uint64_t exact_pages_saved;		// pages those calls gave back, over rounding up to a power of two
+	uint64_t exact_pages_live_saved;	// of which, pages saved by exact allocations that are still in use
+	uint64_t class_fallbacks[NR_ALLOC_CLASSES];	// allocations of each class served from another class's pageblock
+	uint64_t pageblock_claims;		// pageblocks handed from one class to another
+	uint64_t lock_contentions;		// times a CPU had to wait for a region's lock
+	uint32_t nr_regions;			// independently locked regions memory is split into
+	uint64_t contig_allocs;			// allocate_contig_range calls that succeeded with a run of max-order blocks
+	uint64_t contig_pages;			// pages in those ranges that are still in use
+};
+
+/**
+ * The events the allocation trace records.  A zero event marks an empty record.
+ */
+enum BuddyTraceEvent
+{
+	TRACE_ALLOC = 1,			// a block of 2^order pages was allocated - at NO_PFN if the allocation failed
+	TRACE_FREE = 2,				// a block of 2^order pages was freed
+	TRACE_ALLOC_EXACT = 3,		// count pages were allocated with allocate_pages_exact
+	TRACE_FREE_EXACT = 4,		// count pages were freed with free_pages_exact
+	TRACE_INSERT_RANGE = 5,		// count pages were made available
+	TRACE_REMOVE_RANGE = 6,		// count pages were made unavailable
+	TRACE_ALLOC_CONTIG = 7,		// count pages were allocated with allocate_contig_range - more than TRACE_MAX_COUNT
+								// pages take TRACE_CONTIG_MORE records for the rest
+	TRACE_FREE_CONTIG = 8,		// pages allocated with allocate_contig_range were freed
+	TRACE_CONTIG_MORE = 9,		// count more pages of the last contiguous range allocated (or not) on the same CPU
+};
+
+/**
+ * One event in the allocation trace, as it is held in the trace ring and written out by SYS_PGALLOC_TRACE.
+ */
+struct BuddyTraceRecord
+{
+	uint64_t tsc;		// the time stamp counter when the event happened
+	uint32_t pfn;		// the first page of the block or range
+	uint32_t info;		// event (bits 0-3), CPU (4-7), lifetime class (8), ring lap (9-11), order or count (12-31)
+
+	BuddyTraceEvent event() const { return (BuddyTraceEvent)(info & 0xf); }
+	unsigned int cpu() const { return (info >> 4) & 0xf; }
+	int cls() const { return (info >> 8) & 1; }
+	uint32_t arg() const { return info >> 12; }
+};
+
+/* The magic numbers a trace dump starts and ends with. */
+#define TRACE_MAGIC		"PGTRACE1"
+#define TRACE_END_MAGIC	"PGTREND1"
+
+/**
+ * The header of a trace dump.  The dump is framed by this and a BuddyTraceTrailer, so a reader can pick it out of
+ * whatever else was written to the debug console, and tell a whole dump from one that was cut short.
+ */
+struct BuddyTraceHeader
+{
+	char magic[8];			// TRACE_MAGIC
+	uint32_t record_size;	// sizeof(BuddyTraceRecord)
+	uint32_t max_order;
+	uint64_t nr_records;	// the records that follow, oldest first
+	uint64_t nr_dropped;	// older records overwritten since tracing began (or was reset), so not in the dump
+	uint64_t nr_pages;		// the page descriptors the allocator was initialised with
+};
+
+struct BuddyTraceTrailer
+{
+	char magic[8];			// TRACE_END_MAGIC
+	uint64_t nr_skipped;	// records that were overwritten while being dumped, so were written out empty
+};
+
+#ifndef HAVE_DEBUGCON_WRITE
+/**
+ * Writes bytes to QEMU's debug console (port 0xe9), which run.sh connects to its standard output.  A build for
+ * another environment can supply its own debugcon_write() by defining HAVE_DEBUGCON_WRITE.
+ */
+static inline void debugcon_write(const void *data, uint64_t size)
+{
+	asm volatile("rep outsb" : "+S"(data), "+c"(size) : "d"((uint16_t)0xe9) : "memory");
+}
+#endif
+
+static unsigned long sys_get_meminfo(unsigned long info, unsigned long size, unsigned long, unsigned long);
+static unsigned long sys_pgalloc_stress(unsigned long iterations, unsigned long seed, unsigned long, unsigned long);
+static unsigned long sys_pgalloc_trace(unsigned long flags, unsigned long, unsigned long, unsigned long);
+
 /**
  * A buddy page allocation algorithm.
  */
 class BuddyPageAllocator : public PageAllocatorAlgorithm
 {
 private:
+	/**
+	 * An independently locked part of memory: a power-of-two run of pageblocks, with the free lists, uncoalesced
+	 * blocks and counters for the blocks in it.  No block (of any order) spans two regions, so splitting and
+	 * merging only ever touch one region, and a CPU holds only one region's lock at a time - except to claim a
+	 * contiguous range of max-order blocks, when it takes the lock of every region the range is in, in order.
+	 */
+	struct Region {
+		mutable RawSpinLock lock;
+		pfn_t start, end;		// the pages the region covers
+		bool populated;			// set once any memory in the region has been made available, and read without the lock
+
+		PageDescriptor *free_areas[NR_ALLOC_CLASSES][MAX_ORDER+1];
+		uint64_t nr_free_blocks[MAX_ORDER+1];
+
+		// For each class, the first word of each free bitmap that may have a bit set for one of its blocks in
+		// the region, for lowest-address placement
+		uint64_t lowest_word_hint[NR_ALLOC_CLASSES][MAX_ORDER+1];
+
+		PageDescriptor *lazy_blocks[NR_ALLOC_CLASSES][LAZY_ORDERS];
+		unsigned int nr_lazy_blocks[NR_ALLOC_CLASSES][LAZY_ORDERS];
+		uint64_t nr_lazy_flushes;
+
+		uint64_t nr_splits;
+		uint64_t nr_merges;
+		uint64_t nr_fallbacks[NR_ALLOC_CLASSES];
+		uint64_t nr_pageblock_claims;
+		uint64_t nr_exact_allocs;
+		uint64_t nr_exact_pages_saved;
+		uint64_t nr_exact_pages_live_saved;
+		uint64_t nr_contentions;
+	} __aligned(64);
+
+	/**
+	 * Holds a region's lock for the lifetime of the object, counting the times it had to wait for it.  Interrupts
+	 * are off for as long as the lock is held, so an allocation from an interrupt handler can't spin on a lock
+	 * its own CPU holds - and only for that long, so the region locks are all that serialises the CPUs.
+	 */
+	class UniqueRegionLock
+	{
+	public:
+		UniqueRegionLock(Region& region) : _region(region)
+		{
+			if (!_region.lock.try_lock()) {
+				_region.lock.lock();
+				_region.nr_contentions++;
+			}
+		}
+
+		~UniqueRegionLock() { _region.lock.unlock(); }
+
+	private:
+		UniqueIRQLock _irq;
+		Region& _region;
+	};
 
 	/** Given a page descriptor, and an order, returns if the block is aligned with that order
 	 * @param pgd The page descriptor to check alignment for.
@@ -49,34 +319,47 @@ private:
 		return pages; 
 	}
 
-	/** Given a starting page descriptor, and an count of pages to free, returns the lowest order that can hold that many pages
-	 * @param pgd The starting page descriptor 
-	 * @param count The number of page descriptor do allocate/free
-	 * @return Returns an integer representing the lowest order that can fit the count of pages needed 
+	/** Given a count of pages, returns the smallest order whose blocks can hold that many pages
+	 * @param count The number of pages.
+	 * @return Returns the order, which may be above MAX_ORDER if count is larger than the largest block
 	 */
-	int lowest_possible_order(const PageDescriptor *pgd, uint64_t count) {
-		//let's first find the highest aligned order to pgd and then count; 
-		int highest_aligned_order = MAX_ORDER;
-
-		while (!(is_aligned(pgd, highest_aligned_order))) {
-			highest_aligned_order--;
+	int order_for_pages(uint64_t count) {
+		int order = 0;
+		while ((1ULL << order) < count) {
+			order++;
 		}
+		return order;
+	}
 
-		//and now count to lowest order that can fit count of pages 
-		uint64_t pages_can_allocate = this->pages_in_block(highest_aligned_order); 
-		int lowest_possible = highest_aligned_order;
+	/** Given the start of a range of pages, returns the order of the largest block that starts there and fits in
+	 * the range - i.e. the first of the maximal aligned blocks that tile the range.
+	 * @param pfn The first page of the range.
+	 * @param count The number of pages in the range (at least one).
+	 * @return Returns the order of the block.
+	 */
+	int largest_aligned_order(pfn_t pfn, uint64_t count) {
+		//limited by the alignment of pfn, and by how many pages there are
+		int order = (pfn == 0) ? MAX_ORDER : __builtin_ctzll(pfn);
+		if (order > MAX_ORDER) order = MAX_ORDER;
 
-		while ((lowest_possible <= MAX_ORDER) && (pages_can_allocate < count)) {
-			if (is_aligned(pgd, lowest_possible)) { 
-				//mm_log.messagef(LogLevel::INFO,"Got lowest possible aligned order %d to fit 0x%p + 0x%lx", lowest_possible, pgd, count);
-				return lowest_possible; 
-			}
-			lowest_possible++;
-			pages_can_allocate = this->pages_in_block(highest_aligned_order);
+		while (pages_in_block(order) > count) {
+			order--;
 		}
-		
-		//mm_log.messagef(LogLevel::INFO,"Got lowest possible order %d to fit 0x%p + 0x%lx", lowest_possible, pgd, count);
-		return lowest_possible;
+		return order;
+	}
+
+	/** Given a block, returns the free block that contains it, by probing the free bitmap of each order from the
+	 * block's own upwards - so this is O(MAX_ORDER), and never walks a free list.
+	 * @param pfn The first page of the block.
+	 * @param order The order of the block.
+	 * @return Returns the order of the free block containing it (which starts at pfn rounded down to that order),
+	 * or -1 if it is not (wholly) free.
+	 */
+	int containing_free_order(pfn_t pfn, int order) {
+		for (int o = order; o <= MAX_ORDER; o++) {
+			if (test_free_bit(pfn & ~(pages_in_block(o) - 1), o)) return o;
+		}
+		return -1;
 	}
 
 	/** Given a page descriptor, and an order, returns the buddy PGD.  The buddy could either be
@@ -121,31 +404,178 @@ private:
 		return buddy_pgd;
 	}
 
-	/** Given a page descriptor, and an order, returns if the buddy is in the
-	 * @param start The page descriptor to check if in the free areas for the order
+	/** Given an order, returns the number of bits in the free bitmap of that order
+	 * @param order The order of the bitmap.
+	 * @return Returns one bit for every (possibly partial) block of that order
+	 */
+	uint64_t bits_in_bitmap(int order) const {
+		return (_nr_page_descriptors + (1ULL << order) - 1) >> order;
+	}
+
+	/** Given an order, returns the number of 64-bit words in the free bitmap of that order
+	 * @param order The order of the bitmap.
+	 * @return Returns the word count of that bitmap
+	 */
+	uint64_t words_in_bitmap(int order) const {
+		return (bits_in_bitmap(order) + 63) / 64;
+	}
+
+	/** Given a pfn, returns the class that owns the pageblock it lies in - which is also the class whose free
+	 * lists a free block there goes on
+	 * @param pfn The page frame number.
+	 * @return Returns the class
+	 */
+	int class_of(pfn_t pfn) const {
+		return _pageblock_class[pfn >> MAX_ORDER];
+	}
+
+	/** Given a pfn, returns the region that manages it - which is the same for every block the pfn can be in
+	 * @param pfn The page frame number.
+	 * @return Returns the region
+	 */
+	Region& region_of(pfn_t pfn) {
+		return _regions[pfn >> _region_shift];
+	}
+
+	/** Given a pfn, and an order, returns if the block of that order holding the pfn is free
+	 * @param pfn The page frame number to look up.
+	 * @param order The order of the block we are asking about.
+	 * @return Returns TRUE if the (aligned) block of that order containing pfn is on a free list of that order
+	 */
+	bool test_free_bit(pfn_t pfn, int order) const {
+		//the bit for a block is its pfn with the low order bits shifted away
+		uint64_t bit = pfn >> order;
+		if (bit >= bits_in_bitmap(order)) return false;
+
+		return (__atomic_load_n(&_free_bitmap[order][bit / 64], __ATOMIC_RELAXED) >> (bit % 64)) & 1;
+	}
+
+	/** Marks the block of the given order holding pfn as free (on) or not free (off) in the bitmap of that order.
+	 * A word of the highest orders covers more than one region, so other CPUs may be updating its other bits
+	 * under their own region's lock - those words are updated atomically.
+	 * @param pfn The page frame number of the head of the block.
+	 * @param order The order of the block.
+	 * @param free Whether the block is now on the free list of that order.
+	 */
+	void update_free_bit(pfn_t pfn, int order, bool free) {
+		uint64_t bit = pfn >> order;
+		assert(bit < bits_in_bitmap(order));
+
+		uint64_t *word = &_free_bitmap[order][bit / 64];
+		uint64_t mask = 1ULL << (bit % 64);
+		bool shared = (order + 6) > _region_shift;
+
+		if (free) {
+			if (shared) {
+				__atomic_fetch_or(word, mask, __ATOMIC_RELAXED);
+			} else {
+				*word |= mask;
+			}
+
+			//keep the lowest-address search hint of the block's class at or below the first word it has a block in
+			uint64_t& hint = region_of(pfn).lowest_word_hint[class_of(pfn)][order];
+			if (bit / 64 < hint) {
+				hint = bit / 64;
+			}
+		} else if (shared) {
+			__atomic_fetch_and(word, ~mask, __ATOMIC_RELAXED);
+		} else {
+			*word &= ~mask;
+		}
+	}
+
+	/** Given a page descriptor, and an order, returns if the target lies in a free block of that order.
+	 * This is a constant time lookup in the free bitmap for that order.
+	 * @param target The page descriptor to check if in the free areas for the order
 	 * @param order The order in which we are searching the page descriptor for
 	 * @return Returns the if target is in a free-block is this order
 	 */
 	bool is_in_free(const PageDescriptor *target, int order) {
-		//pointer to the free block we are searching
-		PageDescriptor *free_block = this->_free_areas[order];
-		uint64_t block_size = this->pages_in_block(order);
-		
-		while (free_block->next_free) {
-			if ((free_block <= target) && (free_block + block_size >= target)) {
-				//target is somewhere in the block we are looking at
-				//mm_log.messagef(LogLevel::DEBUG,"target found somewhere in the block we are looking at");
-				return true;
-			};        
-			////mm_log.messagef(LogLevel::DEBUG,"keep searching in this order: %d", order);
-			free_block = free_block->next_free; 
+		bool free = test_free_bit(sys.mm().pgalloc().pgd_to_pfn(target), order);
+
+#if BUDDY_DEBUG
+		//the bitmap must agree with the free list
+		assert(free == is_in_free_list(target, order));
+#endif
+		return free;
+	}
+
+	/** Given a page descriptor, and an order, walks the free list of that order to find if target lies in a free block.
+	 * This is O(free blocks), and is only used to cross-check the free bitmaps when BUDDY_DEBUG is on.
+	 * @param target The page descriptor to check if in the free areas for the order
+	 * @param order The order in which we are searching the page descriptor for
+	 * @return Returns the if target is in a free-block is this order
+	 */
+	bool is_in_free_list(const PageDescriptor *target, int order) {
+		uint64_t block_size = 1ULL << order;
+		const Region& region = region_of(sys.mm().pgalloc().pgd_to_pfn(target));
+
+		for (int cls = 0; cls < NR_ALLOC_CLASSES; cls++) {
+			//pointer to the free block we are searching
+			PageDescriptor *free_block = region.free_areas[cls][order];
+
+			while (free_block) {
+				if ((free_block <= target) && (target < free_block + block_size)) {
+					//target is somewhere in the block we are looking at
+					return true;
+				}
+				free_block = free_block->next_free;
+			}
 		}
 		return false;
 	}
 
+	/** Given a pfn, returns if that page is the head of a block on one of the free lists.  Order tags are not
+	 * initialised up front, so a tag is only believed if it names an order the page is aligned to, and the free
+	 * bitmap of that order has the block marked free.
+	 * @param pfn The page frame number to check.
+	 * @return Returns TRUE if pfn heads a free block (of order _free_order[pfn])
+	 */
+	bool is_free_head(pfn_t pfn) const {
+		uint8_t order = _free_order[pfn];
+		if (order > MAX_ORDER) return false;
+
+		return (pfn & ((1ULL << order) - 1)) == 0 && test_free_bit(pfn, order);
+	}
+
+	/** Given a region, an order and a class, returns the lowest-addressed free block of that order on the
+	 * class's free list in the region, by scanning the free bitmap rather than relying on the free list being
+	 * kept sorted.
+	 * @param region The region to search.
+	 * @param order The order to search.
+	 * @param cls The class whose free list to search.
+	 * @return Returns the free block with the lowest pfn in region.free_areas[cls][order], or NULL if there is none
+	 */
+	PageDescriptor *lowest_free_block(Region& region, int order, int cls) {
+		uint64_t first_bit = region.start >> order;
+		uint64_t end_bit = (region.end + pages_in_block(order) - 1) >> order;
+
+		//no word below the class's hint has a block of the class in it, so start the scan there
+		for (uint64_t w = region.lowest_word_hint[cls][order]; w * 64 < end_bit; w++) {
+			uint64_t word = __atomic_load_n(&_free_bitmap[order][w], __ATOMIC_RELAXED);
+
+			//the bitmap covers every region and class, so skip the blocks in other regions, and in other classes'
+			//pageblocks
+			while (word) {
+				uint64_t bit = (w * 64) + __builtin_ctzll(word);
+				if (bit >= end_bit) break;
+
+				if (bit >= first_bit && class_of(bit << order) == cls) {
+					region.lowest_word_hint[cls][order] = w;
+					return sys.mm().pgalloc().pfn_to_pgd(bit << order);
+				}
+				word &= word - 1;
+			}
+		}
+
+		region.lowest_word_hint[cls][order] = (end_bit + 63) / 64;
+		return NULL;
+	}
+
 	/**
 	 * Given a pointer to a block of memory to be inserted into an order this function will
-	 * insert the block into a free list
+	 * push the block onto the head of that order's free list, for the class that owns the block's
+	 * pageblock, in the block's region.  The lists are not kept sorted, so this is O(1).
 	 * @param block_pointer A pointer to a pointer containing the beginning of a block of free memory.
 	 * @param next_order The order in which the insert the block to
 	 * @return Returns the area of free-list that is inserted
@@ -153,47 +583,61 @@ private:
 	PageDescriptor **insert_block(PageDescriptor *block_pgd, int next_order) {
 		//mm_log.messagef(LogLevel::INFO,"Buddy algo called to insert block %p in order %d", block_pgd, next_order);
 		//the buddy allocator maintains a list of free areas for each order, get that array for this particular order we are inserting into
-		PageDescriptor **area = &_free_areas[next_order];
-		//mm_log.messagef(LogLevel::DEBUG,"starting address in free_list: %p", *area);
+		pfn_t pfn = sys.mm().pgalloc().pgd_to_pfn(block_pgd);
+		Region& region = region_of(pfn);
+		PageDescriptor **area = &region.free_areas[class_of(pfn)][next_order];
 
-		//iterate till you find the pgd=free-area pointer and there is still free area left to search
-		while ((block_pgd > *area) && *area) {
-			//mm_log.messagef(LogLevel::DEBUG,"iterating through-freelist till we find the pgd=%p. Pointer of free-area, at: %p", block_pgd, *area);
-			//we cannot dynamically allocate memory, we need to update the pointer to free-area we are looking at
-			area = &(*area)->next_free;
+		//a block that is already the head of a free block is being freed twice
+		assert(!is_free_head(pfn));
+
+		//the old head now has the incoming block behind it
+		if (*area) {
+			_prev_free[sys.mm().pgalloc().pgd_to_pfn(*area)] = pfn;
 		}
 
-		//move the current pointer of free-area where we are gonna insert the incoming block to next block
 		block_pgd->next_free = *area;
+		_prev_free[pfn] = NO_PFN;
 		*area = block_pgd;
+
+		_free_order[pfn] = next_order;
+		update_free_bit(pfn, next_order, true);
+		region.nr_free_blocks[next_order]++;
 		//mm_log.messagef(LogLevel::INFO,"Inserted block into free_area list");
 		return area;
 	}
 
 	/**
-	 * Given a pointer to a block of free_memory, remove the block from that area
+	 * Given a pointer to a block of free_memory, unlink the block from that area using its back-link, in O(1)
 	 * @param block_pointer A pointer to a pointer containing the beginning of a block of free memory.
 	 * @param next_order The order in which the remove the block from
-	 * @return Returns the area of free-list that is removed
 	 */
 	void remove_block(PageDescriptor *block_pgd, int next_order) {
 		////mm_log.messagef(LogLevel::INFO,"Buddy algo called to remove block");
-		//the buddy allocator maintains a list of free areas for each order, get that array for this particular order we are inserting into
-		PageDescriptor **area = &_free_areas[next_order];
+		pfn_t pfn = sys.mm().pgalloc().pgd_to_pfn(block_pgd);
+		Region& region = region_of(pfn);
+
+		//make sure block exists in this order
+		assert(is_free_head(pfn) && _free_order[pfn] == next_order);
 
-		//iterate till you find the find block to remove in linked-list of _free_area
-		while ((block_pgd != *area) && *area) {
-			////mm_log.messagef(LogLevel::DEBUG,"iterating till we find the pgd=free-area pointer");
-			//we cannot dynamically allocate memory, we need to update the pointer to free-area we are looking at
-			area = &(*area)->next_free;
+		uint32_t prev_pfn = _prev_free[pfn];
+		PageDescriptor *next = block_pgd->next_free;
+
+		//point whatever was before us (the list head, or the previous block) to the block after us
+		if (prev_pfn == NO_PFN) {
+			assert(region.free_areas[class_of(pfn)][next_order] == block_pgd);
+			region.free_areas[class_of(pfn)][next_order] = next;
+		} else {
+			sys.mm().pgalloc().pfn_to_pgd(prev_pfn)->next_free = next;
 		}
 
-		//make sure block exists
-		assert(*area == block_pgd);
+		if (next) {
+			_prev_free[sys.mm().pgalloc().pgd_to_pfn(next)] = prev_pfn;
+		}
 
-		//remove the current page residing in that part of free-list, by pointing to the block_pointer->next_free that NULL/empty, so inverse insert_block
-		*area = block_pgd->next_free;
 		block_pgd->next_free = NULL;
+		_free_order[pfn] = NO_FREE_ORDER;
+		update_free_bit(pfn, next_order, false);
+		region.nr_free_blocks[next_order]--;
 		////mm_log.messagef(LogLevel::INFO,"Removed block from free_area");
 	}
 
@@ -215,11 +659,11 @@ private:
 		
 		//the two blocks, one will point to current block pointer address and next block will point to end of that block (in lower order)
 		int lower_order = source_order - 1;
-		uint64_t pages_lower_block = this->pages_in_block(lower_order);
 		PageDescriptor *block_one = *block_pointer;
 		PageDescriptor *block_two = this->buddy_of(block_one,lower_order);
 
 		//now remove the block in that order starting at pgd of block one, and add the two new blocks in the order below 
+		region_of(sys.mm().pgalloc().pgd_to_pfn(block_one)).nr_splits++;
 		this->remove_block(block_one, source_order);
 		this->insert_block(block_one, lower_order);
 		this->insert_block(block_two, lower_order);
@@ -252,6 +696,7 @@ private:
 		PageDescriptor *block_two = this->buddy_of(*block_pointer,source_order);
 
 		//remove the pages from source order
+		region_of(sys.mm().pgalloc().pgd_to_pfn(block_one)).nr_merges++;
 		this->remove_block(block_one,source_order);
 		this->remove_block(block_two,source_order);
 
@@ -267,36 +712,102 @@ private:
 		////mm_log.messagef(LogLevel::INFO,"Finished merging blocks");
 	}
 
+	/**
+	 * Given a region, an order and a class, returns the smallest order at or above it with a free block of that
+	 * class in the region.
+	 * @param region The region whose free lists to look at.
+	 * @param order The lowest order to look at.
+	 * @param cls The class whose free lists to look at.
+	 * @return Returns the order, or -1 if the class has no free block that large.
+	 */
+	int smallest_free_order(const Region& region, int order, int cls) const
+	{
+		for (int o = order; o <= MAX_ORDER; o++) {
+			if (region.free_areas[cls][o]) return o;
+		}
+		return -1;
+	}
+
+	/**
+	 * Given a region, an order and a class, returns the largest order at or above it with a free block of that
+	 * class in the region.
+	 * @param region The region whose free lists to look at.
+	 * @param order The lowest order to look at.
+	 * @param cls The class whose free lists to look at.
+	 * @return Returns the order, or -1 if the class has no free block that large.
+	 */
+	int largest_free_order(const Region& region, int order, int cls) const
+	{
+		for (int o = MAX_ORDER; o >= order; o--) {
+			if (region.free_areas[cls][o]) return o;
+		}
+		return -1;
+	}
+
+	/**
+	 * Finds a free block in a region for a class that has none large enough of its own there, by falling back
+	 * on another class.  The largest free block there is taken, and the whole pageblock holding it is claimed
+	 * for the class first, so the class's later allocations land there too rather than scattering across the
+	 * other class's pageblocks.  The caller must hold the region's lock.
+	 * @param region The region to look in.
+	 * @param order The order of the allocation.
+	 * @param cls The class of the allocation.
+	 * @return Returns the order of the block found, or -1 if no class has one large enough.
+	 */
+	int fallback_free_order(Region& region, int order, int cls)
+	{
+		for (int other = 0; other < NR_ALLOC_CLASSES; other++) {
+			if (other == cls) continue;
 
+			int o = largest_free_order(region, order, other);
+			if (o < 0) continue;
 
+			region.nr_fallbacks[cls]++;
+			claim_pageblock(sys.mm().pgalloc().pgd_to_pfn(region.free_areas[other][o]), cls);
+			return o;
+		}
+		return -1;
+	}
 
-public:
 	/**
-	 * Allocates 2^order number of contiguous pages
+	 * Takes a block of 2^order contiguous pages off a region's free lists, splitting a larger block if need be.
+	 * The block comes from the class's own pageblocks if it has a large enough free block, and from another
+	 * class's only if it does not and the caller allows it.  The caller must hold the region's lock.
+	 * @param region The region to allocate from.
 	 * @param order The power of two, of the number of contiguous pages to allocate.
-	 * @return Returns a pointer to the first page descriptor for the newly allocated page range, or NULL if
-	 * allocation failed.
+	 * @param cls The class of the allocation.
+	 * @param fallback Whether to fall back on another class's pageblocks.
+	 * @return Returns the first page descriptor of the block, or NULL if there is no free block large enough.
 	 */
-	PageDescriptor *allocate_pages(int order) override
+	PageDescriptor *allocate_block(Region& region, int order, int cls, bool fallback)
 	{
 		//mm_log.messagef(LogLevel::INFO,"Called to allocate pages");
-        int highest_order = order;
+		//an uncoalesced block of the right order needs no splitting at all
+		if (order < LAZY_ORDERS && region.lazy_blocks[cls][order]) {
+			return take_lazy_block(region, cls, order);
+		}
 
-		//iterate over each order above inputed order till you find a highest order that is not allocated (non-empty in free list)
+		//find the smallest order at or above the one asked for with a free block (non-empty free list)
 		//Remember: the caller does not care where in memory these pages are, just that the pages returned are
 		//contiguous.
-		while (highest_order <= MAX_ORDER && this->_free_areas[highest_order] == NULL) {
-			highest_order++;
+		int highest_order = smallest_free_order(region, order, cls);
+
+		//merging the uncoalesced blocks may make something large enough, and failing that another class may have it
+		if (highest_order < 0 && flush_all_lazy_blocks(region)) {
+			highest_order = smallest_free_order(region, order, cls);
+		}
+		if (highest_order < 0 && fallback) {
+			highest_order = fallback_free_order(region, order, cls);
 		}
 
-		//allocation failed, we reached the top most order
-		if (highest_order > MAX_ORDER) {
-			//mm_log.messagef(LogLevel::DEBUG,"allocation failed, we counted to high - there must be no suitable blocks free left!");
+		//allocation failed, there must be no suitable blocks free left
+		if (highest_order < 0) {
 			return NULL;
 		}
 
-		//we can allocated 2^order of contigous pages, point to that starting block
-		PageDescriptor *block = _free_areas[highest_order];
+		//we can allocated 2^order of contigous pages, point to that starting block - either the most recently freed
+		//block (the list head), or the lowest-addressed one if that placement policy was asked for
+		PageDescriptor *block = _lowest_address_first ? this->lowest_free_block(region, highest_order, cls) : region.free_areas[cls][highest_order];
 
 		//iteratively split blocks till target order is reached (binary buddy system - https://www.geeksforgeeks.org/operating-system-allocating-kernel-memory-buddy-system-slab-system/)
 		for (int i = highest_order; i > order; i--) {
@@ -305,19 +816,20 @@ public:
 		////mm_log.messagef(LogLevel::DEBUG,"Finished splitting blocks");
 
 		//remove the block of contigous pages from free-memory of that order as its been allocated (memory management core will update status to ALLOCATED)
-		this->remove_block(block, highest_order);
+		this->remove_block(block, order);
 		//mm_log.messagef(LogLevel::INFO,"Removed the block of contigous pages from free-memory");
 		//return the first pdg in this linked list of allocated blocks
 		return block;
 	}
 
-    /**
-	 * Frees 2^order contiguous pages.
-	 * @param pgd A pointer to an array of page descriptors to be freed.
-	 * @param order The power of two number of contiguous pages to free.
+	/**
+	 * Puts a block of 2^order contiguous pages back on the free lists, coalescing it with its buddies.
+	 * The caller must hold the lock of the block's region.
+	 * @param pgd The first page descriptor of the block.
+	 * @param order The power of two number of contiguous pages in the block.
 	 */
-    void free_pages(PageDescriptor *pgd, int order) override
-    {
+	void free_block(PageDescriptor *pgd, int order)
+	{
 		//mm_log.messagef(LogLevel::INFO,"Called to free pages");;
 		//assert that block is aligned with order
 		assert(this->is_aligned(pgd,order));
@@ -327,187 +839,1728 @@ public:
 		
 		//point to first pfn - first pdg to be freed
 		PageDescriptor **base = insert_block(pgd,order);
-		//get pointer to first buddy that could be free, pdg/base should not be in free list 
-		PageDescriptor *potential_buddy = this->_free_areas[order];
-		//get buddy of base
-		PageDescriptor *buddy_of_base = this->buddy_of(*base,order);
-
-		//iterate over potential buddies, start from current order and move up till MAX_ORDER
-		for (int curr_order = order; curr_order <= MAX_ORDER && potential_buddy; curr_order++){
-			if (buddy_of_base != potential_buddy) {  
-				//we can't find block's buddy at this pointer to free_area - area of free_list is not NULL
-				////mm_log.messagef(LogLevel::DEBUG,"we can't find block's buddy at this pointer to free_area, so moving onto the next block in current order");
-				//move onto the next block in current order
-				potential_buddy = potential_buddy->next_free;
-				//stay in same order
-				curr_order --;
-			}
-			else { 
-				//base's buddy is free, so we can merge to base
-				base = this->merge_block(base,curr_order);
-				//go to next order
-				potential_buddy = this->_free_areas[curr_order];
-				//new buddy of new base
-				buddy_of_base = this->buddy_of(*base,curr_order);
-				////mm_log.messagef(LogLevel::DEBUG,"base's buddy is free, so we can merge to base");
-			}
-		}
-		//mm_log.messagef(LogLevel::INFO,"Finished freeing pages");
-    }
 
-    /**
-     * Marks a range of pages as available for allocation -> put it back in _free_areas
-     * @param start A pointer to the first page descriptors to be made available.
-     * @param count The number of page descriptors to make available.
-     */
-    virtual void insert_page_range(PageDescriptor *start, uint64_t count) override
-    {
-        //replicate the logic of free_pages, but now you know start and how many pages to make available, not order of block if start is aligned with order
-		//mm_log.messagef(LogLevel::INFO, "Called to insert page range, with start pdg=%p and count=%lx", start, count);
-		
-		//get lowest order that could allocate count
-		int lowest_order = lowest_possible_order(start, count); 
-		uint64_t remaining_pgs = count;
-		PageDescriptor **base = insert_block(start, lowest_order);
- 
-		for (int curr_order = lowest_order; curr_order <= MAX_ORDER && remaining_pgs>0; curr_order++) {
-			PageDescriptor *buddy_of_base = this->buddy_of(*base,lowest_order);
-			//mm_log.messagef(LogLevel::DEBUG, "We start with base at=%p in free list and try to merge with base %p", base, buddy_of_base);
-			//we check to see if block's buddy is free
-			if (is_in_free(buddy_of_base, curr_order)) {
-				//base's buddy is free, so we can merge to base
-				base = this->merge_block(base,curr_order);
-				//decrease amount of pages left to be inserted
-				remaining_pgs = remaining_pgs - pages_in_block(curr_order);
-				//mm_log.messagef(LogLevel::DEBUG,"base's buddy is free, so we can merge to base");
-			} else {
-				//mm_log.messagef(LogLevel::DEBUG,"base's buddy is not free, so no more merging");
-				break; 
+		//keep merging upwards while the buddy of base is itself a free block of the current order - the
+		//free bitmap answers that in constant time, so each order costs O(1) rather than a walk of its free list
+		for (int curr_order = order; curr_order < MAX_ORDER; curr_order++) {
+			PageDescriptor *buddy_of_base = this->buddy_of(*base,curr_order);
+			if (!is_in_free(buddy_of_base, curr_order)) {
+				//buddy is (at least partly) allocated, so no more merging
+				break;
 			}
+
+			//base's buddy is free, so we can merge to base
+			base = this->merge_block(base,curr_order);
 		}
-		//mm_log.messagef(LogLevel::INFO,"Finished inserting page range");
+	}
 
-    }
+	/**
+	 * Frees a block that is coming back from use.  In lazy coalescing mode, low-order blocks are parked on the
+	 * uncoalesced lists instead of being merged, so a churn of frees and allocations at the same order costs no
+	 * merges and splits; the oldest are merged once an order has more than LAZY_HIGH of them.  Parked blocks are
+	 * kept per region and class, by the pageblock they lie in.  The caller must hold the lock of the block's
+	 * region.
+	 * @param pgd The first page descriptor of the block.
+	 * @param order The power of two number of contiguous pages in the block.
+	 */
+	void release_block(PageDescriptor *pgd, int order)
+	{
+		if (!_lazy_coalescing || order >= LAZY_ORDERS) {
+			free_block(pgd, order);
+			return;
+		}
 
-    /**
-     * Marks a range of pages as unavailable for allocation - take out of free_areas_
-     * @param start A pointer to the first page descriptors to be made unavailable.
-     * @param count The number of page descriptors to make unavailable.
-     */
-    virtual void remove_page_range(PageDescriptor *start, uint64_t count) override
-    {	
-		//mm_log.messagef(LogLevel::INFO,"Called to remove page range, with start pdg=%p and count=%lx", start, count);
-		
-		//get lowest order that could allocate count - to compensate not knowing order of pages to be allocated
-		int lowest_order = lowest_possible_order(start, count); 
-		int highest_order = lowest_order; 
-		//now count up to the highest order where the start page is available 
-		while (highest_order < MAX_ORDER && !is_in_free(start, highest_order)) {
-			highest_order++;
-		}
-
-		//we can allocate 2^order of contigous pages, point to that starting block in the free area
-		uint64_t can_allocate_max = pages_in_block(highest_order); 
-
-		//iterate over potential blocks, start from current higheat order and split down until blocksize goes below count  
-		for (int curr_order = highest_order; curr_order >= 0 && can_allocate_max >= count; curr_order--) {
-			//check alignment of start, if not aligned to start of its block we need to point to its 
-			start = split_block(&start, curr_order);
-			can_allocate_max = pages_in_block(curr_order);
-			//mm_log.messagef(LogLevel::DEBUG,"split the block starting at pdg: pdg=%p to order %d and we can remove pages=%lx", start, curr_order, pages_in_block(curr_order));
-			
-			//time to exit loop and remove block if next block in lower order can't allocate 
-			if (can_allocate_max <= count) {
-				//remove the block of contigous pages from free-memory of that order as its been allocated (memory management core will update status to ALLOCATED)
-				remove_block(start, curr_order);
-				break; 
-			}
+		assert(this->is_aligned(pgd, order));
+
+		pfn_t pfn = sys.mm().pgalloc().pgd_to_pfn(pgd);
+		Region& region = region_of(pfn);
+		int cls = class_of(pfn);
+
+		pgd->next_free = region.lazy_blocks[cls][order];
+		region.lazy_blocks[cls][order] = pgd;
+		if (++region.nr_lazy_blocks[cls][order] > LAZY_HIGH) {
+			flush_lazy_blocks(region, cls, order, LAZY_HIGH / 2);
 		}
-		//mm_log.messagef(LogLevel::INFO,"Finished removing page range");
-		
-    }
+	}
 
 	/**
-	 * Initialises the allocation algorithm.
-	 * @return Returns TRUE if the algorithm was successfully initialised, FALSE otherwise.
+	 * Takes the most recently freed uncoalesced block of the given class and order in a region.  The caller must
+	 * hold the region's lock.
+	 * @param region The region to take the block from.
+	 * @param cls The class of the block.
+	 * @param order The order of the block, which must have one.
+	 * @return Returns the block.
 	 */
-	bool init(PageDescriptor *page_descriptors, uint64_t nr_page_descriptors) override
+	PageDescriptor *take_lazy_block(Region& region, int cls, int order)
 	{
-        //mm_log.messagef(LogLevel::INFO, "Buddy Allocator Initialising pgd=%p, nr_pgds=0x%lx", page_descriptors, nr_page_descriptors);
-		
-		//the nth pgd we have initialised
-		uint64_t remaining_pgs = nr_page_descriptors;
-		PageDescriptor *pgds = page_descriptors;
-
-		for (int curr_order = MAX_ORDER; curr_order >= 0 && remaining_pgs >= 0; curr_order--) {
-			int block_counter = 0;
-			//check if the blocksize for current order can hold atleast one block of remaining pgs to initialise:
-			uint64_t curr_blocksize = pages_in_block(curr_order);
-
-			if (remaining_pgs >= curr_blocksize) {
-				//_free_areas[curr_order] = pgds;
-
-				while (remaining_pgs >= curr_blocksize) {
-					//mm_log.messagef(LogLevel::INFO, "We have can fit some remaining pgds: 0x%lx in order %d", remaining_pgs, curr_order);
-					block_counter++;
-					//move to next block of this order in free list and in pgds 
-					pgds->next_free = pgds + curr_blocksize;
-					pgds = pgds->next_free;
-					//decrease amount of pages left to be initialised by one block at current order
-					remaining_pgs = remaining_pgs - curr_blocksize;
-				}
-			}
-			//mm_log.messagef(LogLevel::INFO, "Finished initialising blocks %d for order %d and now have remaining pgds: 0x%lx", block_counter, curr_order, remaining_pgs);
-			//end 
-			pgds->next_free = NULL;
+		PageDescriptor *block = region.lazy_blocks[cls][order];
+
+		region.lazy_blocks[cls][order] = block->next_free;
+		region.nr_lazy_blocks[cls][order]--;
+		block->next_free = NULL;
+		return block;
+	}
+
+	/**
+	 * Merges a region's uncoalesced blocks of the given class and order back into the free lists, keeping the
+	 * most recently freed ones.  The caller must hold the region's lock.
+	 * @param region The region of the blocks.
+	 * @param cls The class of the blocks.
+	 * @param order The order of the blocks.
+	 * @param keep The number of blocks to leave uncoalesced.
+	 */
+	void flush_lazy_blocks(Region& region, int cls, int order, unsigned int keep)
+	{
+		if (region.nr_lazy_blocks[cls][order] <= keep) return;
+
+		PageDescriptor **tail = &region.lazy_blocks[cls][order];
+		for (unsigned int i = 0; i < keep; i++) {
+			tail = &(*tail)->next_free;
 		}
-		
-		if (remaining_pgs > 0) {
-			////mm_log.messagef(LogLevel::INFO, "We didn't handle 0x%lx pages ", remaining_pgs);
-			return false;
+
+		PageDescriptor *block = *tail;
+		*tail = NULL;
+		region.nr_lazy_blocks[cls][order] = keep;
+		region.nr_lazy_flushes++;
+
+		while (block) {
+			PageDescriptor *next = block->next_free;
+			block->next_free = NULL;
+			free_block(block, order);
+			block = next;
 		}
-		else {
-			//mm_log.messagef(LogLevel::INFO, "Succesfully finished allocator->init");
-			return true;
+	}
+
+	/**
+	 * Merges every uncoalesced block in a region back into the free lists, e.g. because a larger allocation
+	 * would fail without them.  The caller must hold the region's lock.
+	 * @param region The region to flush.
+	 * @return Returns TRUE if there were any blocks to merge.
+	 */
+	bool flush_all_lazy_blocks(Region& region)
+	{
+		bool flushed = false;
+
+		for (int cls = 0; cls < NR_ALLOC_CLASSES; cls++) {
+			for (int order = 0; order < LAZY_ORDERS; order++) {
+				if (region.nr_lazy_blocks[cls][order]) {
+					flush_lazy_blocks(region, cls, order, 0);
+					flushed = true;
+				}
+			}
 		}
-		
+		return flushed;
 	}
 
 	/**
-	 * Returns the friendly name of the allocation algorithm, for INFOging and selection purposes.
+	 * Frees a range of contiguous pages as the largest aligned blocks that tile it, coalescing each of them with
+	 * any free neighbours outside the range.  None of the tiling blocks are buddies of each other (two buddies
+	 * would have been one larger aligned block), so no merging happens inside the range.  Blocks of the range
+	 * that lie in free memory already are skipped, but the range must not partly overlap a smaller free block.
+	 * The range must lie in one region, and the caller must hold its lock.
+	 * @param pfn The first page of the range.
+	 * @param count The number of pages in the range.
 	 */
-	const char* name() const override { return "buddy"; }
+	void free_range(pfn_t pfn, uint64_t count)
+	{
+		while (count > 0) {
+			int order = largest_aligned_order(pfn, count);
+
+			//a block that is already free (e.g. a range inserted twice) is left where it is
+			if (containing_free_order(pfn, order) < 0) {
+				free_block(sys.mm().pgalloc().pfn_to_pgd(pfn), order);
+			}
+			pfn += pages_in_block(order);
+			count -= pages_in_block(order);
+		}
+	}
 
 	/**
-	 * Dumps out the current state of the buddy system
+	 * Takes every free block of up to the given order that lies inside a block off the free lists, found by
+	 * scanning the bitmaps of those orders over the block - one word per 64 blocks of each order.  The caller
+	 * must hold the lock of the block's region.
+	 * @param pfn The first page of the block to look in.
+	 * @param order The order of the block to look in.
+	 * @param top_order The largest order of free block to take.
+	 * @return Returns the blocks taken, chained through next_free, each with its order left in its order tag.
 	 */
-	void dump_state() const override
+	PageDescriptor *take_free_blocks_in(pfn_t pfn, int order, int top_order)
 	{
-		// Print out a header, so we can find the output in the logs.
-		mm_log.messagef(LogLevel::DEBUG, "BUDDY STATE:");
+		PageDescriptor *taken = NULL;
 
-		// Iterate over each free area.
-		for (unsigned int i = 0; i < ARRAY_SIZE(_free_areas); i++) {
-			char buffer[256];
-			snprintf(buffer, sizeof(buffer), "[%d] ", i);
+		for (int o = top_order; o >= 0; o--) {
+			uint64_t bit = pfn >> o;
+			uint64_t end = (pfn + pages_in_block(order)) >> o;
+			if (end > bits_in_bitmap(o)) end = bits_in_bitmap(o);
 
-			// Iterate over each block in the free area.
-			PageDescriptor *pg = _free_areas[i];
-			while (pg) {
-				// Append the PFN of the free block to the output buffer.
-				snprintf(buffer, sizeof(buffer), "%s%lx ", buffer, sys.mm().pgalloc().pgd_to_pfn(pg));
-				pg = pg->next_free;
-			}
+			while (bit < end) {
+				uint64_t word = _free_bitmap[o][bit / 64] >> (bit % 64);
+				if (!word) {
+					bit = (bit | 63) + 1;
+					continue;
+				}
 
-			mm_log.messagef(LogLevel::DEBUG, "%s", buffer);
+				bit += __builtin_ctzll(word);
+				if (bit >= end) break;
+
+				PageDescriptor *block = sys.mm().pgalloc().pfn_to_pgd(bit << o);
+				remove_block(block, o);
+
+				//the tag is no longer believed once the bitmap bit is clear, so it can carry the order for the caller
+				_free_order[bit << o] = o;
+				block->next_free = taken;
+				taken = block;
+				bit++;
+			}
 		}
+		return taken;
 	}
 
-
+	/**
+	 * Hands the pageblock holding a pfn to a class, moving all of the pageblock's free blocks onto that
+	 * class's free lists.  The caller must hold the lock of the pageblock's region.
+	 * @param pfn A page in the pageblock.
+	 * @param cls The class that now owns the pageblock.
+	 */
+	void claim_pageblock(pfn_t pfn, int cls)
+	{
+		pfn_t start = pfn & ~(pages_in_block(MAX_ORDER) - 1);
+		if (class_of(start) == cls) return;
+
+		PageDescriptor *block = take_free_blocks_in(start, MAX_ORDER, MAX_ORDER);
+		_pageblock_class[start >> MAX_ORDER] = cls;
+		region_of(start).nr_pageblock_claims++;
+
+		while (block) {
+			PageDescriptor *next = block->next_free;
+			insert_block(block, _free_order[sys.mm().pgalloc().pgd_to_pfn(block)]);
+			block = next;
+		}
+	}
+
+	/**
+	 * Takes a block of pages that lies somewhere inside free memory off the free lists.  The free block holding
+	 * it is found through the bitmaps, and split down to it by putting back the halves that do not hold it - so
+	 * this is O(MAX_ORDER), wherever in a larger free block it sits.  If the block is not wholly inside one free
+	 * block, any smaller free blocks inside it are found by scanning the bitmaps of the lower orders over it, and
+	 * taken instead.  The caller must hold the lock of the block's region.
+	 * @param pfn The first page of the block.
+	 * @param order The order of the block.
+	 */
+	void claim_block(pfn_t pfn, int order)
+	{
+		int free_order = containing_free_order(pfn, order);
+		if (free_order < 0) {
+			PageDescriptor *block = take_free_blocks_in(pfn, order, order - 1);
+			while (block) {
+				PageDescriptor *next = block->next_free;
+				block->next_free = NULL;
+				block = next;
+			}
+			return;
+		}
+
+		pfn_t head = pfn & ~(pages_in_block(free_order) - 1);
+		remove_block(sys.mm().pgalloc().pfn_to_pgd(head), free_order);
+
+		//walk down towards the block, freeing the half we are not heading into at each order
+		for (int o = free_order; o > order; o--) {
+			uint64_t half = pages_in_block(o - 1);
+			if (pfn & half) {
+				insert_block(sys.mm().pgalloc().pfn_to_pgd(head), o - 1);
+				head += half;
+			} else {
+				insert_block(sys.mm().pgalloc().pfn_to_pgd(head + half), o - 1);
+			}
+			region_of(pfn).nr_splits++;
+		}
+	}
+
+	/**
+	 * Puts the unused tail of a block that has just been taken off the free lists back on them, as the largest
+	 * aligned blocks that tile it.  Nothing is merged: each of those blocks has its buddy either elsewhere in
+	 * the tail (two buddies would have been one larger block) or in the part of the block that is in use, and
+	 * the block's own buddy was not free.  The caller must hold the lock of the block's region.
+	 * @param pfn The first page of the tail.
+	 * @param count The number of pages in the tail, which must end at the end of the block.
+	 */
+	void insert_tail(pfn_t pfn, uint64_t count)
+	{
+		while (count > 0) {
+			int order = largest_aligned_order(pfn, count);
+
+			this->insert_block(sys.mm().pgalloc().pfn_to_pgd(pfn), order);
+			pfn += pages_in_block(order);
+			count -= pages_in_block(order);
+		}
+	}
+
+	/**
+	 * Allocates a block of the given order, and puts the pages after the first count straight back on the free
+	 * lists - for exact allocations, and contiguous ranges that fit in a max-order block.
+	 * @param count The number of pages to keep, at most the size of the block.
+	 * @param order The order of the block, which sets the alignment of the pages.
+	 * @param alloc_class The lifetime class of the allocation.
+	 * @return Returns the first page descriptor of the pages, or NULL if allocation failed, or the order is out
+	 * of range.
+	 */
+	PageDescriptor *allocate_trimmed_block(uint64_t count, int order, BuddyAllocClass alloc_class)
+	{
+		if (order < 0 || order > MAX_ORDER) return NULL;
+
+		PageDescriptor *block = allocate_from_regions(order, group_class(alloc_class));
+		if (!block) {
+			count_failed_alloc(order);
+			trace(TRACE_ALLOC_EXACT, NO_PFN, count, alloc_class);
+			return NULL;
+		}
+
+		//the block is ours now, so nobody else touches it between the two times its region is locked
+		pfn_t pfn = sys.mm().pgalloc().pgd_to_pfn(block);
+		Region& region = region_of(pfn);
+		UniqueRegionLock rl(region);
+
+		uint64_t tail_pages = pages_in_block(order) - count;
+		insert_tail(pfn + count, tail_pages);
+
+		region.nr_exact_allocs++;
+		region.nr_exact_pages_saved += tail_pages;
+		region.nr_exact_pages_live_saved += tail_pages;
+
+		trace(TRACE_ALLOC_EXACT, pfn, count, alloc_class);
+		return block;
+	}
+
+	/**
+	 * Frees pages allocated with allocate_trimmed_block.  They go back as the largest aligned blocks that tile
+	 * them, each coalescing with its free neighbours.
+	 * @param pgd The first page descriptor of the pages.
+	 * @param count The number of pages kept.
+	 * @param order The order of the block they were kept from.
+	 */
+	void free_trimmed_block(PageDescriptor *pgd, uint64_t count, int order)
+	{
+		//the pages lie in one block, so in one region
+		pfn_t pfn = sys.mm().pgalloc().pgd_to_pfn(pgd);
+		Region& region = region_of(pfn);
+
+		trace(TRACE_FREE_EXACT, pfn, count);
+
+		UniqueRegionLock rl(region);
+
+		free_range(pfn, count);
+		region.nr_exact_pages_live_saved -= pages_in_block(order) - count;
+	}
+
+	/**
+	 * Allocates up to n blocks of 2^order pages from a region, by taking one large free block and carving it into
+	 * pieces rather than splitting down from the top once per block.  The caller must hold the region's lock.
+	 * @param region The region to allocate from.
+	 * @param order The order of the blocks to allocate.
+	 * @param n The number of blocks wanted.
+	 * @param out An array of at least n entries that receives the blocks.
+	 * @param cls The class of the allocation.
+	 * @param fallback Whether to fall back on another class's pageblocks.
+	 * @return Returns the number of blocks allocated, which is less than n only if the region ran out.
+	 */
+	unsigned int allocate_blocks(Region& region, int order, unsigned int n, PageDescriptor **out, int cls, bool fallback)
+	{
+		unsigned int allocated = 0;
+
+		//uncoalesced blocks of the right order first, as they need no splitting
+		while (allocated < n && order < LAZY_ORDERS && region.lazy_blocks[cls][order]) {
+			out[allocated++] = take_lazy_block(region, cls, order);
+		}
+
+		while (allocated < n) {
+			//the ideal block to carve is the smallest one that holds everything still wanted
+			int carve_order = order + order_for_pages(n - allocated);
+			if (carve_order > MAX_ORDER) carve_order = MAX_ORDER;
+
+			//take a free block of the class of at least that order (splitting a larger one down to it), or failing
+			//that the largest free block the class has
+			int source_order = smallest_free_order(region, carve_order, cls);
+			if (source_order < 0) {
+				source_order = largest_free_order(region, order, cls);
+			}
+
+			//nothing of at least the requested order is free, unless merging the uncoalesced blocks helps, or
+			//another class has something
+			if (source_order < 0) {
+				if (flush_all_lazy_blocks(region)) continue;
+				if (!fallback) break;
+
+				source_order = fallback_free_order(region, order, cls);
+				if (source_order < 0) break;
+			}
+
+			if (source_order < carve_order) carve_order = source_order;
+
+			PageDescriptor *block = _lowest_address_first ? this->lowest_free_block(region, source_order, cls) : region.free_areas[cls][source_order];
+			for (int i = source_order; i > carve_order; i--) {
+				block = this->split_block(&block, i);
+			}
+			this->remove_block(block, carve_order);
+
+			//hand out pieces from the front of the carved block
+			uint64_t pieces = pages_in_block(carve_order - order);
+			uint64_t used = 0;
+			while (used < pieces && allocated < n) {
+				out[allocated++] = block + (used << order);
+				used++;
+			}
+
+			//the unused tail can go straight back on the free lists - it cannot merge with anything, because the
+			//carved block's own buddy was not free
+			if (used < pieces) {
+				insert_tail(sys.mm().pgalloc().pgd_to_pfn(block) + (used << order), (pieces - used) << order);
+			}
+		}
+
+		return allocated;
+	}
+
+	/**
+	 * Takes a block of 2^order pages from whichever region can supply one, starting with this CPU's home
+	 * region, so CPUs allocating at the same time mostly take different locks.  Every region is tried for a
+	 * block of the class's own before any falls back on another class's pageblocks.  Only one region's lock is
+	 * held at a time.
+	 * @param order The order of the block.
+	 * @param cls The class of the allocation.
+	 * @return Returns the first page descriptor of the block, or NULL if no region has a free block large enough.
+	 */
+	PageDescriptor *allocate_from_regions(int order, int cls)
+	{
+		unsigned int home = current_cpu_id() % _nr_regions;
+
+		for (int fallback = 0; fallback <= 1; fallback++) {
+			for (unsigned int i = 0; i < _nr_regions; i++) {
+				Region& region = _regions[(home + i) % _nr_regions];
+				if (!__atomic_load_n(&region.populated, __ATOMIC_ACQUIRE)) continue;
+
+				UniqueRegionLock l(region);
+				PageDescriptor *block = allocate_block(region, order, cls, fallback);
+				if (block) return block;
+			}
+		}
+		return NULL;
+	}
+
+	/**
+	 * Allocates up to n blocks of 2^order pages from as few regions as possible, starting with this CPU's home
+	 * region, in the same way as allocate_from_regions.
+	 * @param order The order of the blocks to allocate.
+	 * @param n The number of blocks wanted.
+	 * @param out An array of at least n entries that receives the blocks.
+	 * @param cls The class of the allocation.
+	 * @return Returns the number of blocks allocated, which is less than n only if memory ran out.
+	 */
+	unsigned int allocate_blocks_from_regions(int order, unsigned int n, PageDescriptor **out, int cls)
+	{
+		unsigned int home = current_cpu_id() % _nr_regions;
+		unsigned int allocated = 0;
+
+		for (int fallback = 0; fallback <= 1; fallback++) {
+			for (unsigned int i = 0; i < _nr_regions && allocated < n; i++) {
+				Region& region = _regions[(home + i) % _nr_regions];
+				if (!__atomic_load_n(&region.populated, __ATOMIC_ACQUIRE)) continue;
+
+				UniqueRegionLock l(region);
+				allocated += allocate_blocks(region, order, n - allocated, out + allocated, cls, fallback);
+			}
+		}
+		return allocated;
+	}
+
+	/**
+	 * Runs a function over a range of pages one region at a time, holding each region's lock while it works on
+	 * the part of the range in that region.
+	 * @param pfn The first page of the range.
+	 * @param count The number of pages in the range.
+	 * @param fn Called with the region, and the first page and number of pages of each part of the range.
+	 */
+	template<typename F>
+	void for_each_region_in_range(pfn_t pfn, uint64_t count, F fn)
+	{
+		while (count > 0) {
+			Region& region = region_of(pfn);
+			uint64_t part = region.end - pfn;
+			if (part > count) part = count;
+
+			{
+				UniqueRegionLock l(region);
+				fn(region, pfn, part);
+			}
+
+			pfn += part;
+			count -= part;
+		}
+	}
+
+	/**
+	 * Runs a function over the parts of a range of pages that lie outside the allocator's metadata - the whole
+	 * range, or the parts either side of the metadata.
+	 * @param pfn The first page of the range.
+	 * @param count The number of pages in the range.
+	 * @param fn Called with the first page and number of pages of each part.
+	 * @return Returns TRUE if the range overlapped the metadata, so some of it was left out.
+	 */
+	template<typename F>
+	bool for_each_part_outside_metadata(pfn_t pfn, uint64_t count, F fn)
+	{
+		pfn_t end = pfn + count, metadata_end = _metadata_start + _nr_metadata_pages;
+
+		if (end <= _metadata_start || pfn >= metadata_end) {
+			fn(pfn, count);
+			return false;
+		}
+
+		if (pfn < _metadata_start) fn(pfn, _metadata_start - pfn);
+		if (end > metadata_end) fn(metadata_end, end - metadata_end);
+		return true;
+	}
+
+	/**
+	 * Sorts an array of page descriptors into pfn order, in place (heapsort, so no recursion and no extra memory).
+	 * @param pgds The array to sort.
+	 * @param n The number of entries.
+	 */
+	static void sort_by_pfn(PageDescriptor **pgds, unsigned int n)
+	{
+		//the descriptors live in one array, so their addresses are in pfn order
+		auto sift_down = [pgds](unsigned int root, unsigned int end) {
+			while ((root * 2) + 1 < end) {
+				unsigned int child = (root * 2) + 1;
+				if (child + 1 < end && pgds[child] < pgds[child + 1]) child++;
+				if (!(pgds[root] < pgds[child])) return;
+
+				PageDescriptor *tmp = pgds[root];
+				pgds[root] = pgds[child];
+				pgds[child] = tmp;
+				root = child;
+			}
+		};
+
+		for (unsigned int i = n / 2; i > 0; i--) {
+			sift_down(i - 1, n);
+		}
+
+		for (unsigned int end = n; end > 1; end--) {
+			PageDescriptor *tmp = pgds[0];
+			pgds[0] = pgds[end - 1];
+			pgds[end - 1] = tmp;
+			sift_down(0, end - 1);
+		}
+	}
+
+	/**
+	 * Per-CPU cache of recently freed blocks of the lowest orders (kept per class), used without taking a region's
+	 * lock.  Its own lock is only ever wanted by another CPU to drain it (see drain_all_page_caches), so on the
+	 * fast path it is always free, and its cache line is already this CPU's.
+	 */
+	struct PerCPUPageCache {
+		RawSpinLock lock;
+
+		PageDescriptor *blocks[NR_ALLOC_CLASSES][PCP_ORDERS];
+		unsigned int count[NR_ALLOC_CLASSES][PCP_ORDERS];
+
+		uint64_t hits[PCP_ORDERS];
+		uint64_t misses[PCP_ORDERS];
+		uint64_t drains[PCP_ORDERS];
+	} __aligned(64);
+
+	/**
+	 * Moves a batch of blocks of the given class and order from the free lists into a per-CPU page cache, taking
+	 * a region's lock once (unless the CPU's home region has run out).
+	 * @param pcp The page cache to refill.
+	 * @param cls The class of the blocks to move.
+	 * @param order The order of the blocks to move.
+	 */
+	void refill_page_cache(PerCPUPageCache& pcp, int cls, int order)
+	{
+		PageDescriptor *blocks[PCP_BATCH];
+		unsigned int nr_blocks = allocate_blocks_from_regions(order, PCP_BATCH, blocks, cls);
+
+		//push in reverse, so the cache hands the blocks out in address order
+		for (unsigned int i = nr_blocks; i > 0; i--) {
+			blocks[i - 1]->next_free = pcp.blocks[cls][order];
+			pcp.blocks[cls][order] = blocks[i - 1];
+			pcp.count[cls][order]++;
+		}
+	}
+
+	/**
+	 * Gives blocks of the given class and order from a per-CPU page cache back to the free lists, taking each
+	 * region's lock once for all of its blocks.  The most recently freed (cache hot) blocks at the front of the
+	 * cache are kept.
+	 * @param pcp The page cache to drain.
+	 * @param cls The class of the blocks to move.
+	 * @param order The order of the blocks to move.
+	 * @param keep The number of blocks to leave in the cache.
+	 */
+	void drain_page_cache(PerCPUPageCache& pcp, int cls, int order, unsigned int keep)
+	{
+		if (pcp.count[cls][order] <= keep) return;
+
+		//find the link after the ones we are keeping, and cut the rest of the cache off there
+		PageDescriptor **tail = &pcp.blocks[cls][order];
+		for (unsigned int i = 0; i < keep; i++) {
+			tail = &(*tail)->next_free;
+		}
+
+		PageDescriptor *block = *tail;
+		*tail = NULL;
+		pcp.count[cls][order] = keep;
+		pcp.drains[order]++;
+
+		//a CPU mostly frees what it allocated from its home region, so this is usually one pass - blocks from
+		//other regions are set aside for the next pass, under their own region's lock
+		while (block) {
+			Region& region = region_of(sys.mm().pgalloc().pgd_to_pfn(block));
+			PageDescriptor *elsewhere = NULL;
+
+			UniqueRegionLock l(region);
+			while (block) {
+				PageDescriptor *next = block->next_free;
+				if (&region_of(sys.mm().pgalloc().pgd_to_pfn(block)) == &region) {
+					block->next_free = NULL;
+					release_block(block, order);
+				} else {
+					block->next_free = elsewhere;
+					elsewhere = block;
+				}
+				block = next;
+			}
+			block = elsewhere;
+		}
+	}
+
+	/**
+	 * Gives every block in every per-CPU page cache back to the free lists, so the free lists describe all free
+	 * memory.  Each cache is drained under its own lock, which its CPU's fast path also takes, so other CPUs can
+	 * carry on allocating meanwhile - they just can't be refilling or draining the cache that is being emptied.
+	 */
+	void drain_all_page_caches()
+	{
+		for (unsigned int cpu = 0; cpu < MAX_CPUS; cpu++) {
+			//with interrupts off, as an interrupt handler on this CPU could want this CPU's cache
+			UniqueIRQLock l;
+			UniqueRawSpinLock pl(_pcp[cpu].lock);
+
+			for (int cls = 0; cls < NR_ALLOC_CLASSES; cls++) {
+				for (int order = 0; order < PCP_ORDERS; order++) {
+					drain_page_cache(_pcp[cpu], cls, order, 0);
+				}
+			}
+		}
+	}
+
+	/**
+	 * Counts an allocation of the given order that could not be satisfied.  Allocations do not all hold the same
+	 * lock (if any), so the counters are updated atomically.
+	 * @param order The order of the failed allocation.
+	 */
+	void count_failed_alloc(int order)
+	{
+		__atomic_fetch_add(&_nr_failed_allocs[order], 1, __ATOMIC_RELAXED);
+	}
+
+	/**
+	 * Allocates 2^order contiguous pages of the given class, without counting a failure or tracing it.  The lowest
+	 * orders are served from this CPU's page cache when it can, which takes no shared lock; the cache is refilled in
+	 * batches when it runs low.
+	 * @param order The power of two, of the number of contiguous pages to allocate.
+	 * @param cls The class to allocate from, i.e. after grouping.
+	 * @return Returns the first page descriptor of the block, or NULL if allocation failed.
+	 */
+	PageDescriptor *take_pages(int order, int cls)
+	{
+		if (order < PCP_ORDERS) {
+			UniqueIRQLock l;
+			PerCPUPageCache& pcp = _pcp[current_cpu_id()];
+			UniqueRawSpinLock pl(pcp.lock);
+
+			if (pcp.count[cls][order] <= PCP_LOW) {
+				pcp.misses[order]++;
+				refill_page_cache(pcp, cls, order);
+			} else {
+				pcp.hits[order]++;
+			}
+
+			PageDescriptor *block = pcp.blocks[cls][order];
+			if (!block) return NULL;
+
+			pcp.blocks[cls][order] = block->next_free;
+			pcp.count[cls][order]--;
+			block->next_free = NULL;
+			return block;
+		}
+
+		return allocate_from_regions(order, cls);
+	}
+
+	/**
+	 * Frees 2^order contiguous pages, without tracing it.  The lowest orders go into this CPU's page cache (for the
+	 * class that owns the pages' pageblock), and are only given back to the free lists (and coalesced) in batches
+	 * once the cache is above its high watermark.
+	 * @param pgd A pointer to an array of page descriptors to be freed.
+	 * @param order The power of two number of contiguous pages to free.
+	 */
+	void give_pages(PageDescriptor *pgd, int order)
+	{
+		if (order < PCP_ORDERS) {
+			assert(this->is_aligned(pgd,order));
+
+			UniqueIRQLock l;
+			PerCPUPageCache& pcp = _pcp[current_cpu_id()];
+			UniqueRawSpinLock pl(pcp.lock);
+			int cls = class_of(sys.mm().pgalloc().pgd_to_pfn(pgd));
+
+			pgd->next_free = pcp.blocks[cls][order];
+			pcp.blocks[cls][order] = pgd;
+			pcp.count[cls][order]++;
+
+			if (pcp.count[cls][order] > PCP_HIGH) {
+				drain_page_cache(pcp, cls, order, PCP_HIGH - PCP_BATCH);
+			}
+			return;
+		}
+
+		UniqueRegionLock rl(region_of(sys.mm().pgalloc().pgd_to_pfn(pgd)));
+		release_block(pgd, order);
+	}
+
+	/**
+	 * Takes the locks of a run of regions, lowest first - every other CPU holds at most one region lock at a time,
+	 * so taking several in order cannot deadlock.  The caller must have interrupts off until they are unlocked.
+	 * @param first The index of the first region.
+	 * @param last The index of the last region.
+	 */
+	void lock_regions(unsigned int first, unsigned int last)
+	{
+		for (unsigned int r = first; r <= last; r++) {
+			if (!_regions[r].lock.try_lock()) {
+				_regions[r].lock.lock();
+				_regions[r].nr_contentions++;
+			}
+		}
+	}
+
+	void unlock_regions(unsigned int first, unsigned int last)
+	{
+		for (unsigned int r = last + 1; r > first; r--) {
+			_regions[r - 1].lock.unlock();
+		}
+	}
+
+	/**
+	 * Finds a run of free max-order blocks, by probing the max-order free bitmap from a starting block - a probe
+	 * that fails skips the run past the block that was not free, so this is O(number of max-order blocks), however
+	 * many pages they hold.  The bitmap is read without any lock, so the run is only a candidate until the regions
+	 * it is in are locked, and it has been checked again.
+	 * @param from The first max-order block (i.e. pfn >> MAX_ORDER) the run may start at.
+	 * @param nr_blocks The number of blocks in the run.
+	 * @param align_blocks The run must start at a multiple of this many blocks, a power of two.
+	 * @return Returns the first block of the run, or NO_PFN if there is none from there on.
+	 */
+	uint64_t find_free_run(uint64_t from, uint64_t nr_blocks, uint64_t align_blocks) const
+	{
+		uint64_t end = _nr_page_descriptors >> MAX_ORDER;
+		uint64_t start = (from + align_blocks - 1) & ~(align_blocks - 1);
+
+		while (start + nr_blocks <= end) {
+			uint64_t busy = NO_PFN;
+			for (uint64_t b = start + nr_blocks; b > start; b--) {
+				//probing from the end means a failure skips as far as it can
+				if (!test_free_bit((b - 1) << MAX_ORDER, MAX_ORDER)) {
+					busy = b - 1;
+					break;
+				}
+			}
+			if (busy == NO_PFN) return start;
+
+			start = (busy + align_blocks) & ~(align_blocks - 1);
+		}
+		return NO_PFN;
+	}
+
+	/**
+	 * Claims a run of free max-order blocks found by find_free_run, if it is still free, handing the pageblocks
+	 * to the given class.  The caller must hold the locks of every region the run is in.
+	 * @param first The first block of the run.
+	 * @param nr_blocks The number of blocks in the run.
+	 * @param cls The class that now owns the run's pageblocks.
+	 * @return Returns TRUE if the run was claimed, FALSE if another CPU took part of it first.
+	 */
+	bool claim_free_run(uint64_t first, uint64_t nr_blocks, int cls)
+	{
+		for (uint64_t b = first; b < first + nr_blocks; b++) {
+			if (!test_free_bit(b << MAX_ORDER, MAX_ORDER)) return false;
+		}
+
+		for (uint64_t b = first; b < first + nr_blocks; b++) {
+			remove_block(sys.mm().pgalloc().pfn_to_pgd(b << MAX_ORDER), MAX_ORDER);
+			_pageblock_class[b] = cls;
+		}
+		return true;
+	}
+
+	/**
+	 * Records an event in the trace ring, if tracing is on, overwriting the oldest record once the ring is full.
+	 * Callers record an allocation after the block is taken, and a free before it is given back, so the records
+	 * are in an order the events could have happened in, whichever CPUs they happened on.
+	 * @param event The event.
+	 * @param pfn The first page of the block or range.
+	 * @param arg The order of the block, or the number of pages (at most TRACE_MAX_COUNT).
+	 * @param cls The lifetime class the allocation asked for.
+	 */
+	void trace(BuddyTraceEvent event, pfn_t pfn, uint64_t arg, int cls = ALLOC_PINNED)
+	{
+		if (!_trace) return;
+
+		uint64_t index = __atomic_fetch_add(&_trace_head, 1, __ATOMIC_RELAXED);
+		BuddyTraceRecord& record = _trace[index & _trace_mask];
+
+		//empty the record while it is filled in, so a dump reading it meanwhile sees it change (see read_trace_record)
+		__atomic_store_n(&record.info, 0, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_RELEASE);
+
+		__atomic_store_n(&record.tsc, read_tsc(), __ATOMIC_RELAXED);
+		__atomic_store_n(&record.pfn, (uint32_t)pfn, __ATOMIC_RELAXED);
+		__atomic_store_n(&record.info, event | ((current_cpu_id() & 0xf) << 4) | ((cls & 1) << 8) |
+			(((index >> _trace_bits) & 7) << 9) | ((uint32_t)arg << 12), __ATOMIC_RELEASE);
+	}
+
+	/**
+	 * Records an event covering a range of pages, as as many records as it takes.
+	 * @param event The event.
+	 * @param pfn The first page of the range.
+	 * @param count The number of pages in the range.
+	 */
+	void trace_range(BuddyTraceEvent event, pfn_t pfn, uint64_t count)
+	{
+		if (!_trace) return;
+
+		while (count > 0) {
+			uint64_t pages = count < TRACE_MAX_COUNT ? count : TRACE_MAX_COUNT;
+			trace(event, pfn, pages);
+
+			pfn += pages;
+			count -= pages;
+		}
+	}
+
+	/**
+	 * Records a contiguous range allocation, as a TRACE_ALLOC_CONTIG record and as many TRACE_CONTIG_MORE records
+	 * as the rest of the range takes.  The caller holds a UniqueIRQLock, so the records of one range follow each
+	 * other on this CPU.
+	 * @param pfn The first page of the range, or NO_PFN if the allocation failed.
+	 * @param count The number of pages in the range.
+	 * @param cls The lifetime class the allocation asked for.
+	 */
+	void trace_contig(pfn_t pfn, uint64_t count, int cls)
+	{
+		if (!_trace) return;
+
+		BuddyTraceEvent event = TRACE_ALLOC_CONTIG;
+		while (count > 0) {
+			uint64_t pages = count < TRACE_MAX_COUNT ? count : TRACE_MAX_COUNT;
+			trace(event, pfn, pages, cls);
+
+			event = TRACE_CONTIG_MORE;
+			if (pfn != NO_PFN) pfn += pages;
+			count -= pages;
+		}
+	}
+
+	/**
+	 * Copies a record out of the trace ring, if it still holds the event it was given at the given index - CPUs
+	 * carry on tracing while the ring is dumped, so the slot may have been reused, or be half written.
+	 * @param index The index the record was written at.
+	 * @param out Receives the record.
+	 * @return Returns TRUE if the record was copied whole, FALSE if it has been (or is being) overwritten.
+	 */
+	bool read_trace_record(uint64_t index, BuddyTraceRecord& out) const
+	{
+		const BuddyTraceRecord& record = _trace[index & _trace_mask];
+
+		uint32_t info = __atomic_load_n(&record.info, __ATOMIC_ACQUIRE);
+		out.tsc = __atomic_load_n(&record.tsc, __ATOMIC_RELAXED);
+		out.pfn = __atomic_load_n(&record.pfn, __ATOMIC_RELAXED);
+		out.info = info;
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+		return out.event() != 0 && ((info >> 9) & 7) == ((index >> _trace_bits) & 7) &&
+			__atomic_load_n(&record.info, __ATOMIC_RELAXED) == info;
+	}
+
+	/**
+	 * Given the class an allocation asked for, returns the class it is made from - which is always the first
+	 * one if grouping is off.
+	 * @param cls The class asked for.
+	 * @return Returns the class to use.
+	 */
+	int group_class(BuddyAllocClass cls) const
+	{
+		return _grouping ? cls : ALLOC_PINNED;
+	}
+
+public:
+	/**
+	 * Allocates 2^order number of contiguous pages, as a pinned allocation.
+	 * @param order The power of two, of the number of contiguous pages to allocate.
+	 * @return Returns a pointer to the first page descriptor for the newly allocated page range, or NULL if
+	 * allocation failed.
+	 */
+	PageDescriptor *allocate_pages(int order) override
+	{
+		return allocate_pages(order, ALLOC_PINNED);
+	}
+
+	/**
+	 * Allocates 2^order number of contiguous pages of the given lifetime class.  The lowest orders are served
+	 * from this CPU's page cache when it can, which takes no shared lock; the cache is refilled in batches when it
+	 * runs low.
+	 * @param order The power of two, of the number of contiguous pages to allocate.
+	 * @param alloc_class The lifetime class of the allocation.
+	 * @return Returns a pointer to the first page descriptor for the newly allocated page range, or NULL if
+	 * allocation failed, or the order is out of range.
+	 */
+	PageDescriptor *allocate_pages(int order, BuddyAllocClass alloc_class)
+	{
+		//there are no counters for orders that don't exist, so these aren't counted or traced as failures
+		if (order < 0 || order > MAX_ORDER) return NULL;
+
+		PageDescriptor *block = take_pages(order, group_class(alloc_class));
+		if (!block) count_failed_alloc(order);
+
+		trace(TRACE_ALLOC, block ? sys.mm().pgalloc().pgd_to_pfn(block) : NO_PFN, order, alloc_class);
+		return block;
+	}
+
+	/**
+	 * Frees 2^order contiguous pages.  The lowest orders go into this CPU's page cache (for the class that owns
+	 * the pages' pageblock), and are only given back to the free lists (and coalesced) in batches once the cache
+	 * is above its high watermark.
+	 * @param pgd A pointer to an array of page descriptors to be freed.
+	 * @param order The power of two number of contiguous pages to free.
+	 */
+	void free_pages(PageDescriptor *pgd, int order) override
+	{
+		trace(TRACE_FREE, sys.mm().pgalloc().pgd_to_pfn(pgd), order);
+		give_pages(pgd, order);
+	}
+
+	/**
+	 * Allocates n blocks of 2^order contiguous pages in one go, for callers that need many blocks at once (e.g.
+	 * setting up a process or a batch of threads).  The blocks are carved from as few large free blocks as
+	 * possible, so this costs far fewer splits than n calls to allocate_pages.
+	 * @param order The power of two, of the number of contiguous pages in each block.
+	 * @param n The number of blocks to allocate.
+	 * @param out An array of at least n entries that receives the first page descriptor of each block.
+	 * @param alloc_class The lifetime class of the allocation.
+	 * @return Returns the number of blocks allocated - if this is less than n, memory ran out and the blocks
+	 * that were allocated are still owned by the caller.  No blocks are allocated if the order is out of range.
+	 */
+	unsigned int allocate_pages_bulk(int order, unsigned int n, PageDescriptor **out, BuddyAllocClass alloc_class = ALLOC_PINNED)
+	{
+		if (order < 0 || order > MAX_ORDER) return 0;
+
+		unsigned int nr_allocated = allocate_blocks_from_regions(order, n, out, group_class(alloc_class));
+		if (nr_allocated < n) count_failed_alloc(order);
+
+		for (unsigned int i = 0; i < nr_allocated; i++) {
+			trace(TRACE_ALLOC, sys.mm().pgalloc().pgd_to_pfn(out[i]), order, alloc_class);
+		}
+		return nr_allocated;
+	}
+
+	/**
+	 * Frees n blocks of 2^order contiguous pages in one go.  The blocks are sorted by pfn, and each run of
+	 * adjacent blocks is freed as a single range, so a run coalesces in one pass instead of one merge chain
+	 * per block, under one region lock.  The array is reordered.
+	 * @param pgds The first page descriptor of each block to free.
+	 * @param n The number of blocks.
+	 * @param order The power of two number of contiguous pages in each block.
+	 */
+	void free_pages_bulk(PageDescriptor **pgds, unsigned int n, int order)
+	{
+		for (unsigned int i = 0; i < n; i++) {
+			trace(TRACE_FREE, sys.mm().pgalloc().pgd_to_pfn(pgds[i]), order);
+		}
+
+		sort_by_pfn(pgds, n);
+
+		unsigned int i = 0;
+		while (i < n) {
+			assert(this->is_aligned(pgds[i], order));
+
+			//extend the run for as long as the next block starts where this one ends
+			unsigned int run = 1;
+			while (i + run < n && pgds[i + run] == pgds[i] + (run << order)) {
+				run++;
+			}
+
+			for_each_region_in_range(sys.mm().pgalloc().pgd_to_pfn(pgds[i]), (uint64_t)run << order,
+				[this](Region&, pfn_t first, uint64_t pages) { free_range(first, pages); });
+			i += run;
+		}
+	}
+
+	/**
+	 * Allocates exactly count contiguous pages, rather than rounding up to a power of two: a block of the next
+	 * order up is taken, and the pages after the first count go straight back on the free lists.  Free the pages
+	 * with free_pages_exact, as they are not a block of any order.
+	 * @param count The number of contiguous pages to allocate.
+	 * @param alloc_class The lifetime class of the allocation.
+	 * @return Returns the first page descriptor of the pages, or NULL if allocation failed.
+	 */
+	PageDescriptor *allocate_pages_exact(uint64_t count, BuddyAllocClass alloc_class = ALLOC_PINNED)
+	{
+		if (count == 0 || count > pages_in_block(MAX_ORDER)) return NULL;
+
+		return allocate_trimmed_block(count, order_for_pages(count), alloc_class);
+	}
+
+	/**
+	 * Frees pages allocated with allocate_pages_exact.  They go back as the largest aligned blocks that tile
+	 * them, each coalescing with its free neighbours.
+	 * @param pgd The first page descriptor of the pages.
+	 * @param count The number of pages, as passed to allocate_pages_exact.
+	 */
+	void free_pages_exact(PageDescriptor *pgd, uint64_t count)
+	{
+		if (count == 0) return;
+
+		free_trimmed_block(pgd, count, order_for_pages(count));
+	}
+
+	/**
+	 * Allocates count physically contiguous pages, which may be more than the largest block holds (e.g. for a RAM
+	 * disk or a frame buffer): a run of adjacent free max-order blocks is found through the max-order free bitmap
+	 * and claimed whole, and the pages past the first count go straight back on the free lists.  The cost is in
+	 * max-order blocks, never in pages.  A range that fits in one max-order block, with an alignment no larger
+	 * than one, is instead a single block of the order that holds it at that alignment, trimmed like an exact
+	 * allocation.  Pages held in the per-CPU page caches are not given back to look for a run, so they can keep a
+	 * max-order block from being free.  Free the pages with free_contig_range.
+	 * @param count The number of contiguous pages to allocate.
+	 * @param alignment The range must start at a multiple of this many pages, a power of two (or zero, for the
+	 * natural alignment - that of the smallest block that holds count pages, up to a max-order block).
+	 * @param alloc_class The lifetime class of the allocation.
+	 * @return Returns the first page descriptor of the pages, or NULL if there is no free run large enough.
+	 */
+	PageDescriptor *allocate_contig_range(uint64_t count, uint64_t alignment = 0, BuddyAllocClass alloc_class = ALLOC_PINNED)
+	{
+		if (count == 0 || (alignment & (alignment - 1))) return NULL;
+
+		//a range no larger than a max-order block is one block - aligned, as blocks are, to its own size
+		if (count <= pages_in_block(MAX_ORDER) && alignment <= pages_in_block(MAX_ORDER)) {
+			return allocate_trimmed_block(count, order_for_pages(count > alignment ? count : alignment), alloc_class);
+		}
+
+		uint64_t nr_blocks = (count + pages_in_block(MAX_ORDER) - 1) >> MAX_ORDER;
+		uint64_t align_blocks = (alignment >> MAX_ORDER) ? (alignment >> MAX_ORDER) : 1;
+		int cls = group_class(alloc_class);
+
+		UniqueIRQLock l;
+
+		for (int attempt = 0; attempt <= 1; attempt++) {
+			uint64_t first = 0;
+			while ((first = find_free_run(first, nr_blocks, align_blocks)) != NO_PFN) {
+				pfn_t pfn = first << MAX_ORDER;
+				unsigned int first_region = pfn >> _region_shift;
+				unsigned int last_region = (pfn + (nr_blocks << MAX_ORDER) - 1) >> _region_shift;
+
+				lock_regions(first_region, last_region);
+				bool claimed = claim_free_run(first, nr_blocks, cls);
+				if (claimed) {
+					insert_tail(pfn + count, (nr_blocks << MAX_ORDER) - count);
+				}
+				unlock_regions(first_region, last_region);
+
+				if (claimed) {
+					__atomic_fetch_add(&_nr_contig_allocs, 1, __ATOMIC_RELAXED);
+					__atomic_fetch_add(&_nr_contig_pages, count, __ATOMIC_RELAXED);
+
+					trace_contig(pfn, count, alloc_class);
+					return sys.mm().pgalloc().pfn_to_pgd(pfn);
+				}
+
+				//another CPU got to part of the run first - carry on from the next aligned start
+				first += align_blocks;
+			}
+
+			//uncoalesced blocks can keep a max-order block from being free, so merge them and look again
+			bool flushed = false;
+			for (unsigned int r = 0; r < _nr_regions; r++) {
+				if (!__atomic_load_n(&_regions[r].populated, __ATOMIC_ACQUIRE)) continue;
+
+				UniqueRegionLock rl(_regions[r]);
+				flushed = flush_all_lazy_blocks(_regions[r]) || flushed;
+			}
+			if (!flushed) break;
+		}
+
+		count_failed_alloc(MAX_ORDER);
+		trace_contig(NO_PFN, count, alloc_class);
+		return NULL;
+	}
+
+	/**
+	 * Frees pages allocated with allocate_contig_range.  They go back as the largest aligned blocks that tile them,
+	 * one region at a time, so the cost is in max-order blocks again.
+	 * @param pgd The first page descriptor of the pages.
+	 * @param count The number of pages, as passed to allocate_contig_range.
+	 * @param alignment The alignment, as passed to allocate_contig_range.
+	 */
+	void free_contig_range(PageDescriptor *pgd, uint64_t count, uint64_t alignment = 0)
+	{
+		if (count == 0) return;
+
+		if (count <= pages_in_block(MAX_ORDER) && alignment <= pages_in_block(MAX_ORDER)) {
+			free_trimmed_block(pgd, count, order_for_pages(count > alignment ? count : alignment));
+			return;
+		}
+
+		pfn_t pfn = sys.mm().pgalloc().pgd_to_pfn(pgd);
+		trace(TRACE_FREE_CONTIG, pfn, 0);
+
+		for_each_region_in_range(pfn, count, [this](Region&, pfn_t first, uint64_t pages) {
+			free_range(first, pages);
+		});
+		__atomic_fetch_sub(&_nr_contig_pages, count, __ATOMIC_RELAXED);
+	}
+
+    /**
+     * Marks a range of pages as available for allocation -> put it back in _free_areas
+     * @param start A pointer to the first page descriptors to be made available.
+     * @param count The number of page descriptors to make available.
+     */
+    virtual void insert_page_range(PageDescriptor *start, uint64_t count) override
+    {
+		//mm_log.messagef(LogLevel::INFO, "Called to insert page range, with start pdg=%p and count=%lx", start, count);
+		pfn_t pfn = sys.mm().pgalloc().pgd_to_pfn(start);
+
+		//traced as the core asked, so a replay against a build with more or less metadata trims it for itself
+		trace_range(TRACE_INSERT_RANGE, pfn, count);
+
+		assert(pfn + count <= _nr_page_descriptors);
+
+		//free the range as the largest aligned blocks that tile it, whatever alignment it starts and ends at, with
+		//each block coalescing into any free memory either side - that is O(MAX_ORDER) per block, so a memory map
+		//goes in with work proportional to its number of max-order blocks rather than its number of pages
+		bool trimmed = for_each_part_outside_metadata(pfn, count, [this](pfn_t part_pfn, uint64_t part_count) {
+			for_each_region_in_range(part_pfn, part_count, [this](Region& region, pfn_t first, uint64_t pages) {
+				free_range(first, pages);
+				__atomic_store_n(&region.populated, true, __ATOMIC_RELEASE);
+			});
+		});
+
+		//our metadata was taken from available memory, so the range holding it is expected to overlap it
+		if (trimmed) {
+			mm_log.messagef(LogLevel::INFO, "buddy: left the allocator metadata at pfn %lx-%lx out of range %lx-%lx",
+				_metadata_start, _metadata_start + _nr_metadata_pages, pfn, pfn + count);
+		}
+		//mm_log.messagef(LogLevel::INFO,"Finished inserting page range");
+    }
+
+    /**
+     * Marks a range of pages as unavailable for allocation - take out of free_areas_
+     * @param start A pointer to the first page descriptors to be made unavailable.
+     * @param count The number of page descriptors to make unavailable.
+     */
+    virtual void remove_page_range(PageDescriptor *start, uint64_t count) override
+    {	
+		//mm_log.messagef(LogLevel::INFO,"Called to remove page range, with start pdg=%p and count=%lx", start, count);
+		pfn_t pfn = sys.mm().pgalloc().pgd_to_pfn(start);
+		trace_range(TRACE_REMOVE_RANGE, pfn, count);
+
+		assert(pfn + count <= _nr_page_descriptors);
+
+		//pages sitting in the per-CPU caches are not on the free lists, so hand them back before looking for the range
+		drain_all_page_caches();
+
+		//claim the range as the largest aligned blocks that tile it, each at O(MAX_ORDER) cost however large it is
+		//and wherever it sits in the free block that holds it - the metadata pages were never made available, so
+		//they are left out
+		bool trimmed = for_each_part_outside_metadata(pfn, count, [this](pfn_t part_pfn, uint64_t part_count) {
+			for_each_region_in_range(part_pfn, part_count, [this](Region& region, pfn_t first, uint64_t pages) {
+				flush_all_lazy_blocks(region);
+
+				while (pages > 0) {
+					int order = largest_aligned_order(first, pages);
+					claim_block(first, order);
+
+					first += pages_in_block(order);
+					pages -= pages_in_block(order);
+				}
+			});
+		});
+
+		//but whoever is reserving the range now shares those pages with our metadata
+		if (trimmed) {
+			mm_log.messagef(LogLevel::ERROR, "buddy: range %lx-%lx being reserved overlaps the allocator metadata at pfn %lx-%lx",
+				pfn, pfn + count, _metadata_start, _metadata_start + _nr_metadata_pages);
+		}
+		//mm_log.messagef(LogLevel::INFO,"Finished removing page range");
+    }
+
+	/**
+	 * Initialises the allocation algorithm.
+	 * @return Returns TRUE if the algorithm was successfully initialised, FALSE otherwise.
+	 */
+	bool init(PageDescriptor *page_descriptors, uint64_t nr_page_descriptors) override
+	{
+        //mm_log.messagef(LogLevel::INFO, "Buddy Allocator Initialising pgd=%p, nr_pgds=0x%lx", page_descriptors, nr_page_descriptors);
+		_page_descriptors = page_descriptors;
+		_nr_page_descriptors = nr_page_descriptors;
+
+		for (int i = 0; i <= MAX_ORDER; i++) {
+			_nr_failed_allocs[i] = 0;
+		}
+		_nr_contig_allocs = 0;
+		_nr_contig_pages = 0;
+
+		for (unsigned int cpu = 0; cpu < MAX_CPUS; cpu++) {
+			for (int order = 0; order < PCP_ORDERS; order++) {
+				for (int cls = 0; cls < NR_ALLOC_CLASSES; cls++) {
+					_pcp[cpu].blocks[cls][order] = NULL;
+					_pcp[cpu].count[cls][order] = 0;
+				}
+				_pcp[cpu].hits[order] = 0;
+				_pcp[cpu].misses[order] = 0;
+				_pcp[cpu].drains[order] = 0;
+			}
+		}
+
+		//the back-links are stored as 32-bit pfns
+		if (nr_page_descriptors >= NO_PFN) {
+			return false;
+		}
+
+		_lowest_address_first = buddy_lowest_address_first;
+		_lazy_coalescing = buddy_lazy_coalescing;
+		_grouping = !buddy_no_grouping;
+
+		//the trace ring is a power of two records, taking up at most a sixteenth of memory
+		uint64_t trace_records = buddy_trace_records < TRACE_MAX_RECORDS ? buddy_trace_records : TRACE_MAX_RECORDS;
+		_trace_bits = 0;
+		while ((2ULL << _trace_bits) <= trace_records &&
+				(2ULL << _trace_bits) * sizeof(BuddyTraceRecord) <= (nr_page_descriptors * __page_size) / 16) {
+			_trace_bits++;
+		}
+		if (!trace_records) _trace_bits = -1;
+
+		//the free bitmaps need one bit per block of every order (about two bits per page in total), each page
+		//needs a free list back-link and a free order tag, and each pageblock needs its class - we can't allocate
+		//memory yet, so take them from pages that are then never handed out
+		uint64_t bitmap_words = 0;
+		for (int i = 0; i <= MAX_ORDER; i++) {
+			bitmap_words += words_in_bitmap(i);
+		}
+
+		uint64_t trace_bytes = (_trace_bits >= 0) ? (1ULL << _trace_bits) * sizeof(BuddyTraceRecord) : 0;
+		uint64_t metadata_bytes = trace_bytes + (bitmap_words * sizeof(uint64_t)) +
+			(nr_page_descriptors * (sizeof(uint32_t) + sizeof(uint8_t))) + bits_in_bitmap(MAX_ORDER);
+		uint64_t metadata_pages = (metadata_bytes + __page_size - 1) / __page_size;
+		if (metadata_pages >= nr_page_descriptors) {
+			return false;
+		}
+
+		//the core has already marked each page with its type in the memory map, so the metadata goes in the highest
+		//run of available pages that can hold it - never in a hole, or in memory a device or the firmware owns.  Each
+		//page is looked at once, and the top of memory is normally available, so that is only the metadata's pages
+		uint64_t top = nr_page_descriptors, first = nr_page_descriptors;
+		while (top - first < metadata_pages) {
+			if (first == 0) return false;
+
+			first--;
+			if (page_descriptors[first].type != PageDescriptorType::AVAILABLE) top = first;
+		}
+
+		_metadata_start = first;
+		_nr_metadata_pages = metadata_pages;
+		uint8_t *metadata = (uint8_t *)sys.mm().pgalloc().pgd_to_kva(&page_descriptors[first]);
+
+		//the trace ring goes first, as its records are the most aligned - it is only touched here if tracing is on
+		_trace = NULL;
+		_trace_mask = 0;
+		_trace_head = 0;
+		_trace_start = 0;
+		if (trace_bytes) {
+			_trace = (BuddyTraceRecord *)metadata;
+			_trace_mask = (1ULL << _trace_bits) - 1;
+			memset(_trace, 0, trace_bytes);
+		}
+
+		uint64_t *bitmap_word = (uint64_t *)(metadata + trace_bytes);
+		for (int i = 0; i <= MAX_ORDER; i++) {
+			_free_bitmap[i] = bitmap_word;
+			for (uint64_t w = 0; w < words_in_bitmap(i); w++) {
+				bitmap_word[w] = 0;
+			}
+			bitmap_word += words_in_bitmap(i);
+		}
+
+		//the back-links and order tags are not initialised - a page's entries are first written when it becomes
+		//the head of a free block, and an order tag only counts when the free bitmap agrees with it (see is_free_head),
+		//so nothing here touches memory per page
+		_prev_free = (uint32_t *)bitmap_word;
+		_free_order = (uint8_t *)(_prev_free + nr_page_descriptors);
+		_nr_usable_pages = nr_page_descriptors - metadata_pages;
+
+		//all memory starts out reclaimable, and pinned allocations claim pageblocks from it as they need them
+		_pageblock_class = _free_order + nr_page_descriptors;
+		for (uint64_t pb = 0; pb < bits_in_bitmap(MAX_ORDER); pb++) {
+			_pageblock_class[pb] = group_class(ALLOC_RECLAIMABLE);
+		}
+
+		//split memory into as many regions as we are allowed, each a power-of-two number of pageblocks - so a
+		//guest with fewer pageblocks than CPUs gets one region per pageblock
+		_region_shift = MAX_ORDER;
+		while (((nr_page_descriptors - 1) >> _region_shift) + 1 > buddy_max_regions) {
+			_region_shift++;
+		}
+		_nr_regions = ((nr_page_descriptors - 1) >> _region_shift) + 1;
+
+		for (unsigned int r = 0; r < _nr_regions; r++) {
+			Region& region = _regions[r];
+
+			region.start = (pfn_t)r << _region_shift;
+			region.end = region.start + (1ULL << _region_shift);
+			if (region.end > nr_page_descriptors) region.end = nr_page_descriptors;
+			region.populated = false;
+
+			for (int i = 0; i <= MAX_ORDER; i++) {
+				for (int cls = 0; cls < NR_ALLOC_CLASSES; cls++) {
+					region.free_areas[cls][i] = NULL;
+					region.lowest_word_hint[cls][i] = (region.start >> i) / 64;
+				}
+				region.nr_free_blocks[i] = 0;
+			}
+
+			for (int cls = 0; cls < NR_ALLOC_CLASSES; cls++) {
+				for (int order = 0; order < LAZY_ORDERS; order++) {
+					region.lazy_blocks[cls][order] = NULL;
+					region.nr_lazy_blocks[cls][order] = 0;
+				}
+				region.nr_fallbacks[cls] = 0;
+			}
+
+			region.nr_lazy_flushes = 0;
+			region.nr_splits = 0;
+			region.nr_merges = 0;
+			region.nr_pageblock_claims = 0;
+			region.nr_exact_allocs = 0;
+			region.nr_exact_pages_saved = 0;
+			region.nr_exact_pages_live_saved = 0;
+			region.nr_contentions = 0;
+		}
+
+		//nothing is free yet - the memory map is handed to us afterwards, one available region at a time, through
+		//insert_page_range, so holes and disjoint regions are never put on the free lists
+
+		//the syscall table is static, so user space can be given the statistics from here on
+		buddy_instance = this;
+		sys.syscalls().RegisterSyscall(SYS_GET_MEMINFO, sys_get_meminfo);
+		if (buddy_stress_syscall) {
+			sys.syscalls().RegisterSyscall(SYS_PGALLOC_STRESS, sys_pgalloc_stress);
+		}
+		//dumping the trace is a long spell in the kernel, so it is only there for a kernel booted to be traced
+		if (_trace) {
+			sys.syscalls().RegisterSyscall(SYS_PGALLOC_TRACE, sys_pgalloc_trace);
+		}
+
+		//mm_log.messagef(LogLevel::INFO, "Succesfully finished allocator->init");
+		return true;
+	}
+
+	/**
+	 * Returns the number of blocks on the free lists of the given order, in every region (blocks held in the
+	 * per-CPU page caches are not counted).  The regions are not locked, so this may be a little out while
+	 * other CPUs are allocating.
+	 */
+	uint64_t nr_free_blocks(int order) const
+	{
+		uint64_t nr_blocks = 0;
+		for (unsigned int r = 0; r < _nr_regions; r++) {
+			nr_blocks += __atomic_load_n(&_regions[r].nr_free_blocks[order], __ATOMIC_RELAXED);
+		}
+		return nr_blocks;
+	}
+
+	/**
+	 * Returns the number of independently locked regions memory is split into.
+	 */
+	unsigned int nr_regions() const { return _nr_regions; }
+
+	/**
+	 * Writes the allocation trace to the debug console: a BuddyTraceHeader, the records oldest first, then a
+	 * BuddyTraceTrailer.  Other CPUs carry on tracing meanwhile, and any record they overwrite before it is
+	 * written out goes out empty.
+	 * @param reset Whether the next dump should start after the records in this one.
+	 * @return Returns the number of records written, or -1 if tracing is off.
+	 */
+	int64_t dump_trace(bool reset)
+	{
+		if (!_trace) return -1;
+
+		uint64_t head = __atomic_load_n(&_trace_head, __ATOMIC_ACQUIRE);
+		uint64_t start = __atomic_load_n(&_trace_start, __ATOMIC_RELAXED);
+		uint64_t first = start;
+		if (head - first > _trace_mask + 1) first = head - (_trace_mask + 1);
+
+		BuddyTraceHeader header;
+		memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+		header.record_size = sizeof(BuddyTraceRecord);
+		header.max_order = MAX_ORDER;
+		header.nr_records = head - first;
+		header.nr_dropped = first - start;
+		header.nr_pages = _nr_page_descriptors;
+		debugcon_write(&header, sizeof(header));
+
+		//copy the records out a batch at a time, so each port write moves a good run of bytes
+		const unsigned int batch_size = 64;
+		BuddyTraceRecord batch[batch_size];
+		BuddyTraceTrailer trailer;
+		memcpy(trailer.magic, TRACE_END_MAGIC, sizeof(trailer.magic));
+		trailer.nr_skipped = 0;
+
+		for (uint64_t index = first; index < head; ) {
+			unsigned int n = 0;
+			for (; n < batch_size && index < head; n++, index++) {
+				if (!read_trace_record(index, batch[n])) {
+					batch[n].tsc = 0;
+					batch[n].pfn = NO_PFN;
+					batch[n].info = 0;
+					trailer.nr_skipped++;
+				}
+			}
+			debugcon_write(batch, n * sizeof(BuddyTraceRecord));
+		}
+
+		debugcon_write(&trailer, sizeof(trailer));
+
+		if (reset) __atomic_store_n(&_trace_start, head, __ATOMIC_RELAXED);
+		return head - first;
+	}
+
+	/**
+	 * Starts the next trace dump from the next event recorded.
+	 * @return Returns FALSE if tracing is off.
+	 */
+	bool reset_trace()
+	{
+		if (!_trace) return false;
+
+		__atomic_store_n(&_trace_start, __atomic_load_n(&_trace_head, __ATOMIC_ACQUIRE), __ATOMIC_RELAXED);
+		return true;
+	}
+
+	/**
+	 * Returns the friendly name of the allocation algorithm, for INFOging and selection purposes.
+	 */
+	const char* name() const override { return "buddy"; }
+
+	/**
+	 * Takes a snapshot of the allocator statistics.  This is cheap enough to sample while a workload runs: it
+	 * reads each region's counters under that region's lock, and never walks a free list.  The regions are
+	 * read one after another, and the per-CPU page cache counts without their CPU's cooperation, so the totals
+	 * may be a batch out while other CPUs are allocating.
+	 * @param info Receives the statistics.
+	 */
+	void get_meminfo(BuddyMemInfo& info) const
+	{
+		info.nr_pages = _nr_usable_pages;
+		info.max_order = MAX_ORDER;
+		info.largest_free_order = -1;
+
+		info.nr_cached_pages = 0;
+		for (unsigned int cpu = 0; cpu < MAX_CPUS; cpu++) {
+			for (int order = 0; order < PCP_ORDERS; order++) {
+				for (int cls = 0; cls < NR_ALLOC_CLASSES; cls++) {
+					info.nr_cached_pages += (uint64_t)__atomic_load_n(&_pcp[cpu].count[cls][order], __ATOMIC_RELAXED) << order;
+				}
+			}
+		}
+
+		info.splits = 0;
+		info.merges = 0;
+		info.exact_allocs = 0;
+		info.exact_pages_saved = 0;
+		info.exact_pages_live_saved = 0;
+		info.pageblock_claims = 0;
+		info.lock_contentions = 0;
+		info.nr_regions = _nr_regions;
+		info.contig_allocs = __atomic_load_n(&_nr_contig_allocs, __ATOMIC_RELAXED);
+		info.contig_pages = __atomic_load_n(&_nr_contig_pages, __ATOMIC_RELAXED);
+		for (int cls = 0; cls < NR_ALLOC_CLASSES; cls++) {
+			info.class_fallbacks[cls] = 0;
+		}
+		for (int order = 0; order <= MAX_ORDER; order++) {
+			info.free_blocks[order] = 0;
+			info.failed_allocs[order] = __atomic_load_n(&_nr_failed_allocs[order], __ATOMIC_RELAXED);
+		}
+
+		for (unsigned int r = 0; r < _nr_regions; r++) {
+			const Region& region = _regions[r];
+
+			UniqueIRQLock l;
+			UniqueRawSpinLock sl(region.lock);
+
+			info.splits += region.nr_splits;
+			info.merges += region.nr_merges;
+			info.exact_allocs += region.nr_exact_allocs;
+			info.exact_pages_saved += region.nr_exact_pages_saved;
+			info.exact_pages_live_saved += region.nr_exact_pages_live_saved;
+			info.pageblock_claims += region.nr_pageblock_claims;
+			info.lock_contentions += region.nr_contentions;
+			for (int cls = 0; cls < NR_ALLOC_CLASSES; cls++) {
+				for (int order = 0; order < LAZY_ORDERS; order++) {
+					info.nr_cached_pages += (uint64_t)region.nr_lazy_blocks[cls][order] << order;
+				}
+				info.class_fallbacks[cls] += region.nr_fallbacks[cls];
+			}
+			for (int order = 0; order <= MAX_ORDER; order++) {
+				info.free_blocks[order] += region.nr_free_blocks[order];
+			}
+		}
+
+		info.nr_free_pages = 0;
+		for (int order = 0; order <= MAX_ORDER; order++) {
+			info.nr_free_pages += info.free_blocks[order] << order;
+			if (info.free_blocks[order]) info.largest_free_order = order;
+		}
+
+		//the unusable free space index of an order is the share of free memory in blocks too small to satisfy
+		//an allocation of that order - 0 means all free memory is usable, 1000 means none of it is
+		uint64_t usable = info.nr_free_pages;
+		for (int order = 0; order <= MAX_ORDER; order++) {
+			info.fragmentation[order] = info.nr_free_pages ? ((info.nr_free_pages - usable) * 1000) / info.nr_free_pages : 0;
+			usable -= info.free_blocks[order] << order;
+		}
+	}
+
+	/**
+	 * Dumps out the current state of the buddy system: the statistics, and the first few free blocks of each order.
+	 */
+	void dump_state() const override
+	{
+		// The most free blocks listed for each order - the counts cover the rest.
+		const unsigned int max_listed = 8;
+
+		BuddyMemInfo info;
+		get_meminfo(info);
+
+		// Print out a header, so we can find the output in the logs.
+		mm_log.messagef(LogLevel::DEBUG, "BUDDY STATE: pages=%lu free=%lu cached=%lu largest=%d splits=%lu merges=%lu",
+			info.nr_pages, info.nr_free_pages, info.nr_cached_pages, info.largest_free_order, info.splits, info.merges);
+		mm_log.messagef(LogLevel::DEBUG, "exact allocs=%lu pages saved=%lu (in use %lu)",
+			info.exact_allocs, info.exact_pages_saved, info.exact_pages_live_saved);
+		mm_log.messagef(LogLevel::DEBUG, "contig allocs=%lu pages in use=%lu", info.contig_allocs, info.contig_pages);
+		mm_log.messagef(LogLevel::DEBUG, "fallbacks pinned=%lu reclaimable=%lu pageblock claims=%lu",
+			info.class_fallbacks[ALLOC_PINNED], info.class_fallbacks[ALLOC_RECLAIMABLE], info.pageblock_claims);
+		mm_log.messagef(LogLevel::DEBUG, "regions=%u lock contentions=%lu", info.nr_regions, info.lock_contentions);
+
+		// Iterate over each free area, of each class - the first few blocks listed are from the lowest regions.
+		for (int cls = 0; cls < NR_ALLOC_CLASSES; cls++) {
+			for (int i = 0; i <= MAX_ORDER; i++) {
+				char buffer[256];
+				int n = snprintf(buffer, sizeof(buffer), "%c[%d] blocks=%lu failed=%lu frag=%u :", cls == ALLOC_PINNED ? 'P' : 'R',
+					i, info.free_blocks[i], info.failed_allocs[i], info.fragmentation[i]);
+
+				// Append the PFNs of the first few blocks in the free area, stopping before the buffer fills.
+				unsigned int listed = 0;
+				bool more = false;
+				for (unsigned int r = 0; r < _nr_regions; r++) {
+					PageDescriptor *pg = _regions[r].free_areas[cls][i];
+					for (; pg && listed < max_listed && n < (int)sizeof(buffer); listed++) {
+						n += snprintf(buffer + n, sizeof(buffer) - n, " %lx", sys.mm().pgalloc().pgd_to_pfn(pg));
+						pg = pg->next_free;
+					}
+					more = more || pg;
+				}
+
+				if (more && n < (int)sizeof(buffer)) {
+					snprintf(buffer + n, sizeof(buffer) - n, " ...");
+				}
+
+				mm_log.messagef(LogLevel::DEBUG, "%s", buffer);
+			}
+		}
+
+		// Print each region's extent and lock contention, and its uncoalesced blocks if lazy coalescing is on.
+		for (unsigned int r = 0; r < _nr_regions; r++) {
+			const Region& region = _regions[r];
+			if (!__atomic_load_n(&region.populated, __ATOMIC_ACQUIRE)) continue;
+
+			mm_log.messagef(LogLevel::DEBUG, "region %u pfn %lx-%lx contentions=%lu", r, region.start, region.end,
+				region.nr_contentions);
+
+			if (_lazy_coalescing) {
+				for (int cls = 0; cls < NR_ALLOC_CLASSES; cls++) {
+					mm_log.messagef(LogLevel::DEBUG, "  lazy %c[0] %u [1] %u [2] %u [3] %u", cls == ALLOC_PINNED ? 'P' : 'R',
+						region.nr_lazy_blocks[cls][0], region.nr_lazy_blocks[cls][1], region.nr_lazy_blocks[cls][2],
+						region.nr_lazy_blocks[cls][3]);
+				}
+				mm_log.messagef(LogLevel::DEBUG, "  lazy flushes=%lu", region.nr_lazy_flushes);
+			}
+		}
+
+		// Print the per-CPU page cache counters, for the CPUs that have used them.
+		for (unsigned int cpu = 0; cpu < MAX_CPUS; cpu++) {
+			for (int order = 0; order < PCP_ORDERS; order++) {
+				const PerCPUPageCache& pcp = _pcp[cpu];
+				if (!pcp.hits[order] && !pcp.misses[order]) continue;
+
+				mm_log.messagef(LogLevel::DEBUG, "pcp cpu%u [%d] cached=%u+%u hits=%lu misses=%lu drains=%lu",
+					cpu, order, pcp.count[ALLOC_PINNED][order], pcp.count[ALLOC_RECLAIMABLE][order],
+					pcp.hits[order], pcp.misses[order], pcp.drains[order]);
+			}
+		}
+	}
+
+	/** The allocator that SYS_GET_MEMINFO reports on, once one has been initialised. */
+	static BuddyPageAllocator *buddy_instance;
+
 private:
-	PageDescriptor *_free_areas[MAX_ORDER+1];
+	// The regions memory is split into, each with its own lock and free lists - a free block is on the lists of its
+	// region, for the class that owns its pageblock.  Region r covers pfns [r << _region_shift, (r + 1) << _region_shift).
+	Region _regions[MAX_REGIONS];
+	unsigned int _nr_regions;
+	int _region_shift;
+
+	// One bit per block of each order, set when that block is on a free list of that order (indexed by pfn >> order)
+	uint64_t *_free_bitmap[MAX_ORDER+1];
+
+	// Per page: the pfn of the previous block on the same free list, and the order of the free block this page heads
+	uint32_t *_prev_free;
+	uint8_t *_free_order;
+
+	bool _lowest_address_first;
+
+	// Lazy coalescing: blocks freed without merging are kept on each region's lazy lists, apart from the free lists
+	// and bitmaps (so the free lists still only hold blocks whose buddies are not free)
+	bool _lazy_coalescing;
+
+	// Grouping by lifetime class: the class that owns each pageblock (max-order block)
+	bool _grouping;
+	uint8_t *_pageblock_class;
+
+	// Contiguous ranges made of runs of max-order blocks - allocated under several region locks, so counted atomically
+	uint64_t _nr_contig_allocs;
+	uint64_t _nr_contig_pages;
+
+	// Event tracing: a ring of 2^_trace_bits records (NULL if tracing is off) - _trace_head counts the records ever
+	// claimed, and _trace_start is the first the next dump should include - both are read and written atomically, as
+	// dumps and resets can come from any CPU
+	BuddyTraceRecord *_trace;
+	int _trace_bits;
+	uint64_t _trace_mask;
+	uint64_t _trace_head;
+	uint64_t _trace_start;
+
+	PageDescriptor *_page_descriptors;
+	uint64_t _nr_page_descriptors;
+
+	// The pages holding the allocator's metadata, which are never handed out
+	pfn_t _metadata_start;
+	uint64_t _nr_metadata_pages;
+	uint64_t _nr_usable_pages;
+
+	// Statistics: everything else is counted per region, under the region's lock, but failed allocations atomically
+	uint64_t _nr_failed_allocs[MAX_ORDER+1];
+
+	// The per-CPU page caches are only touched by their own CPU, except to drain them all when a range is removed
+	PerCPUPageCache _pcp[MAX_CPUS];
 };
 
+BuddyPageAllocator *BuddyPageAllocator::buddy_instance;
+
+/**
+ * SYS_GET_MEMINFO: copies a snapshot of the buddy allocator statistics to user space.
+ * @param info The user buffer to fill in.
+ * @param size The size of the user buffer - at most this many bytes are copied.
+ * @return Returns the number of bytes copied, or -1 if the buddy allocator is not in use, or the buffer is not in
+ * user space.
+ */
+static unsigned long sys_get_meminfo(unsigned long info, unsigned long size, unsigned long, unsigned long)
+{
+	if (!BuddyPageAllocator::buddy_instance) return (unsigned long)-1;
+
+	BuddyMemInfo snapshot;
+	BuddyPageAllocator::buddy_instance->get_meminfo(snapshot);
+
+	if (size > sizeof(snapshot)) size = sizeof(snapshot);
+	if (!copy_to_user(info, &snapshot, size)) return (unsigned long)-1;
+	return size;
+}
+
+/**
+ * SYS_PGALLOC_STRESS: allocates and frees blocks of orders 0 to 3 at random, as fast as it can, keeping up to 64 of
+ * them live - for measuring how page allocation scales with the number of CPUs doing it at once.  The pages never
+ * leave the allocator, so the core's page descriptors are not updated.  Only registered with pgalloc.stress=1.
+ * @param iterations The number of allocations to make.
+ * @param seed Seeds the orders chosen and the blocks freed - give each thread its own.
+ * @return Returns the number of allocations that failed, or -1 if the buddy allocator is not in use.
+ */
+static unsigned long sys_pgalloc_stress(unsigned long iterations, unsigned long seed, unsigned long, unsigned long)
+{
+	BuddyPageAllocator *alloc = BuddyPageAllocator::buddy_instance;
+	if (!alloc) return (unsigned long)-1;
+
+	const unsigned int nr_slots = 64;
+	PageDescriptor *slots[nr_slots];
+	int orders[nr_slots];
+	for (unsigned int i = 0; i < nr_slots; i++) {
+		slots[i] = NULL;
+	}
+
+	//xorshift, so the CPUs running this share nothing but the allocator
+	uint64_t state = (seed * 2) + 1;
+	unsigned long failed = 0;
+
+	for (unsigned long i = 0; i < iterations; i++) {
+		state ^= state << 13;
+		state ^= state >> 7;
+		state ^= state << 17;
+
+		unsigned int slot = state % nr_slots;
+		if (slots[slot]) {
+			alloc->free_pages(slots[slot], orders[slot]);
+		}
+
+		orders[slot] = (state >> 32) % 4;
+		slots[slot] = alloc->allocate_pages(orders[slot], ALLOC_RECLAIMABLE);
+		if (!slots[slot]) failed++;
+	}
+
+	for (unsigned int i = 0; i < nr_slots; i++) {
+		if (slots[i]) alloc->free_pages(slots[i], orders[i]);
+	}
+
+	return failed;
+}
+
+/**
+ * SYS_PGALLOC_TRACE: writes the allocation trace to the debug console, and/or marks where the next dump starts.
+ * Only registered with tracing on (pgalloc.trace=<records>).
+ * @param flags PGALLOC_TRACE_DUMP to write the trace out, and PGALLOC_TRACE_RESET to start the next dump after the
+ * records written so far.
+ * @return Returns the number of records written (zero if only resetting), or -1 if tracing is off.
+ */
+static unsigned long sys_pgalloc_trace(unsigned long flags, unsigned long, unsigned long, unsigned long)
+{
+	BuddyPageAllocator *alloc = BuddyPageAllocator::buddy_instance;
+	if (!alloc) return (unsigned long)-1;
+
+	if (flags & PGALLOC_TRACE_DUMP) {
+		return alloc->dump_trace(flags & PGALLOC_TRACE_RESET);
+	}
+
+	return alloc->reset_trace() ? 0 : (unsigned long)-1;
+}
+
 /* --- DO NOT CHANGE ANYTHING BELOW THIS LINE --- */
 
 /*
@@ -0,0 +1,268 @@
+/*
+ * Deadline reservations for REALTIME entities, with admission control
+ */
+
+#pragma once
+
+#include <infos/define.h>
+#include <infos/kernel/kernel.h>
+#include <infos/kernel/sched.h>
+#include "slab.h"
+#include "smp.h"
+
+/* The syscall a thread sets or clears its own deadline reservation with - see infos-user/inc/infos.h. */
+#define SYS_SCHED_SET_DEADLINE	36
+
+/* Bandwidths are in millionths of a CPU. */
+#define DEADLINE_BANDWIDTH_UNIT	1000000
+
+/* The longest period a reservation can have, in microseconds - which keeps the arithmetic on them in 64 bits. */
+#define DEADLINE_MAX_PERIOD		60000000
+
+/* The periods an entity can stay blocked for before its reservation lapses - see DeadlineReservationTable. */
+#define DEADLINE_LAPSE_PERIODS	8
+
+/* The buckets in a DeadlineReservationTable - a power of two. */
+#define DEADLINE_BUCKETS		64
+
+#ifndef HAVE_SCHED_CLOCK
+/**
+ * Returns the time since boot, in microseconds, which reservations are measured in.  A build for another
+ * environment (e.g. a simulator with a clock of its own) can supply its own sched_clock_us() by defining
+ * HAVE_SCHED_CLOCK.
+ */
+static inline uint64_t sched_clock_us()
+{
+	return infos::kernel::sys.runtime().count() / 1000;
+}
+#endif
+
+/**
+ * An entity's deadline reservation: it is promised runtime microseconds of a CPU within deadline microseconds of
+ * each release, once every period microseconds.  The state of its current job is kept here too, so it lasts
+ * while the entity blocks between jobs.
+ */
+struct DeadlineReservation
+{
+	infos::kernel::SchedulingEntity *entity;
+	DeadlineReservation *hash_next;
+
+	uint64_t runtime, period, deadline;
+	uint32_t bandwidth;			// runtime / deadline (its density), in millionths of a CPU
+	unsigned int cpu;			// the CPU the reservation was admitted on, which the entity always runs on
+
+	// The current job, for the scheduler's use
+	uint64_t abs_deadline;
+	uint64_t remaining;			// runtime left before the deadline
+	uint64_t run_start;			// when the entity was last picked, or charged for the time it ran
+
+	uint64_t blocked_since;		// when the entity last blocked, or zero while it is queued
+};
+
+/**
+ * The deadline reservations, found by entity, and the bandwidth admitted on each CPU.  Everything is under one
+ * lock, which is only taken when a reservation is made or cleared, or a REALTIME entity with one wakes or blocks.
+ *
+ * A reservation is found by its entity's address, and only the entity itself can clear it - so one whose entity
+ * exits would hold its bandwidth for good, and be handed to whatever entity is made at that address next.  A
+ * reservation is instead a lease, which lapses once its entity has stayed blocked for DEADLINE_LAPSE_PERIODS of
+ * its periods: a lapsed reservation is released when its entity next wakes (which then runs at its priority's
+ * level, as if it had none), or when a reservation is made and every lapsed one gives its bandwidth back.
+ */
+class DeadlineReservationTable
+{
+public:
+	/**
+	 * @param name The name of the cache the reservations come from, which is set up when the first is made.
+	 */
+	DeadlineReservationTable(const char *name) : _name(name), _cache_ready(false), _count(0)
+	{
+		for (unsigned int i = 0; i < DEADLINE_BUCKETS; i++) {
+			_buckets[i] = NULL;
+		}
+
+		for (unsigned int cpu = 0; cpu < MAX_CPUS; cpu++) {
+			_cpu_bandwidth[cpu] = 0;
+		}
+	}
+
+	/**
+	 * Returns the number of reservations, without taking the lock - so a scheduler can skip looking entities up
+	 * while there are none.
+	 */
+	unsigned int count() const { return __atomic_load_n(&_count, __ATOMIC_RELAXED); }
+
+	/**
+	 * Returns an entity's reservation, which lasts until the entity clears it, or it lapses.
+	 * @param entity The entity, which must be running or queued - so its reservation can't lapse.
+	 * @return Returns the reservation, or NULL if the entity has none.
+	 */
+	DeadlineReservation *lookup(const infos::kernel::SchedulingEntity *entity)
+	{
+		UniqueRawSpinLock l(_lock);
+		return lookup_locked(entity);
+	}
+
+	/**
+	 * Returns the reservation of an entity that is waking, so it can't lapse while the entity is queued - or
+	 * releases it if it already has.
+	 * @param entity The entity.
+	 * @param now The time, in microseconds.
+	 * @return Returns the reservation, or NULL if the entity has none, or it lapsed.
+	 */
+	DeadlineReservation *wake(const infos::kernel::SchedulingEntity *entity, uint64_t now)
+	{
+		UniqueRawSpinLock l(_lock);
+
+		DeadlineReservation *r = lookup_locked(entity);
+		if (!r) return NULL;
+
+		if (lapsed(r, now)) {
+			release_locked(r);
+			return NULL;
+		}
+
+		r->blocked_since = 0;
+		return r;
+	}
+
+	/**
+	 * Starts the lease of a reservation whose entity has blocked - after which it lapses unless the entity wakes.
+	 * The scheduler must not use it again until the entity wakes.
+	 * @param r The reservation.
+	 * @param now The time, in microseconds.
+	 */
+	void block(DeadlineReservation *r, uint64_t now)
+	{
+		UniqueRawSpinLock l(_lock);
+
+		//zero means queued, and only a clock that has just started reads zero
+		r->blocked_since = now ? now : 1;
+	}
+
+	/**
+	 * Makes a reservation for an entity, on the first CPU that has the bandwidth left for it: the preferred CPU,
+	 * or failing that the one with the least bandwidth admitted.  A reservation's bandwidth is its density,
+	 * runtime / deadline, rather than its share of the CPU, runtime / period: EDF only meets every deadline on a
+	 * CPU when the densities add up to at most one, and a deadline shorter than the period needs the runtime
+	 * sooner than its share alone would give it.
+	 * @param entity The entity, which must have no reservation.
+	 * @param runtime, period, deadline The reservation, in microseconds, with runtime <= deadline <= period.
+	 * @param preferred_cpu The CPU to try first.
+	 * @param cpu_mask The CPUs that can be chosen.
+	 * @param limit The bandwidth each CPU can have admitted, in millionths.
+	 * @param now The time, in microseconds.
+	 * @return Returns the reservation, with no job started, or NULL if no CPU could take it.
+	 */
+	DeadlineReservation *admit(infos::kernel::SchedulingEntity *entity, uint64_t runtime, uint64_t period,
+		uint64_t deadline, unsigned int preferred_cpu, uint32_t cpu_mask, uint32_t limit, uint64_t now)
+	{
+		//rounded up, so what is admitted is never less than what is needed
+		uint32_t bandwidth = ((runtime * DEADLINE_BANDWIDTH_UNIT) + deadline - 1) / deadline;
+
+		UniqueRawSpinLock l(_lock);
+
+		//the entities of lapsed reservations may have exited, so this is where their bandwidth is given back
+		for (unsigned int i = 0; i < DEADLINE_BUCKETS; i++) {
+			DeadlineReservation *r = _buckets[i];
+			while (r) {
+				DeadlineReservation *next = r->hash_next;
+				if (lapsed(r, now)) release_locked(r);
+				r = next;
+			}
+		}
+
+		if (lookup_locked(entity)) return NULL;
+
+		unsigned int cpu = preferred_cpu;
+		if (!(cpu_mask & (1U << cpu)) || _cpu_bandwidth[cpu] + bandwidth > limit) {
+			cpu = MAX_CPUS;
+			for (unsigned int c = 0; c < MAX_CPUS; c++) {
+				if (!(cpu_mask & (1U << c)) || _cpu_bandwidth[c] + bandwidth > limit) continue;
+				if (cpu == MAX_CPUS || _cpu_bandwidth[c] < _cpu_bandwidth[cpu]) cpu = c;
+			}
+
+			if (cpu == MAX_CPUS) return NULL;
+		}
+
+		if (!_cache_ready) {
+			_cache.init(_name, sizeof(DeadlineReservation));
+			_cache_ready = true;
+		}
+
+		DeadlineReservation *r = (DeadlineReservation *)_cache.alloc();
+		if (!r) return NULL;
+
+		r->entity = entity;
+		r->runtime = runtime;
+		r->period = period;
+		r->deadline = deadline;
+		r->bandwidth = bandwidth;
+		r->cpu = cpu;
+		r->abs_deadline = 0;
+		r->remaining = 0;
+		r->run_start = 0;
+		r->blocked_since = 0;
+
+		DeadlineReservation *&bucket = bucket_of(entity);
+		r->hash_next = bucket;
+		bucket = r;
+
+		_cpu_bandwidth[cpu] += bandwidth;
+		__atomic_store_n(&_count, _count + 1, __ATOMIC_RELAXED);
+		return r;
+	}
+
+	/**
+	 * Clears a reservation, giving its bandwidth back to its CPU.  The scheduler must have stopped using it.
+	 * @param r The reservation.
+	 */
+	void release(DeadlineReservation *r)
+	{
+		UniqueRawSpinLock l(_lock);
+		release_locked(r);
+	}
+
+private:
+	static bool lapsed(const DeadlineReservation *r, uint64_t now)
+	{
+		return r->blocked_since && now >= r->blocked_since + (DEADLINE_LAPSE_PERIODS * r->period);
+	}
+
+	void release_locked(DeadlineReservation *r)
+	{
+		DeadlineReservation **link = &bucket_of(r->entity);
+		while (*link != r) {
+			link = &(*link)->hash_next;
+		}
+		*link = r->hash_next;
+
+		_cpu_bandwidth[r->cpu] -= r->bandwidth;
+		__atomic_store_n(&_count, _count - 1, __ATOMIC_RELAXED);
+		_cache.free(r);
+	}
+
+	DeadlineReservation *lookup_locked(const infos::kernel::SchedulingEntity *entity)
+	{
+		for (DeadlineReservation *r = bucket_of(entity); r; r = r->hash_next) {
+			if (r->entity == entity) return r;
+		}
+		return NULL;
+	}
+
+	DeadlineReservation *&bucket_of(const infos::kernel::SchedulingEntity *entity)
+	{
+		//entities are heap objects, so the low bits of their addresses carry nothing
+		uintptr_t key = (uintptr_t)entity >> 4;
+		key ^= key >> 8;
+		return _buckets[key & (DEADLINE_BUCKETS - 1)];
+	}
+
+	const char *_name;
+	bool _cache_ready;
+	unsigned int _count;
+	RawSpinLock _lock;
+	DeadlineReservation *_buckets[DEADLINE_BUCKETS];
+	uint32_t _cpu_bandwidth[MAX_CPUS];
+	SlabCache _cache;
+};
@@ -0,0 +1,361 @@
+/*
+ * Intrusive run queues for the coursework schedulers
+ */
+
+#pragma once
+
+#include <infos/define.h>
+#include <infos/kernel/sched.h>
+#include "slab.h"
+#include "smp.h"
+
+/* The buckets in a RunQueueNodeTable - a power of two. */
+#define RUNQUEUE_NODE_BUCKETS	256
+
+/* The locks a RunQueueNodeTable's buckets are striped over - a power of two, at most RUNQUEUE_NODE_BUCKETS. */
+#define RUNQUEUE_NODE_STRIPES	16
+
+/* The nodes a RunQueueNodeTable sets aside on each stripe when it is reserved - enough for every entity queued at
+ * once on a small machine, so a wake-up normally takes a node that already exists. */
+#define RUNQUEUE_NODE_RESERVE	8
+
+/* Not a level: returned for an entity that is never queued (i.e. the idle entity), or when there is no next level. */
+#define NO_LEVEL	0xffffffffU
+
+/**
+ * A set of levels, with constant-time insert, remove and find-first: one bit per level, and a summary word with
+ * one bit per non-empty word of levels.
+ */
+template<unsigned int NR_LEVELS>
+class LevelBitmap
+{
+public:
+	static_assert(NR_LEVELS > 0 && NR_LEVELS <= 64 * 64, "a level bitmap holds at most 4096 levels");
+
+	LevelBitmap() : _summary(0)
+	{
+		for (unsigned int w = 0; w < NR_WORDS; w++) {
+			_words[w] = 0;
+		}
+	}
+
+	void set(unsigned int level)
+	{
+		_words[level / 64] |= 1ULL << (level % 64);
+		_summary |= 1ULL << (level / 64);
+	}
+
+	void clear(unsigned int level)
+	{
+		_words[level / 64] &= ~(1ULL << (level % 64));
+		if (!_words[level / 64]) _summary &= ~(1ULL << (level / 64));
+	}
+
+	bool empty() const { return !_summary; }
+
+	/**
+	 * Returns the lowest level in the set, which must not be empty.
+	 */
+	unsigned int first() const
+	{
+		unsigned int w = __builtin_ctzll(_summary);
+		return (w * 64) + __builtin_ctzll(_words[w]);
+	}
+
+	/**
+	 * Returns the lowest level in the set at or above a given level.
+	 * @param level The level to start from.
+	 * @return Returns the level, or NO_LEVEL if there is none.
+	 */
+	unsigned int next(unsigned int level) const
+	{
+		if (level >= NR_LEVELS) return NO_LEVEL;
+
+		unsigned int w = level / 64;
+		uint64_t bits = _words[w] & (~0ULL << (level % 64));
+		if (bits) return (w * 64) + __builtin_ctzll(bits);
+
+		//then the first non-empty word after this one
+		uint64_t summary = (w < 63) ? (_summary & (~0ULL << (w + 1))) : 0;
+		if (!summary) return NO_LEVEL;
+
+		w = __builtin_ctzll(summary);
+		return (w * 64) + __builtin_ctzll(_words[w]);
+	}
+
+private:
+	static const unsigned int NR_WORDS = (NR_LEVELS + 63) / 64;
+
+	uint64_t _summary;
+	uint64_t _words[NR_WORDS];
+};
+
+/**
+ * A scheduling entity's place in a run queue.  The kernel's SchedulingEntity has no room for a scheduler's links,
+ * so the scheduler keeps one of these for each entity it has queued (see RunQueueNodeTable), and the run queues
+ * link them together instead - so queueing, removing and rotating never allocate.
+ */
+struct RunQueueNode
+{
+	infos::kernel::SchedulingEntity *entity;
+	RunQueueNode *prev, *next;		// on the run queue, which is circular
+	RunQueueNode *hash_next;		// on the node table's bucket for the entity
+	// For the scheduler's use
+	unsigned int level;				// the run queue the node is on
+	unsigned int base_level;		// the run queue the node goes back to, if the scheduler moves it
+	unsigned int cpu;				// the CPU whose run queues the node is on
+	uint64_t since;					// when the node last moved, in the scheduler's units
+	unsigned int budget;			// what is left of the entity's timeslice, in the scheduler's units
+	uint64_t woken;					// the TSC when the entity was added, until it is first picked
+	unsigned int flags;				// anything else the scheduler keeps about the entity
+	void *data;						// e.g. the entity's deadline reservation
+};
+
+/**
+ * A round-robin run queue: a circular, doubly linked list of nodes, with a pointer to the one at its head.  Every
+ * operation is O(1), and none allocates.
+ */
+class RunQueue
+{
+public:
+	RunQueue() : _head(NULL), _count(0) { }
+
+	bool empty() const { return !_head; }
+	unsigned int count() const { return _count; }
+
+	/** Returns the node at the head of the queue, which must not be empty. */
+	RunQueueNode *front() const { return _head; }
+
+	/**
+	 * Adds a node at the tail of the queue, i.e. just behind the head.
+	 * @param node The node, which must not be on a queue.
+	 */
+	void enqueue(RunQueueNode *node)
+	{
+		if (!_head) {
+			node->prev = node;
+			node->next = node;
+			_head = node;
+		} else {
+			node->prev = _head->prev;
+			node->next = _head;
+			_head->prev->next = node;
+			_head->prev = node;
+		}
+		_count++;
+	}
+
+	/**
+	 * Adds a node just in front of another, e.g. to keep the queue sorted.
+	 * @param node The node, which must not be on a queue.
+	 * @param before The node to add it in front of, which must be on this queue - if it is the head, the new node
+	 * becomes the head.
+	 */
+	void insert_before(RunQueueNode *node, RunQueueNode *before)
+	{
+		node->prev = before->prev;
+		node->next = before;
+		before->prev->next = node;
+		before->prev = node;
+		if (_head == before) _head = node;
+		_count++;
+	}
+
+	/**
+	 * Takes a node off the queue, wherever it is in it.
+	 * @param node The node, which must be on this queue.
+	 */
+	void remove(RunQueueNode *node)
+	{
+		if (node->next == node) {
+			_head = NULL;
+		} else {
+			node->prev->next = node->next;
+			node->next->prev = node->prev;
+			if (_head == node) _head = node->next;
+		}
+
+		node->prev = NULL;
+		node->next = NULL;
+		_count--;
+	}
+
+	/**
+	 * Moves the head of the queue to its tail - the same as dequeueing and enqueueing it again, but only a pointer
+	 * moves.  The queue must not be empty.
+	 */
+	void rotate() { _head = _head->next; }
+
+private:
+	RunQueueNode *_head;
+	unsigned int _count;
+};
+
+/**
+ * The nodes of the entities a scheduler has queued, found by entity in O(1) (expected) through a table of buckets
+ * chained through the nodes themselves.
+ *
+ * The buckets are striped over a set of locks: the caller holds the lock of an entity's stripe (lock_of) around
+ * inserting, looking up and erasing its node, so CPUs working on different entities rarely meet.
+ *
+ * An erased node is kept on its stripe's free list, not given back, and insert takes from there - so once the
+ * table is reserved (at scheduler init) a wake-up only allocates if more entities are queued on a stripe than
+ * ever before.  Then the node comes from a slab cache, which may take a page from the page allocator.  That is
+ * done with the stripe lock (and perhaps a run queue lock) held and interrupts off, which is safe because the
+ * page allocator only takes its own locks, with interrupts off, and never calls into the scheduler - so no
+ * lock is ever taken in the opposite order.
+ */
+class RunQueueNodeTable
+{
+public:
+	/**
+	 * @param name The name of the cache the nodes come from, which is set up when the first node is needed.
+	 */
+	RunQueueNodeTable(const char *name) : _name(name), _cache_ready(false)
+	{
+		for (unsigned int i = 0; i < RUNQUEUE_NODE_BUCKETS; i++) {
+			_buckets[i] = NULL;
+		}
+
+		for (unsigned int i = 0; i < RUNQUEUE_NODE_STRIPES; i++) {
+			_stripes[i].free = NULL;
+		}
+	}
+
+	/**
+	 * Sets aside RUNQUEUE_NODE_RESERVE nodes on each stripe, so the first wake-ups don't allocate - call it from
+	 * the scheduler's init, where nothing is locked.
+	 */
+	void reserve()
+	{
+		init_cache();
+
+		for (unsigned int i = 0; i < RUNQUEUE_NODE_STRIPES; i++) {
+			UniqueRawSpinLock l(_stripes[i].lock);
+
+			for (unsigned int n = 0; n < RUNQUEUE_NODE_RESERVE; n++) {
+				RunQueueNode *node = (RunQueueNode *)_node_cache.alloc();
+				if (!node) return;
+
+				node->hash_next = _stripes[i].free;
+				_stripes[i].free = node;
+			}
+		}
+	}
+
+	/**
+	 * Returns the lock that covers an entity's node.
+	 * @param entity The entity.
+	 */
+	RawSpinLock& lock_of(const infos::kernel::SchedulingEntity *entity)
+	{
+		return stripe_of(entity).lock;
+	}
+
+	/**
+	 * Gives an entity a node, which is on no run queue.
+	 * @param entity The entity, which must not have a node already.
+	 * @return Returns the node, or NULL if there was no memory for one.
+	 */
+	RunQueueNode *insert(infos::kernel::SchedulingEntity *entity)
+	{
+		Stripe& stripe = stripe_of(entity);
+
+		RunQueueNode *node = stripe.free;
+		if (node) {
+			stripe.free = node->hash_next;
+		} else {
+			init_cache();
+
+			node = (RunQueueNode *)_node_cache.alloc();
+			if (!node) return NULL;
+		}
+
+		RunQueueNode *&bucket = bucket_of(entity);
+
+		node->entity = entity;
+		node->prev = NULL;
+		node->next = NULL;
+		node->level = 0;
+		node->base_level = 0;
+		node->cpu = 0;
+		node->since = 0;
+		node->budget = 0;
+		node->woken = 0;
+		node->flags = 0;
+		node->data = NULL;
+		node->hash_next = bucket;
+		bucket = node;
+		return node;
+	}
+
+	/**
+	 * Returns an entity's node.
+	 * @param entity The entity.
+	 * @return Returns the node, or NULL if the entity has none.
+	 */
+	RunQueueNode *lookup(const infos::kernel::SchedulingEntity *entity)
+	{
+		for (RunQueueNode *node = bucket_of(entity); node; node = node->hash_next) {
+			if (node->entity == entity) return node;
+		}
+		return NULL;
+	}
+
+	/**
+	 * Takes a node out of the table, and keeps it for the next insert on its stripe.
+	 * @param node The node, which must be on no run queue.
+	 */
+	void erase(RunQueueNode *node)
+	{
+		RunQueueNode **link = &bucket_of(node->entity);
+		while (*link != node) {
+			link = &(*link)->hash_next;
+		}
+		*link = node->hash_next;
+
+		Stripe& stripe = stripe_of(node->entity);
+		node->hash_next = stripe.free;
+		stripe.free = node;
+	}
+
+private:
+	static unsigned int bucket_index(const infos::kernel::SchedulingEntity *entity)
+	{
+		//entities are heap objects, so the low bits of their addresses carry nothing
+		uintptr_t key = (uintptr_t)entity >> 4;
+		key ^= key >> 8;
+		return key & (RUNQUEUE_NODE_BUCKETS - 1);
+	}
+
+	RunQueueNode *&bucket_of(const infos::kernel::SchedulingEntity *entity) { return _buckets[bucket_index(entity)]; }
+
+	struct Stripe {
+		RawSpinLock lock;
+		RunQueueNode *free;			// erased nodes, chained through hash_next
+	} __aligned(64);
+
+	Stripe& stripe_of(const infos::kernel::SchedulingEntity *entity)
+	{
+		return _stripes[bucket_index(entity) % RUNQUEUE_NODE_STRIPES];
+	}
+
+	void init_cache()
+	{
+		if (__atomic_load_n(&_cache_ready, __ATOMIC_ACQUIRE)) return;
+
+		//the first insert on each stripe can race to get here
+		UniqueRawSpinLock l(_setup_lock);
+		if (!_cache_ready) {
+			_node_cache.init(_name, sizeof(RunQueueNode));
+			__atomic_store_n(&_cache_ready, true, __ATOMIC_RELEASE);
+		}
+	}
+
+	const char *_name;
+	bool _cache_ready;
+	RawSpinLock _setup_lock;
+	RunQueueNode *_buckets[RUNQUEUE_NODE_BUCKETS];
+	Stripe _stripes[RUNQUEUE_NODE_STRIPES];
+	SlabCache _node_cache;
+};
@@ -0,0 +1,394 @@
+/*
+ * The Multi-Level Feedback Queue Scheduler
+ */
+
+#include <infos/kernel/sched.h>
+#include <infos/kernel/thread.h>
+#include <infos/kernel/log.h>
+#include <infos/kernel/cmdline.h>
+#include <infos/kernel/kernel.h>
+#include <infos/kernel/syscall.h>
+#include <infos/util/lock.h>
+#include <infos/util/string.h>
+
+#include "runqueue.h"
+#include "schedstat.h"
+#include "smp.h"
+#include "usercopy.h"
+
+using namespace infos::kernel;
+using namespace infos::util;
+
+/* The run queue levels: level 0 is REALTIME's own, and the rest are the feedback levels, from the top down. */
+#define MLFQ_LEVELS			8
+#define MLFQ_TOP_LEVEL		1
+#define MLFQ_BOTTOM_LEVEL	(MLFQ_LEVELS - 1)
+
+/* A node's flag for an entity that is its CPU's current entity, and so on no run queue. */
+#define MLFQ_RUNNING	1
+
+/* The picks in a slice at the top level, unless sched.mlfq.slice=<n> says otherwise - each level down doubles it. */
+#define MLFQ_DEFAULT_SLICE	1
+
+/* The picks between boosts, unless sched.mlfq.boost=<n> says otherwise. */
+#define MLFQ_DEFAULT_BOOST	200
+
+/* The picks in a slice at the top level (sched.mlfq.slice=<n>), which is also REALTIME's round-robin slice. */
+static unsigned int mlfq_slice = MLFQ_DEFAULT_SLICE;
+
+/* The picks between putting every entity back on the top level (sched.mlfq.boost=<n>) - zero never boosts. */
+static unsigned int mlfq_boost_interval = MLFQ_DEFAULT_BOOST;
+
+RegisterCmdLineArgument(MlfqSlice, "sched.mlfq.slice") {
+	unsigned int n = 0;
+	while (*value >= '0' && *value <= '9') {
+		n = (n * 10) + (*value++ - '0');
+	}
+
+	//the bottom level's slice must still fit in a node's budget
+	if (n >= 1 && n <= (1U << 16)) mlfq_slice = n;
+}
+
+RegisterCmdLineArgument(MlfqBoost, "sched.mlfq.boost") {
+	unsigned int n = 0;
+	while (*value >= '0' && *value <= '9') {
+		n = (n * 10) + (*value++ - '0');
+	}
+
+	mlfq_boost_interval = n;
+}
+
+/**
+ * A multi-level feedback queue scheduling algorithm: an entity's level follows how it behaves, rather than the
+ * priority it was created with.  An entity that uses up its whole slice is demoted a level, and one that blocks
+ * starts again from its priority's level when it wakes - so CPU-bound entities sink, and entities that wait on the
+ * user or a timer come back up.  Slices double from each level to the next one down, so the entities that sink
+ * switch less often.  Every sched.mlfq.boost=<n> picks, every runnable entity is put back on the top level, so none
+ * starve however many are above them.
+ *
+ * The priority an entity is created with only says where it starts: INTERACTIVE at the top level, NORMAL one
+ * below, and DAEMON at the bottom.  REALTIME entities are not fed back at all - they run round-robin on a level of
+ * their own, above the rest.
+ *
+ * A running entity is taken off its run queue while it runs, and keeps its CPU until its slice is used up, it
+ * blocks, or an entity at a higher level is waiting.  An entity's node is freed as soon as it blocks: nodes are
+ * found by the entity's address, and an entity that exits can have its address given to a new one, which must not
+ * inherit its level - so nothing is remembered about an entity that is not runnable.
+ *
+ * There is one set of run queues, under one lock - see sched-mq.cpp for per-CPU run queues.  The statistics are
+ * those of sched-mq.cpp (see schedstat.h), kept for each priority class an entity was created with.
+ */
+class MultiLevelFeedbackQueueScheduler : public SchedulingAlgorithm
+{
+public:
+	MultiLevelFeedbackQueueScheduler() : _clock(0), _last_boost(0), _idle_picks(0), _cpus_seen(0), _nodes("sched-mlfq-node")
+	{
+		for (unsigned int cpu = 0; cpu < MAX_CPUS; cpu++) {
+			_current[cpu] = NULL;
+		}
+
+		memset(_stats, 0, sizeof(_stats));
+		memset(_nr_queued, 0, sizeof(_nr_queued));
+	}
+
+	/**
+	 * Returns the friendly name of the algorithm, for debugging and selection purposes.
+	 */
+	const char* name() const override { return "mlfq"; }
+
+	/**
+	 * Called during scheduler initialisation.
+	 */
+	void init()
+	{
+		syslog.messagef(LogLevel::DEBUG, "Scheduling-MLFQ algo init, %u levels, slice %u, boosting every %u picks\n",
+			MLFQ_LEVELS, mlfq_slice, mlfq_boost_interval);
+
+		//set the run queue nodes aside now, while nothing is locked
+		_nodes.reserve();
+
+		//only the algorithm the kernel chose is initialised, so it is the one whose statistics user space sees
+		mlfq_instance = this;
+		sys.syscalls().RegisterSyscall(SYS_GET_SCHEDSTAT, sys_get_schedstat);
+	}
+
+	/**
+	 * Called when a scheduling entity becomes eligible for running.
+	 * @param entity
+	 */
+	void add_to_runqueue(SchedulingEntity& entity) override
+	{
+		unsigned int level = entry_level(entity.priority());
+		if (level == NO_LEVEL) {
+			syslog.messagef(LogLevel::DEBUG, "trying to add IDLE process so nothing to add");
+			return;
+		}
+
+		UniqueIRQLock l;
+		UniqueRawSpinLock ql(_lock);
+		UniqueRawSpinLock nl(_nodes.lock_of(&entity));
+
+		if (_nodes.lookup(&entity)) {
+			syslog.messagef(LogLevel::DEBUG, "trying to add an entity that is already runnable");
+			return;
+		}
+
+		RunQueueNode *node = _nodes.insert(&entity);
+		if (!node) {
+			syslog.messagef(LogLevel::ERROR, "no memory to queue entity");
+			return;
+		}
+
+		node->base_level = level;
+		node->level = level;
+		node->woken = read_tsc();
+		queue(node);
+		_stats[class_of(node)].wakeups++;
+	}
+
+	/**
+	 * Called when a scheduling entity is no longer eligible for running.
+	 * @param entity
+	 */
+	void remove_from_runqueue(SchedulingEntity& entity) override
+	{
+		UniqueIRQLock l;
+		UniqueRawSpinLock ql(_lock);
+		UniqueRawSpinLock nl(_nodes.lock_of(&entity));
+
+		RunQueueNode *node = _nodes.lookup(&entity);
+		if (!node) {
+			syslog.messagef(LogLevel::DEBUG, "trying to remove an entity that is not queued");
+			return;
+		}
+
+		if (node->flags & MLFQ_RUNNING) {
+			_current[node->cpu] = NULL;
+		} else {
+			unqueue(node);
+		}
+
+		_nodes.erase(node);
+	}
+
+	/**
+	 * Called every time a scheduling event occurs, to cause the next eligible entity
+	 * to be chosen.  The next eligible entity might actually be the same entity, if
+	 * e.g. its timeslice has not expired.
+	 */
+	SchedulingEntity *pick_next_entity() override
+	{
+		UniqueIRQLock l;
+		UniqueRawSpinLock ql(_lock);
+
+		unsigned int cpu = current_cpu_id();
+		_cpus_seen |= 1U << cpu;
+		_clock++;
+
+		if (mlfq_boost_interval && _clock - _last_boost >= mlfq_boost_interval) boost();
+
+		RunQueueNode *current = _current[cpu];
+		if (current) {
+			//the running entity keeps its CPU while it has some of its slice left, and nothing more important is waiting
+			if (current->budget && (_nonempty.empty() || current->level <= _nonempty.first())) {
+				current->budget--;
+				return current->entity;
+			}
+
+			if (current->budget) {
+				_stats[class_of(current)].preemptions++;
+			} else if (current->level >= MLFQ_TOP_LEVEL && current->level < MLFQ_BOTTOM_LEVEL) {
+				//it used its whole slice, so it goes down a level
+				current->level++;
+			}
+
+			_current[cpu] = NULL;
+			queue(current);
+		}
+
+		for (unsigned int cls = 0; cls < SCHEDSTAT_CLASSES; cls++) {
+			_stats[cls].queue_length_sum += _nr_queued[cls];
+			if (_nr_queued[cls] > _stats[cls].queue_length_max) _stats[cls].queue_length_max = _nr_queued[cls];
+		}
+
+		if (_nonempty.empty()) {
+			_idle_picks++;
+			return NULL;
+		}
+
+		RunQueueNode *node = _runqueues[_nonempty.first()].front();
+		unqueue(node);
+
+		//this pick is the first of the entity's slice
+		node->flags = MLFQ_RUNNING;
+		node->cpu = cpu;
+		node->budget = slice_of(node->level) - 1;
+		_current[cpu] = node;
+
+		SchedClassStats& stats = _stats[class_of(node)];
+		stats.picks++;
+		if (node->woken) {
+			//the TSCs are in step, but not exactly, and the entity may have been added on another CPU
+			uint64_t now = read_tsc();
+			schedstat_record_latency(stats, now > node->woken ? now - node->woken : 0);
+			node->woken = 0;
+		}
+
+		return node->entity;
+	}
+
+	/**
+	 * Takes a snapshot of the statistics.
+	 * @param stat Receives the statistics.
+	 */
+	void get_schedstat(SchedStat& stat)
+	{
+		memset(&stat, 0, sizeof(stat));
+
+		UniqueIRQLock l;
+		UniqueRawSpinLock ql(_lock);
+
+		stat.nr_levels = MLFQ_LEVELS;
+		stat.nr_cpus = __builtin_popcount(_cpus_seen);
+		stat.picks = _clock;
+		stat.idle_picks = _idle_picks;
+
+		for (unsigned int cls = 0; cls < SCHEDSTAT_CLASSES; cls++) {
+			schedstat_add(stat.classes[cls], _stats[cls]);
+		}
+	}
+
+private:
+	/**
+	 * Given a priority, returns the level its entities start at.
+	 * @param priority The priority of the entity.
+	 * @return Returns the level, or NO_LEVEL if entities of that priority are never queued.
+	 */
+	static unsigned int entry_level(SchedulingEntityPriority::SchedulingEntityPriority priority)
+	{
+		switch (priority) {
+		case SchedulingEntityPriority::REALTIME: return 0;
+		case SchedulingEntityPriority::INTERACTIVE: return MLFQ_TOP_LEVEL;
+		case SchedulingEntityPriority::NORMAL: return MLFQ_TOP_LEVEL + 1;
+		case SchedulingEntityPriority::DAEMON: return MLFQ_BOTTOM_LEVEL;
+		default: return NO_LEVEL;
+		}
+	}
+
+	/**
+	 * Returns the picks in a slice at a level.
+	 */
+	static unsigned int slice_of(unsigned int level)
+	{
+		return level <= MLFQ_TOP_LEVEL ? mlfq_slice : mlfq_slice << (level - MLFQ_TOP_LEVEL);
+	}
+
+	/**
+	 * Returns the priority class a queued entity was created with, for the statistics.
+	 */
+	static unsigned int class_of(const RunQueueNode *node)
+	{
+		unsigned int cls = (unsigned int)node->entity->priority();
+		return cls < SCHEDSTAT_CLASSES ? cls : SCHEDSTAT_CLASSES - 1;
+	}
+
+	/**
+	 * Puts a node on the tail of its level's run queue.
+	 */
+	void queue(RunQueueNode *node)
+	{
+		node->flags = 0;
+		_runqueues[node->level].enqueue(node);
+		_nonempty.set(node->level);
+		_nr_queued[class_of(node)]++;
+	}
+
+	/**
+	 * Takes a node off its level's run queue.
+	 */
+	void unqueue(RunQueueNode *node)
+	{
+		RunQueue& runqueue = _runqueues[node->level];
+		runqueue.remove(node);
+		if (runqueue.empty()) _nonempty.clear(node->level);
+		_nr_queued[class_of(node)]--;
+	}
+
+	/**
+	 * Puts every runnable entity below the top level on the top level.
+	 */
+	void boost()
+	{
+		_last_boost = _clock;
+
+		for (unsigned int level = _nonempty.next(MLFQ_TOP_LEVEL + 1); level != NO_LEVEL; level = _nonempty.next(level + 1)) {
+			RunQueue& runqueue = _runqueues[level];
+			while (!runqueue.empty()) {
+				RunQueueNode *node = runqueue.front();
+				unqueue(node);
+				node->level = MLFQ_TOP_LEVEL;
+				queue(node);
+				_stats[class_of(node)].boosts++;
+			}
+		}
+
+		//the running entities go back on the top level when their slices end
+		for (unsigned int cpu = 0; cpu < MAX_CPUS; cpu++) {
+			RunQueueNode *current = _current[cpu];
+			if (current && current->level > MLFQ_TOP_LEVEL) {
+				current->level = MLFQ_TOP_LEVEL;
+				_stats[class_of(current)].boosts++;
+			}
+		}
+	}
+
+	/**
+	 * SYS_GET_SCHEDSTAT: copies the statistics out to user space.
+	 * @param info The user's struct schedstat.
+	 * @param size The size of the user's structure, so an older one gets a prefix of the statistics.
+	 * @return Returns the number of bytes copied, or -1 if there are no statistics to give, or the structure is not
+	 * in user space.
+	 */
+	static unsigned long sys_get_schedstat(unsigned long info, unsigned long size, unsigned long, unsigned long)
+	{
+		if (!mlfq_instance) return (unsigned long)-1;
+
+		SchedStat snapshot;
+		mlfq_instance->get_schedstat(snapshot);
+
+		if (size > sizeof(snapshot)) size = sizeof(snapshot);
+		if (!copy_to_user(info, &snapshot, size)) return (unsigned long)-1;
+		return size;
+	}
+
+	static MultiLevelFeedbackQueueScheduler *mlfq_instance;
+
+	// Everything below is under this lock
+	RawSpinLock _lock;
+
+	// The run queue of each level, and which of them have anything on them
+	RunQueue _runqueues[MLFQ_LEVELS];
+	LevelBitmap<MLFQ_LEVELS> _nonempty;
+
+	// The node of the entity running on each CPU, which is on no run queue
+	RunQueueNode *_current[MAX_CPUS];
+
+	// The picks made on every CPU, which slices and boosts are measured in
+	uint64_t _clock;
+	uint64_t _last_boost;
+
+	// Statistics, for SYS_GET_SCHEDSTAT
+	SchedClassStats _stats[SCHEDSTAT_CLASSES];
+	uint64_t _nr_queued[SCHEDSTAT_CLASSES];
+	uint64_t _idle_picks;
+	uint32_t _cpus_seen;
+
+	// The node of each runnable entity
+	RunQueueNodeTable _nodes;
+};
+
+MultiLevelFeedbackQueueScheduler *MultiLevelFeedbackQueueScheduler::mlfq_instance;
+
+/* --- DO NOT CHANGE ANYTHING BELOW THIS LINE --- */
+
+RegisterScheduler(MultiLevelFeedbackQueueScheduler);
@@ -1,198 +1,854 @@
 /*
- * The Priority Task Scheduler
- * SKELETON IMPLEMENTATION TO BE FILLED IN FOR TASK 1
+ * The Multiple Queue Priority Scheduler
+ *
+ * Per-CPU round-robin run queues, one per level, found through a bitmap of the non-empty levels - with aging,
+ * per-class timeslices, load balancing between CPUs, and deadline reservations for REALTIME threads.
  */
 
 #include <infos/kernel/sched.h>
 #include <infos/kernel/thread.h>
 #include <infos/kernel/log.h>
-#include <infos/util/list.h>
+#include <infos/kernel/cmdline.h>
+#include <infos/kernel/kernel.h>
+#include <infos/kernel/syscall.h>
 #include <infos/util/lock.h>
 #include <infos/util/string.h>
 
+#include "deadline.h"
+#include "runqueue.h"
+#include "schedstat.h"
+#include "smp.h"
+#include "usercopy.h"
+
 using namespace infos::kernel;
 using namespace infos::util;
 
+/* The priority classes the scheduler is asked to run: REALTIME, INTERACTIVE, NORMAL and DAEMON. */
+#define NR_PRIORITY_CLASSES	4
+
+/* The picks each CPU makes between pulling entities from the busiest CPU, unless sched.balance=<n> says otherwise. */
+#define SCHED_DEFAULT_BALANCE	32
+
+/* The picks between load balancing passes on each CPU (sched.balance=<n>) - zero leaves only idle CPUs stealing. */
+static unsigned int sched_balance_interval = SCHED_DEFAULT_BALANCE;
+
+RegisterCmdLineArgument(SchedBalance, "sched.balance") {
+	unsigned int n = 0;
+	while (*value >= '0' && *value <= '9') {
+		n = (n * 10) + (*value++ - '0');
+	}
+
+	sched_balance_interval = n;
+}
+
+/* The picks an entity waits at a level before it is boosted to the next one up, unless sched.aging=<n> says otherwise. */
+#define SCHED_DEFAULT_AGING		16
+
+/* The picks a waiting entity spends at each level before it is boosted (sched.aging=<n>) - zero turns aging off. */
+static unsigned int sched_aging_interval = SCHED_DEFAULT_AGING;
+
+RegisterCmdLineArgument(SchedAging, "sched.aging") {
+	unsigned int n = 0;
+	while (*value >= '0' && *value <= '9') {
+		n = (n * 10) + (*value++ - '0');
+	}
+
+	sched_aging_interval = n;
+}
+
+/* The picks an entity keeps its CPU for, by priority class, unless sched.timeslice=<r>,<i>,<n>,<d> says otherwise. */
+static unsigned int sched_timeslices[NR_PRIORITY_CLASSES] = { 2, 1, 4, 8 };
+
+RegisterCmdLineArgument(SchedTimeslice, "sched.timeslice") {
+	//as many classes as are given, in priority order - a slice of one re-picks on every scheduling event
+	for (unsigned int cls = 0; cls < NR_PRIORITY_CLASSES && *value; cls++) {
+		unsigned int n = 0;
+		while (*value >= '0' && *value <= '9') {
+			n = (n * 10) + (*value++ - '0');
+		}
+
+		if (n > 0) sched_timeslices[cls] = n;
+		if (*value == ',') value++;
+	}
+}
+
+/* The share of each CPU that deadline reservations can take, in percent, unless sched.deadline=<n> says otherwise. */
+#define SCHED_DEFAULT_DEADLINE_LIMIT	90
+
+/* The bandwidth each CPU can have reserved (sched.deadline=<percent>), in millionths - the rest is left for the levels. */
+static uint32_t sched_deadline_limit = SCHED_DEFAULT_DEADLINE_LIMIT * (DEADLINE_BANDWIDTH_UNIT / 100);
+
+RegisterCmdLineArgument(SchedDeadline, "sched.deadline") {
+	unsigned int n = 0;
+	while (*value >= '0' && *value <= '9') {
+		n = (n * 10) + (*value++ - '0');
+	}
+
+	if (n > 100) n = 100;
+	sched_deadline_limit = n * (DEADLINE_BANDWIDTH_UNIT / 100);
+}
+
+/* The node is on its CPU's deadline queue, and its data is the entity's DeadlineReservation. */
+#define NODE_DEADLINE	1
+
+/* The node is a deadline entity that has used up its runtime, and is waiting for its next release. */
+#define NODE_THROTTLED	2
+
 /**
- * A Multiple Queue priority scheduling algorithm
+ * A multiple queue priority scheduling algorithm: an array of round-robin run queues indexed by level (level 0
+ * runs first), with a bitmap of the non-empty levels, so picking and queueing an entity cost the same however
+ * many levels there are.  The four priority classes are spread evenly over the levels, from REALTIME at level 0
+ * to DAEMON in the last quarter - the levels in between are left for policies that move entities between them.
+ *
+ * The run queues are intrusive (see runqueue.h), so picking an entity only moves a pointer: nothing is allocated
+ * or freed on a scheduling event.  An entity's node is taken from its node table's free list when it is added, and
+ * put back there when it is removed - a node is only allocated, from a slab cache, when more entities are queued
+ * on a stripe of the table than ever before, and never freed.
+ *
+ * Each CPU has run queues of its own, under its own lock: an entity is queued on the CPU that adds it, and a CPU
+ * picks only from its own queues, so CPUs don't contend on a scheduling event.  A CPU with nothing to run steals
+ * from the busiest CPU's highest populated level, and every few picks (sched.balance=<n>) a CPU pulls entities
+ * from the busiest CPU if it is more than one entity behind it.
+ *
+ * So that lower priorities are never starved, waiting entities age: an entity that has waited sched.aging=<n>
+ * picks at a level is boosted to the tail of the level above, and when it next runs it goes back to the level of
+ * its priority.  Each level's queue stays in the order its entities last moved, so only the heads need checking.
+ *
+ * An entity that is picked keeps its CPU for the timeslice of its priority class (sched.timeslice=<r>,<i>,<n>,<d>
+ * picks, by default 2, 1, 4 and 8), unless it blocks or an entity at a higher level becomes runnable - so a short
+ * slice keeps INTERACTIVE entities responsive, and a long one saves DAEMON entities' caches and TLBs from being
+ * refilled on every tick.
+ *
+ * An entity queued at level L on a CPU with N entities queued therefore runs within L * n + N * s picks on that
+ * CPU, where s is the longest timeslice, however busy the levels above it are.
+ *
+ * A REALTIME thread can also reserve runtime microseconds of a CPU every period, to be had within deadline
+ * microseconds of each release (SYS_SCHED_SET_DEADLINE).  A reservation is only admitted on a CPU whose reservations'
+ * densities (runtime / deadline) add up to at most sched.deadline=<percent> of it (by default 90), and the entity
+ * always runs on that CPU - from when it next blocks, if it is running on another - from a queue of its own kept in
+ * order of absolute deadline: the earliest deadline runs ahead of every level.  An entity that uses up its runtime
+ * has its deadline put back a period, with its runtime renewed (a constant bandwidth server), and it waits,
+ * throttled, until its next release - so an overrunning entity can't take more than it reserved from the
+ * others.  Densities that add up to no more than the whole CPU are enough for earliest deadline first to meet every
+ * deadline, so the jobs on a CPU that keep to their runtime all meet their deadlines, and the levels still get what
+ * is left.
+ *
+ * Each CPU counts, for each priority class, its picks, preemptions, boosts and wake-ups, samples its run queue
+ * lengths on every pick, and keeps a log2 histogram of the time from an entity being added to it being picked -
+ * user space reads them with SYS_GET_SCHEDSTAT (see schedstat.h, and /usr/schedstat).
  */
-class MultipleQueuePriorityScheduler : public SchedulingAlgorithm
+template<unsigned int NR_LEVELS>
+class BitmapPriorityScheduler : public SchedulingAlgorithm
 {
 public:
-    /**
-     * Returns the friendly name of the algorithm, for debugging and selection purposes.
-     */
-    const char* name() const override { return "mq"; }
-
-    /**
-     * Called during scheduler initialisation.
-     */
-    void init()
-    {
-        syslog.messagef(LogLevel::DEBUG, "Scheduling-MQ algo init\n");
-    }
-
-    /**
-     * Called when a scheduling entity becomes eligible for running.
-     * @param entity
-     */
-    void add_to_runqueue(SchedulingEntity& entity) override
-    {           
-        //syslog.messagef(LogLevel::DEBUG, "OS has asked to add entity to runqueue, getting priority and name");
-
-        UniqueIRQLock l;
-
-        SchedulingEntityPriority::SchedulingEntityPriority entity_priority = entity.priority();
-        //syslog.messagef(LogLevel::DEBUG, "Got priority ");
-
-        const infos::util::String entity_name = entity.name();
-        //syslog.messagef(LogLevel::DEBUG, "Got name %s!", entity_name.c_str());
-
-        //REALTIME
-        if (entity_priority == SchedulingEntityPriority::REALTIME) {
-            realtime_runqueue.enqueue(&entity);
-            //syslog.messagef(LogLevel::DEBUG, "Adding entitity {%s} from REALTIME",entity_name.c_str());
-        }
-		
-        //INTERACTIVE
-        else if (entity_priority == SchedulingEntityPriority::INTERACTIVE) {
-            interactive_runqueue.enqueue(&entity);
-            //syslog.messagef(LogLevel::DEBUG, "Adding entitity {%s} from INTERACTIVE",entity_name.c_str());
-        }
-
-        //NORMAL
-        else if (entity_priority == SchedulingEntityPriority::NORMAL) { 
-            normal_runqueue.enqueue(&entity);
-            //syslog.messagef(LogLevel::DEBUG, "Adding entitity {%s} from NORMAL",entity_name.c_str());
-        }
-
-        //DAEMON
-        else  if (entity_priority == SchedulingEntityPriority::DAEMON) {
-            daemon_runqueue.enqueue(&entity);
-            //syslog.messagef(LogLevel::DEBUG, "Removing entitity {%s} of priority DAEMON",entity_name.c_str());
-        }
-
-        //IDLE - should not happen
-        else {
-            syslog.messagef(LogLevel::DEBUG, "trying to add IDLE process so nothing to add");
-        }
-    }
-
-    /**
-     * Called when a scheduling entity is no longer eligible for running.
-     * @param entity
-     */
-    void remove_from_runqueue(SchedulingEntity& entity) override
-    {   
-        
-        //syslog.messagef(LogLevel::DEBUG, "OS has asked to remove entity to runqueue, getting priority and name");
-        
-        UniqueIRQLock l;
-
-        SchedulingEntityPriority::SchedulingEntityPriority entity_priority = entity.priority();
-        //syslog.messagef(LogLevel::DEBUG, "Got priority");
-
-        const infos::util::String entity_name = entity.name();
-        //syslog.messagef(LogLevel::DEBUG, "Got name %s!", entity_name.c_str());
-        
-        //REALTIME
-        if (entity_priority == SchedulingEntityPriority::REALTIME) {    
-            realtime_runqueue.remove(&entity);
-            //syslog.messagef(LogLevel::DEBUG, "Removing entitity {%s} from REALTIME",entity_name.c_str());
-        }
-		
-
-        //INTERACTIVE
-        else if (entity_priority == SchedulingEntityPriority::INTERACTIVE) {
-            interactive_runqueue.remove(&entity);
-            //syslog.messagef(LogLevel::DEBUG, "Removing entitity {%s} from INTERACTIVE ",entity_name.c_str());
-        }
-
-        //NORMAL
-        else if (entity_priority == SchedulingEntityPriority::NORMAL) {
-            normal_runqueue.remove(&entity);
-            //syslog.messagef(LogLevel::DEBUG, "Removing entitity {%s} from NORMAL",entity_name.c_str());
-        }
-
-        //DAEMON
-        else if (entity_priority == SchedulingEntityPriority::DAEMON) {
-            daemon_runqueue.remove(&entity);
-            //syslog.messagef(LogLevel::DEBUG, "Removing entitity {%s} of priority DAEMON",entity_name.c_str());
-        }
-
-        //IDLE - should not happen
-        else {
-            syslog.messagef(LogLevel::DEBUG, "trying to remove IDLE process");
-        }
-    }
-
-    /**
-     * Called every time a scheduling event occurs, to cause the next eligible entity
-     * to be chosen.  The next eligible entity might actually be the same entity, if
-     * e.g. its timeslice has not expired.
-     */
-    SchedulingEntity *pick_next_entity() override
-    {   
-        //syslog.messagef(LogLevel::DEBUG, "OS has asked for a scheduling event occurs, to cause the next eligible entity to be chosen");
-        
-        //look at the different queues of priorities of the thread, return top of queue if last process left
-        //round-robin fashion to finish/point-to the current process to non-empty highest priority queue 
-        //otherwise go to the next priority queue 
-        
-        //start with realtime queue 
-        if (!realtime_runqueue.empty())  {
-            UniqueIRQLock l;
-            //syslog.messagef(LogLevel::DEBUG, "REALTIME(%d) process(s) left to execute",realtime_runqueue.count());
-            //get the first entity on top of the queue 
-            SchedulingEntity *entity = realtime_runqueue.dequeue(); 
-            //put at the end of queue and return entity 
-            realtime_runqueue.enqueue(entity);
-            return entity; 
-        } 
-        
-        //realtime queue is empty so move to interactive 
-        else if (!interactive_runqueue.empty())  {
-            UniqueIRQLock l;
-            //syslog.messagef(LogLevel::DEBUG, "INTERACTIVE(%d) process(s) left to execute",interactive_runqueue.count());
-            SchedulingEntity *entity = interactive_runqueue.dequeue(); 
-            interactive_runqueue.enqueue(entity);
-            return entity; 
-        } 
-        
-        //interactive  queue is empty so move to daemon
-        else if (!normal_runqueue.empty())  {
-            UniqueIRQLock l;
-            //syslog.messagef(LogLevel::DEBUG, "NORMAL process(%d) left to execute", normal_runqueue.count());
-            SchedulingEntity *entity = normal_runqueue.dequeue(); 
-            normal_runqueue.enqueue(entity);
-            return entity; 
-        } 
-        
-        //daemon queue is empty so return null
-        else if (daemon_runqueue.empty()) {
-            //syslog.messagef(LogLevel::DEBUG, "Nothing left to execute");
-            return NULL;
-        }
-        
-        //get top of daemon queue
-        else  {
-            UniqueIRQLock l;
-            //syslog.messagef(LogLevel::DEBUG, "DAEMON(%d) process left to execute",daemon_runqueue.count());
-            SchedulingEntity *entity = daemon_runqueue.dequeue(); 
-            daemon_runqueue.enqueue(entity);
-            return entity;  
-        }
-    }
+	static_assert(NR_LEVELS >= NR_PRIORITY_CLASSES, "every priority class needs a level of its own");
+
+	BitmapPriorityScheduler() : _nodes("sched-mq-node"), _reservations("sched-mq-deadline") { }
+
+	/**
+	 * Returns the friendly name of the algorithm, for debugging and selection purposes.
+	 */
+	const char* name() const override { return "mq"; }
+
+	/**
+	 * Called during scheduler initialisation.
+	 */
+	void init()
+	{
+		syslog.messagef(LogLevel::DEBUG, "Scheduling-MQ algo init, %u levels, balancing every %u picks, aging every %u, "
+			"reserving up to %u/%u of each CPU\n", NR_LEVELS, sched_balance_interval, sched_aging_interval,
+			sched_deadline_limit, DEADLINE_BANDWIDTH_UNIT);
+
+		//set the run queue nodes aside now, while nothing is locked
+		_nodes.reserve();
+
+		//only the algorithm the kernel chose is initialised, so it is the one whose statistics user space sees
+		mq_instance = this;
+		sys.syscalls().RegisterSyscall(SYS_GET_SCHEDSTAT, sys_get_schedstat);
+		sys.syscalls().RegisterSyscall(SYS_SCHED_SET_DEADLINE, sys_sched_set_deadline);
+	}
+
+	/**
+	 * Gives a REALTIME entity a deadline reservation, on this CPU if it has the bandwidth left, or else on the CPU
+	 * with the least reserved.  If the entity is queued here (e.g. it is the caller), the reservation applies at
+	 * once.  An entity that is running can't be moved to another CPU until it has been switched out, so one that is
+	 * queued on another CPU than its reservation's keeps running there, at its priority's level and without being
+	 * charged for it, until it next blocks - the reservation applies from when it is next added.
+	 * @param entity The entity, which must have no reservation.
+	 * @param runtime, period, deadline The reservation, in microseconds.  A deadline of zero is the period.
+	 * @return Returns 0 if the reservation was admitted and applies at once (or the entity is not queued), 1 if it
+	 * was admitted but only applies once the entity blocks and wakes, or -1 if it is not valid, or no CPU can take it.
+	 */
+	int set_deadline(SchedulingEntity& entity, uint64_t runtime, uint64_t period, uint64_t deadline)
+	{
+		if (entity.priority() != SchedulingEntityPriority::REALTIME) return -1;
+
+		if (!deadline) deadline = period;
+		if (!runtime || runtime > deadline || deadline > period || period > DEADLINE_MAX_PERIOD) return -1;
+
+		UniqueIRQLock l;
+
+		//a CPU that has never picked an entity may not be up, so it is given no reservations
+		unsigned int cpu = current_cpu_id();
+		uint32_t cpu_mask = 1U << cpu;
+		for (unsigned int c = 0; c < MAX_CPUS; c++) {
+			if (__atomic_load_n(&_cpu[c].clock, __ATOMIC_RELAXED)) cpu_mask |= 1U << c;
+		}
+
+		uint64_t now = sched_clock_us();
+		DeadlineReservation *reservation = _reservations.admit(&entity, runtime, period, deadline, cpu, cpu_mask,
+			sched_deadline_limit, now);
+		if (!reservation) return -1;
+
+		UniqueRawSpinLock nl(_nodes.lock_of(&entity));
+		RunQueueNode *node = _nodes.lookup(&entity);
+		if (!node) return 0;
+
+		if (reservation->cpu != cpu) return 1;
+
+		PerCPURunQueues& rq = _cpu[cpu];
+		UniqueRawSpinLock rl(rq.lock);
+
+		//once this CPU's lock is held, an entity queued here can't be stolen
+		if (node->cpu != cpu) return 1;
+
+		dequeue(rq, node);
+		node->flags |= NODE_DEADLINE;
+		node->data = reservation;
+		start_job(reservation, now);
+		reservation->run_start = now;
+		enqueue_deadline(rq, cpu, node);
+		return 0;
+	}
+
+	/**
+	 * Clears an entity's deadline reservation, so it goes back to the level of its priority, and gives its
+	 * bandwidth back.
+	 * @param entity The entity.
+	 * @return Returns true if the entity had a reservation.
+	 */
+	bool clear_deadline(SchedulingEntity& entity)
+	{
+		UniqueIRQLock l;
+		UniqueRawSpinLock nl(_nodes.lock_of(&entity));
+
+		DeadlineReservation *reservation = _reservations.lookup(&entity);
+		if (!reservation) return false;
+
+		//only a queued entity's node can be using the reservation, and it can't move off the reservation's CPU
+		RunQueueNode *node = _nodes.lookup(&entity);
+		if (node && (node->flags & NODE_DEADLINE)) {
+			PerCPURunQueues& rq = _cpu[node->cpu];
+			UniqueRawSpinLock rl(rq.lock);
+
+			dequeue(rq, node);
+			node->flags &= ~(NODE_DEADLINE | NODE_THROTTLED);
+			node->data = NULL;
+			node->level = node->base_level;
+			enqueue(rq, node->cpu, node);
+		}
+
+		_reservations.release(reservation);
+		return true;
+	}
+
+	/**
+	 * Adds up every CPU's statistics.  No locks are taken, so they may be a little out while CPUs are scheduling.
+	 * @param stat Receives the statistics.
+	 */
+	void get_schedstat(SchedStat& stat) const
+	{
+		memset(&stat, 0, sizeof(stat));
+		stat.nr_levels = NR_LEVELS;
+
+		for (unsigned int cpu = 0; cpu < MAX_CPUS; cpu++) {
+			const PerCPURunQueues& rq = _cpu[cpu];
+
+			uint64_t picks = __atomic_load_n(&rq.clock, __ATOMIC_RELAXED);
+			if (!picks) continue;
+
+			stat.nr_cpus++;
+			stat.picks += picks;
+			stat.idle_picks += __atomic_load_n(&rq.idle_picks, __ATOMIC_RELAXED);
+			stat.migrations += __atomic_load_n(&rq.migrations, __ATOMIC_RELAXED);
+
+			for (unsigned int cls = 0; cls < SCHEDSTAT_CLASSES; cls++) {
+				schedstat_add(stat.classes[cls], rq.stats[cls]);
+			}
+		}
+	}
+
+	/**
+	 * Called when a scheduling entity becomes eligible for running.
+	 * @param entity
+	 */
+	void add_to_runqueue(SchedulingEntity& entity) override
+	{
+		unsigned int level = level_of(entity.priority());
+		if (level == NO_LEVEL) {
+			syslog.messagef(LogLevel::DEBUG, "trying to add IDLE process so nothing to add");
+			return;
+		}
+
+		UniqueIRQLock l;
+		UniqueRawSpinLock nl(_nodes.lock_of(&entity));
+
+		RunQueueNode *node = _nodes.insert(&entity);
+		if (!node) {
+			syslog.messagef(LogLevel::ERROR, "no memory to queue entity");
+			return;
+		}
+
+		//an entity with a deadline reservation always runs on the CPU it was admitted on, in deadline order
+		unsigned int cpu = current_cpu_id();
+		DeadlineReservation *reservation = NULL;
+		if (entity.priority() == SchedulingEntityPriority::REALTIME && _reservations.count()) {
+			reservation = _reservations.wake(&entity, sched_clock_us());
+			if (reservation) cpu = reservation->cpu;
+		}
+
+		UniqueRawSpinLock rl(_cpu[cpu].lock);
+
+		node->base_level = level;
+		node->level = level;
+		node->woken = read_tsc();
+
+		if (reservation) {
+			node->flags |= NODE_DEADLINE;
+			node->data = reservation;
+			start_job(reservation, sched_clock_us());
+			enqueue_deadline(_cpu[cpu], cpu, node);
+		} else {
+			enqueue(_cpu[cpu], cpu, node);
+		}
+
+		schedstat_inc(_cpu[cpu].stats[class_of(level)].wakeups);
+	}
+
+	/**
+	 * Called when a scheduling entity is no longer eligible for running.
+	 * @param entity
+	 */
+	void remove_from_runqueue(SchedulingEntity& entity) override
+	{
+		UniqueIRQLock l;
+		UniqueRawSpinLock nl(_nodes.lock_of(&entity));
+
+		//the node says which queue the entity is on, and an entity that was never queued (e.g. the idle entity) has none
+		RunQueueNode *node = _nodes.lookup(&entity);
+		if (!node) {
+			syslog.messagef(LogLevel::DEBUG, "trying to remove an entity that is not queued");
+			return;
+		}
+
+		//holding the node's stripe keeps it alive, but it can still be stolen onto another CPU until that CPU's lock is held
+		for (;;) {
+			unsigned int cpu = __atomic_load_n(&node->cpu, __ATOMIC_RELAXED);
+			PerCPURunQueues& rq = _cpu[cpu];
+
+			rq.lock.lock();
+			if (node->cpu == cpu) {
+				if (rq.current == node) {
+					//a deadline entity that blocks is charged for what it ran, so its next job is only started early if it can afford it
+					if (node->flags & NODE_DEADLINE) charge(rq, node, sched_clock_us());
+					rq.current = NULL;
+				}
+				if (rq.previous == node) rq.previous = NULL;
+
+				dequeue(rq, node);
+				rq.lock.unlock();
+				break;
+			}
+			rq.lock.unlock();
+		}
+
+		//the reservation is only kept for the entity while it is blocked for a few periods - it may have exited
+		if (node->flags & NODE_DEADLINE) _reservations.block(reservation_of(node), sched_clock_us());
+
+		_nodes.erase(node);
+	}
+
+	/**
+	 * Called every time a scheduling event occurs, to cause the next eligible entity
+	 * to be chosen.  The next eligible entity might actually be the same entity, if
+	 * e.g. its timeslice has not expired.
+	 */
+	SchedulingEntity *pick_next_entity() override
+	{
+		UniqueIRQLock l;
+
+		unsigned int cpu = current_cpu_id();
+		PerCPURunQueues& rq = _cpu[cpu];
+
+		//only this CPU touches its countdown, so it needs no lock
+		if (sched_balance_interval && ++rq.picks_since_balance >= sched_balance_interval) {
+			rq.picks_since_balance = 0;
+			pull(cpu, PULL_ALL);
+		}
+
+		if (!__atomic_load_n(&rq.nr_queued, __ATOMIC_RELAXED)) {
+			pull(cpu, 1);
+		}
+
+		UniqueRawSpinLock rl(rq.lock);
+
+		//whatever is picked, the entity that was running is only switched away from once this pick returns
+		rq.previous = rq.current;
+
+		__atomic_store_n(&rq.clock, rq.clock + 1, __ATOMIC_RELAXED);
+		if (sched_aging_interval) age(rq, cpu);
+
+		if (!rq.deadline_queue.empty() || !rq.throttled.empty()) {
+			SchedulingEntity *entity = pick_deadline(rq);
+			if (entity) return entity;
+		}
+
+		if (rq.nonempty.empty()) {
+			rq.current = NULL;
+			schedstat_inc(rq.idle_picks);
+			return NULL;
+		}
+
+		sample_queue_lengths(rq);
+
+		//the running entity keeps its CPU while it has some of its slice left, and nothing more important is waiting
+		RunQueueNode *current = rq.current;
+		if (current && current->budget) {
+			if (current->level <= rq.nonempty.first()) {
+				current->budget--;
+
+				//its wait starts again, so it goes to the tail of its level, which stays in the order its entities last moved
+				dequeue(rq, current);
+				enqueue(rq, cpu, current);
+				return current->entity;
+			}
+
+			schedstat_inc(rq.stats[class_of(current->base_level)].preemptions);
+		}
+
+		//the first non-empty level runs round-robin: take the entity at its head, and move the head on past it
+		RunQueue& runqueue = rq.runqueues[rq.nonempty.first()];
+		RunQueueNode *node = runqueue.front();
+
+		if (node->level != node->base_level) {
+			//a boosted entity has had its turn, so it goes back to the level of its priority
+			dequeue(rq, node);
+			node->level = node->base_level;
+			enqueue(rq, cpu, node);
+		} else {
+			runqueue.rotate();
+			node->since = rq.clock;
+		}
+
+		//this pick is the first of the entity's slice
+		unsigned int cls = class_of(node->base_level);
+		node->budget = sched_timeslices[cls] - 1;
+
+		schedstat_inc(rq.stats[cls].picks);
+		if (node->woken) {
+			//the TSCs are in step, but not exactly, and the entity may have been added on another CPU
+			uint64_t now = read_tsc();
+			schedstat_record_latency(rq.stats[cls], now > node->woken ? now - node->woken : 0);
+			node->woken = 0;
+		}
+
+		rq.current = node;
+		return node->entity;
+	}
 
 private:
-    // A list to keep track of the current runqueue 
-    List<SchedulingEntity *> realtime_runqueue;
-    List<SchedulingEntity *> interactive_runqueue;
-    List<SchedulingEntity *> normal_runqueue;
-    List<SchedulingEntity *> daemon_runqueue;
+	/* Passed to pull for as many entities as it takes to even two CPUs out. */
+	static const unsigned int PULL_ALL = ~0U;
+
+	// A CPU's run queues, and which of them have anything on them
+	struct PerCPURunQueues {
+		RawSpinLock lock;
+		RunQueue runqueues[NR_LEVELS];
+		LevelBitmap<NR_LEVELS> nonempty;
+		RunQueue deadline_queue;		// the entities with reservations admitted here, earliest deadline first
+		RunQueue throttled;				// and those waiting for their next release
+		unsigned int nr_queued;			// read without the lock by CPUs looking for one to steal from
+		RunQueueNode *current;			// the node last picked here, which is running, so never stolen
+		RunQueueNode *previous;			// the node that was running before the last pick, which may still be switching out
+		unsigned int picks_since_balance;
+		uint64_t clock;					// the picks made here, which waits are measured in
+
+		// Statistics, for SYS_GET_SCHEDSTAT
+		SchedClassStats stats[SCHEDSTAT_CLASSES];
+		uint64_t idle_picks;
+		uint64_t migrations;			// entities pulled here from another CPU
+
+		PerCPURunQueues() : nr_queued(0), current(NULL), previous(NULL), picks_since_balance(0), clock(0), idle_picks(0), migrations(0)
+		{
+			memset(stats, 0, sizeof(stats));
+		}
+	} __aligned(64);
+
+	/**
+	 * Given a priority, returns the level its entities are queued at.
+	 * @param priority The priority of the entity.
+	 * @return Returns the level, or NO_LEVEL if entities of that priority are never queued.
+	 */
+	static unsigned int level_of(SchedulingEntityPriority::SchedulingEntityPriority priority)
+	{
+		unsigned int cls;
+		switch (priority) {
+		case SchedulingEntityPriority::REALTIME: cls = 0; break;
+		case SchedulingEntityPriority::INTERACTIVE: cls = 1; break;
+		case SchedulingEntityPriority::NORMAL: cls = 2; break;
+		case SchedulingEntityPriority::DAEMON: cls = 3; break;
+		default: return NO_LEVEL;
+		}
+
+		return (cls * NR_LEVELS) / NR_PRIORITY_CLASSES;
+	}
+
+	/**
+	 * Given a level an entity is queued at for its priority, returns the priority class.
+	 */
+	static unsigned int class_of(unsigned int level)
+	{
+		return (level * NR_PRIORITY_CLASSES) / NR_LEVELS;
+	}
+
+	/**
+	 * Puts a node on the tail of its level's run queue on a CPU, whose lock is held.  Its wait starts now.
+	 */
+	static void enqueue(PerCPURunQueues& rq, unsigned int cpu, RunQueueNode *node)
+	{
+		node->since = rq.clock;
+		rq.runqueues[node->level].enqueue(node);
+		rq.nonempty.set(node->level);
+		__atomic_store_n(&node->cpu, cpu, __ATOMIC_RELAXED);
+		__atomic_store_n(&rq.nr_queued, rq.nr_queued + 1, __ATOMIC_RELAXED);
+	}
+
+	/**
+	 * Takes a node off a CPU's run queues, or its deadline queue, whose lock is held.
+	 */
+	static void dequeue(PerCPURunQueues& rq, RunQueueNode *node)
+	{
+		if (node->flags & NODE_DEADLINE) {
+			RunQueue& queue = (node->flags & NODE_THROTTLED) ? rq.throttled : rq.deadline_queue;
+			queue.remove(node);
+			__atomic_store_n(&rq.nr_queued, rq.nr_queued - 1, __ATOMIC_RELAXED);
+			return;
+		}
+
+		RunQueue& runqueue = rq.runqueues[node->level];
+		runqueue.remove(node);
+		if (runqueue.empty()) rq.nonempty.clear(node->level);
+		__atomic_store_n(&rq.nr_queued, rq.nr_queued - 1, __ATOMIC_RELAXED);
+	}
+
+	/**
+	 * Puts a node on a CPU's deadline queue, whose lock is held, in order of its job's absolute deadline - behind any
+	 * with the same deadline.
+	 */
+	static void enqueue_deadline(PerCPURunQueues& rq, unsigned int cpu, RunQueueNode *node)
+	{
+		RunQueue& queue = rq.deadline_queue;
+		uint64_t deadline = reservation_of(node)->abs_deadline;
+
+		//only entities admitted on this CPU are on its queue, so it is short enough to walk
+		RunQueueNode *before = NULL;
+		if (!queue.empty()) {
+			RunQueueNode *pos = queue.front();
+			do {
+				if (deadline < reservation_of(pos)->abs_deadline) {
+					before = pos;
+					break;
+				}
+				pos = pos->next;
+			} while (pos != queue.front());
+		}
+
+		if (before) {
+			queue.insert_before(node, before);
+		} else {
+			queue.enqueue(node);
+		}
+
+		__atomic_store_n(&node->cpu, cpu, __ATOMIC_RELAXED);
+		__atomic_store_n(&rq.nr_queued, rq.nr_queued + 1, __ATOMIC_RELAXED);
+	}
+
+	static DeadlineReservation *reservation_of(RunQueueNode *node) { return (DeadlineReservation *)node->data; }
+
+	/**
+	 * Starts a new job for a reservation that is being added, unless its current one can still run to its deadline
+	 * without taking more than the density it was admitted with - i.e. if the deadline has passed, or
+	 * remaining / (abs_deadline - now) > runtime / deadline.
+	 */
+	static void start_job(DeadlineReservation *reservation, uint64_t now)
+	{
+		if (now >= reservation->abs_deadline
+			|| reservation->remaining * reservation->deadline > (reservation->abs_deadline - now) * reservation->runtime) {
+			reservation->abs_deadline = now + reservation->deadline;
+			reservation->remaining = reservation->runtime;
+		}
+	}
+
+	/**
+	 * Charges a deadline entity on a CPU, whose lock is held, for the time it has run since it was picked or last
+	 * charged.  If it has used up its job's runtime, its deadline is put back a period and its runtime renewed, and
+	 * it is throttled until the release of that job.
+	 */
+	static void charge(PerCPURunQueues& rq, RunQueueNode *node, uint64_t now)
+	{
+		DeadlineReservation *reservation = reservation_of(node);
+
+		uint64_t ran = now > reservation->run_start ? now - reservation->run_start : 0;
+		reservation->run_start = now;
+
+		if (ran < reservation->remaining) {
+			reservation->remaining -= ran;
+			return;
+		}
+
+		reservation->abs_deadline += reservation->period;
+		reservation->remaining = reservation->runtime;
+
+		rq.deadline_queue.remove(node);
+		if (now < reservation->abs_deadline - reservation->deadline) {
+			node->flags |= NODE_THROTTLED;
+			rq.throttled.enqueue(node);
+		} else {
+			__atomic_store_n(&rq.nr_queued, rq.nr_queued - 1, __ATOMIC_RELAXED);
+			enqueue_deadline(rq, node->cpu, node);
+		}
+	}
+
+	/**
+	 * Moves the throttled entities on a CPU, whose lock is held, whose next job has been released back onto its
+	 * deadline queue.
+	 */
+	static void unthrottle(PerCPURunQueues& rq, uint64_t now)
+	{
+		while (!rq.throttled.empty()) {
+			//there are only as many as there are reservations on this CPU, so they are all checked
+			RunQueueNode *node = NULL, *pos = rq.throttled.front();
+			do {
+				DeadlineReservation *reservation = reservation_of(pos);
+				if (now >= reservation->abs_deadline - reservation->deadline) {
+					node = pos;
+					break;
+				}
+				pos = pos->next;
+			} while (pos != rq.throttled.front());
+
+			if (!node) return;
+
+			rq.throttled.remove(node);
+			node->flags &= ~NODE_THROTTLED;
+			__atomic_store_n(&rq.nr_queued, rq.nr_queued - 1, __ATOMIC_RELAXED);
+			enqueue_deadline(rq, node->cpu, node);
+		}
+	}
+
+	/**
+	 * Picks the deadline entity with the earliest deadline on a CPU, whose lock is held, ahead of anything queued
+	 * at a level.
+	 * @return Returns the entity, or NULL if every deadline entity on the CPU is throttled - in which case the
+	 * levels are picked from as usual.
+	 */
+	static SchedulingEntity *pick_deadline(PerCPURunQueues& rq)
+	{
+		uint64_t now = sched_clock_us();
+
+		RunQueueNode *current = rq.current;
+		if (current && (current->flags & NODE_DEADLINE)) {
+			charge(rq, current, now);
 
+			//a throttled entity gives up its CPU, and a level entity starts a fresh slice
+			if (current->flags & NODE_THROTTLED) {
+				current = NULL;
+				rq.current = NULL;
+			}
+		}
+
+		unthrottle(rq, now);
+		if (rq.deadline_queue.empty()) return NULL;
+
+		sample_queue_lengths(rq);
+
+		RunQueueNode *node = rq.deadline_queue.front();
+		reservation_of(node)->run_start = now;
+		if (node == current) return node->entity;
+
+		if (current && ((current->flags & NODE_DEADLINE) ? reservation_of(current)->remaining : current->budget)) {
+			schedstat_inc(rq.stats[class_of(current->base_level)].preemptions);
+		}
+
+		unsigned int cls = class_of(node->base_level);
+		schedstat_inc(rq.stats[cls].picks);
+		if (node->woken) {
+			uint64_t tsc = read_tsc();
+			schedstat_record_latency(rq.stats[cls], tsc > node->woken ? tsc - node->woken : 0);
+			node->woken = 0;
+		}
+
+		rq.current = node;
+		return node->entity;
+	}
+
+	/**
+	 * Boosts the entity at the head of each level on a CPU, whose lock is held, to the tail of the level above, if it
+	 * has waited sched.aging=<n> picks.  Only the heads are looked at, so a pick costs one check per non-empty level
+	 * however many entities are queued - any others that are due are boosted on the picks that follow.
+	 */
+	static void age(PerCPURunQueues& rq, unsigned int cpu)
+	{
+		for (unsigned int level = rq.nonempty.next(1); level != NO_LEVEL; level = rq.nonempty.next(level + 1)) {
+			//the queue is in the order its entities last moved, so the head has waited longest
+			RunQueueNode *node = rq.runqueues[level].front();
+			if (rq.clock - node->since < sched_aging_interval) continue;
+
+			dequeue(rq, node);
+			node->level = level - 1;
+			enqueue(rq, cpu, node);
+			schedstat_inc(rq.stats[class_of(node->base_level)].boosts);
+		}
+	}
+
+	/**
+	 * Moves entities to a CPU from the CPU with the most entities queued, if that one has at least two more -
+	 * the highest priority ones first, and never the one the busiest CPU is running, or the one it last switched
+	 * away from, until that CPU's next pick.
+	 * @param cpu The CPU to move the entities to, which is the CPU we are running on.
+	 * @param max The most entities to move.
+	 * @return Returns the number of entities moved.
+	 */
+	unsigned int pull(unsigned int cpu, unsigned int max)
+	{
+		//find the busiest CPU without taking any locks, then check again once they're held
+		unsigned int busiest = cpu, busiest_load = __atomic_load_n(&_cpu[cpu].nr_queued, __ATOMIC_RELAXED) + 1;
+		for (unsigned int c = 0; c < MAX_CPUS; c++) {
+			unsigned int load = __atomic_load_n(&_cpu[c].nr_queued, __ATOMIC_RELAXED);
+			if (load > busiest_load) {
+				busiest = c;
+				busiest_load = load;
+			}
+		}
+
+		if (busiest == cpu) return 0;
+
+		PerCPURunQueues& dst = _cpu[cpu];
+		PerCPURunQueues& src = _cpu[busiest];
+
+		//always lock the lower numbered CPU first, so two CPUs pulling from each other can't deadlock
+		RawSpinLock& first = (cpu < busiest) ? dst.lock : src.lock;
+		RawSpinLock& second = (cpu < busiest) ? src.lock : dst.lock;
+		UniqueRawSpinLock l1(first);
+		UniqueRawSpinLock l2(second);
+
+		if (src.nr_queued < dst.nr_queued + 2) return 0;
+
+		unsigned int count = (src.nr_queued - dst.nr_queued) / 2;
+		if (count > max) count = max;
+
+		unsigned int moved = 0;
+		for (unsigned int level = src.nonempty.next(0); level != NO_LEVEL && moved < count; level = src.nonempty.next(level + 1)) {
+			RunQueue& runqueue = src.runqueues[level];
+
+			while (moved < count && !runqueue.empty()) {
+				//take from the head, which has waited longest - passing over the running entity, and the one it took over from, which stay put
+				RunQueueNode *node = NULL, *pos = runqueue.front();
+				do {
+					if (pos != src.current && pos != src.previous) {
+						node = pos;
+						break;
+					}
+					pos = pos->next;
+				} while (pos != runqueue.front());
+
+				if (!node) break;
+
+				dequeue(src, node);
+				enqueue(dst, cpu, node);
+				moved++;
+			}
+		}
+
+		schedstat_inc(dst.migrations, moved);
+		return moved;
+	}
+
+	/**
+	 * Adds the length of each class's run queues on a CPU, whose lock is held, to the class's statistics.
+	 */
+	static void sample_queue_lengths(PerCPURunQueues& rq)
+	{
+		uint64_t lengths[SCHEDSTAT_CLASSES] = { rq.deadline_queue.count() + rq.throttled.count() };
+		for (unsigned int level = rq.nonempty.next(0); level != NO_LEVEL; level = rq.nonempty.next(level + 1)) {
+			lengths[class_of(level)] += rq.runqueues[level].count();
+		}
+
+		for (unsigned int cls = 0; cls < SCHEDSTAT_CLASSES; cls++) {
+			SchedClassStats& stats = rq.stats[cls];
+			if (!lengths[cls]) continue;
+
+			schedstat_inc(stats.queue_length_sum, lengths[cls]);
+			if (lengths[cls] > stats.queue_length_max) __atomic_store_n(&stats.queue_length_max, lengths[cls], __ATOMIC_RELAXED);
+		}
+	}
+
+	/**
+	 * SYS_GET_SCHEDSTAT: copies the statistics of the algorithm the kernel chose out to user space.
+	 * @param info The user's struct schedstat.
+	 * @param size The size of the user's structure, so an older one gets a prefix of the statistics.
+	 * @return Returns the number of bytes copied, or -1 if there are no statistics to give, or the structure is not
+	 * in user space.
+	 */
+	static unsigned long sys_get_schedstat(unsigned long info, unsigned long size, unsigned long, unsigned long)
+	{
+		if (!mq_instance) return (unsigned long)-1;
+
+		SchedStat snapshot;
+		mq_instance->get_schedstat(snapshot);
+
+		if (size > sizeof(snapshot)) size = sizeof(snapshot);
+		if (!copy_to_user(info, &snapshot, size)) return (unsigned long)-1;
+		return size;
+	}
+
+	/**
+	 * SYS_SCHED_SET_DEADLINE: sets or clears the calling thread's deadline reservation.  A thread must clear its
+	 * reservation before it sets another, and before it exits - or the bandwidth stays reserved.  A reservation
+	 * admitted on another CPU only starts once the thread next blocks - see set_deadline.
+	 * @param runtime The runtime to reserve in each period, in microseconds, or zero to clear the reservation.
+	 * @param period The period, in microseconds.
+	 * @param deadline The deadline of each job, relative to its release, in microseconds - or zero for the period.
+	 * @return Returns 0 on success, 1 if the reservation was admitted but only starts when the thread next blocks,
+	 * or -1 if the reservation is not valid or could not be admitted, or there was none to clear.
+	 */
+	static unsigned long sys_sched_set_deadline(unsigned long runtime, unsigned long period, unsigned long deadline, unsigned long)
+	{
+		if (!mq_instance) return (unsigned long)-1;
+
+		Thread& thread = Thread::current();
+		if (runtime) return (unsigned long)(long)mq_instance->set_deadline(thread, runtime, period, deadline);
+		return mq_instance->clear_deadline(thread) ? 0 : (unsigned long)-1;
+	}
+
+	static BitmapPriorityScheduler *mq_instance;
+
+	// The run queues of each CPU
+	PerCPURunQueues _cpu[MAX_CPUS];
+
+	// The node of each queued entity
+	RunQueueNodeTable _nodes;
+
+	// The deadline reservations, and the bandwidth reserved on each CPU
+	DeadlineReservationTable _reservations;
 };
 
+template<unsigned int NR_LEVELS>
+BitmapPriorityScheduler<NR_LEVELS> *BitmapPriorityScheduler<NR_LEVELS>::mq_instance;
+
+/* The scheduler as registered: one level per priority class. */
+typedef BitmapPriorityScheduler<NR_PRIORITY_CLASSES> MultipleQueuePriorityScheduler;
+
 /* --- DO NOT CHANGE ANYTHING BELOW THIS LINE --- */
 
-RegisterScheduler(MultipleQueuePriorityScheduler);
\ No newline at end of file
+RegisterScheduler(MultipleQueuePriorityScheduler);
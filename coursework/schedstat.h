@@ -0,0 +1,89 @@
+/*
+ * Scheduler statistics, as read from user space
+ */
+
+#pragma once
+
+#include <infos/define.h>
+#include "smp.h"
+
+/* The syscall user space reads the scheduler statistics through - see infos-user/inc/infos.h. */
+#define SYS_GET_SCHEDSTAT	35
+
+/* The priority classes the statistics are kept for: REALTIME, INTERACTIVE, NORMAL and DAEMON. */
+#define SCHEDSTAT_CLASSES	4
+
+/* The buckets of a wake-up latency histogram: bucket b counts latencies of [2^b, 2^(b+1)) TSC cycles. */
+#define SCHEDSTAT_LATENCY_BUCKETS	40
+
+/**
+ * The statistics of one priority class.  Each CPU keeps its own, under its run queue lock, and SYS_GET_SCHEDSTAT
+ * adds them up.
+ */
+struct SchedClassStats
+{
+	uint64_t picks;					// times an entity of the class was picked to start a slice
+	uint64_t preemptions;			// slices cut short because an entity at a higher level was waiting
+	uint64_t boosts;				// times a waiting entity of the class was aged up a level
+	uint64_t wakeups;				// times an entity of the class was added to a run queue
+	uint64_t queue_length_sum;		// entities queued at the class's levels (aged up into them or not), over every pick
+	uint64_t queue_length_max;
+	uint64_t latency[SCHEDSTAT_LATENCY_BUCKETS];	// time from being added to being picked, in TSC cycles
+};
+
+/**
+ * A snapshot of the scheduler statistics, as copied out by SYS_GET_SCHEDSTAT.  The layout must match struct
+ * schedstat in infos-user/inc/infos.h.
+ */
+struct SchedStat
+{
+	uint32_t nr_levels;				// run queue levels the algorithm has
+	uint32_t nr_cpus;				// CPUs that have picked an entity
+	uint64_t picks;					// calls to pick_next_entity, i.e. run queue length samples
+	uint64_t idle_picks;			// picks that found nothing to run
+	uint64_t migrations;			// entities pulled from one CPU's run queues to another's
+	SchedClassStats classes[SCHEDSTAT_CLASSES];
+};
+
+/**
+ * Adds to a counter that only one CPU writes, under its lock, but any CPU may read.
+ */
+static inline void schedstat_inc(uint64_t& counter, uint64_t n = 1)
+{
+	__atomic_store_n(&counter, counter + n, __ATOMIC_RELAXED);
+}
+
+/**
+ * Records a wake-up latency in a histogram.
+ * @param stats The statistics of the entity's class.
+ * @param cycles The time from the entity being added to it being picked.
+ */
+static inline void schedstat_record_latency(SchedClassStats& stats, uint64_t cycles)
+{
+	unsigned int bucket = cycles ? 63 - __builtin_clzll(cycles) : 0;
+	if (bucket >= SCHEDSTAT_LATENCY_BUCKETS) bucket = SCHEDSTAT_LATENCY_BUCKETS - 1;
+
+	schedstat_inc(stats.latency[bucket]);
+}
+
+/**
+ * Adds one CPU's statistics of a class into a snapshot.  The CPU's lock is not taken, so the counters may be a
+ * little out while it is scheduling.
+ * @param total The class in the snapshot.
+ * @param stats The CPU's statistics of the class.
+ */
+static inline void schedstat_add(SchedClassStats& total, const SchedClassStats& stats)
+{
+	total.picks += __atomic_load_n(&stats.picks, __ATOMIC_RELAXED);
+	total.preemptions += __atomic_load_n(&stats.preemptions, __ATOMIC_RELAXED);
+	total.boosts += __atomic_load_n(&stats.boosts, __ATOMIC_RELAXED);
+	total.wakeups += __atomic_load_n(&stats.wakeups, __ATOMIC_RELAXED);
+	total.queue_length_sum += __atomic_load_n(&stats.queue_length_sum, __ATOMIC_RELAXED);
+
+	uint64_t max = __atomic_load_n(&stats.queue_length_max, __ATOMIC_RELAXED);
+	if (max > total.queue_length_max) total.queue_length_max = max;
+
+	for (unsigned int b = 0; b < SCHEDSTAT_LATENCY_BUCKETS; b++) {
+		total.latency[b] += __atomic_load_n(&stats.latency[b], __ATOMIC_RELAXED);
+	}
+}
@@ -0,0 +1,550 @@
+/*
+ * Slab Object Caches
+ *
+ * Caches of same-sized kernel objects, carved out of order-0 and order-1 pages, with per-CPU magazines in front
+ * of them (after Bonwick's slab and magazine allocators) - see slab.h.
+ */
+
+#include <infos/mm/page-allocator.h>
+#include <infos/mm/mm.h>
+#include <infos/kernel/kernel.h>
+#include <infos/kernel/log.h>
+#include <infos/kernel/cmdline.h>
+#include <infos/util/lock.h>
+#include <infos/util/string.h>
+
+#include "slab.h"
+
+using namespace infos::kernel;
+using namespace infos::mm;
+using namespace infos::util;
+
+/* The objects each magazine holds, unless slab.magazine=<n> says otherwise. */
+#define SLAB_DEFAULT_MAGAZINE	16
+
+/* The most full (and the most empty) magazines a cache's depot keeps - more go back to the slabs. */
+#define SLAB_DEPOT_MAGAZINES	8
+
+/* The slabs with nothing in use a cache keeps for its next allocations - more go back to the page allocator. */
+#define SLAB_KEEP_EMPTY		1
+
+/* A slab is order 0 if it holds at least this many objects that way, and order 1 otherwise. */
+#define SLAB_MIN_OBJECTS	8
+
+/* The objects in each magazine (slab.magazine=<n>) - zero turns the magazines off, so every allocation locks. */
+static unsigned int slab_magazine_size = SLAB_DEFAULT_MAGAZINE;
+
+RegisterCmdLineArgument(SlabMagazine, "slab.magazine") {
+	unsigned int n = 0;
+	while (*value >= '0' && *value <= '9') {
+		n = (n * 10) + (*value++ - '0');
+	}
+
+	if (n <= SLAB_MAX_MAGAZINE) slab_magazine_size = n;
+}
+
+/**
+ * The header at the start of every slab.  The objects follow it, and the slab is aligned to its size, so the slab
+ * an object is in is found by rounding its address down.
+ */
+struct SlabCache::Slab
+{
+	SlabCache *cache;
+	Slab *prev, *next;			// on the cache's partial or empty list - a full slab is on neither
+	void *free_objects;
+	unsigned int nr_in_use;
+};
+
+/**
+ * A stack of free objects, which a CPU allocates from and frees to without taking the cache lock.
+ */
+struct SlabCache::Magazine
+{
+	Magazine *next;				// on the depot's full or empty list
+	unsigned int rounds;		// the objects in the magazine
+	void *objects[SLAB_MAX_MAGAZINE];
+};
+
+SlabCache SlabCache::_magazine_cache;
+static bool magazine_cache_ready;
+
+/* Every cache that has been set up. */
+static SlabCache *all_caches;
+static RawSpinLock all_caches_lock;
+
+/* The size classes slab_alloc serves, smallest first. */
+static const uint32_t size_class_sizes[] = { 16, 32, 64, 128, 256, 512, 1024 };
+static const char *size_class_names[] = { "size-16", "size-32", "size-64", "size-128", "size-256", "size-512", "size-1024" };
+static SlabCache size_classes[ARRAY_SIZE(size_class_sizes)];
+static bool size_classes_ready;
+
+/**
+ * Sets up the cache the magazines come from, the first time a cache with magazines is set up.
+ */
+void SlabCache::setup_magazine_cache()
+{
+	if (__atomic_load_n(&magazine_cache_ready, __ATOMIC_ACQUIRE)) return;
+
+	static RawSpinLock setup_lock;
+	UniqueIRQLock l;
+	UniqueRawSpinLock sl(setup_lock);
+
+	if (magazine_cache_ready) return;
+
+	//the magazine cache has no magazines, so setting it up does not come back here
+	_magazine_cache.init("magazine", sizeof(Magazine), sizeof(void *), NULL, false);
+	__atomic_store_n(&magazine_cache_ready, true, __ATOMIC_RELEASE);
+}
+
+void SlabCache::init(const char *name, size_t object_size, size_t align, ctor_fn ctor, bool magazines)
+{
+	assert(object_size > 0 && object_size <= SLAB_MAX_SIZE);
+	assert(align >= sizeof(void *) && (align & (align - 1)) == 0);
+
+	_name = name;
+	_ctor = ctor;
+
+	//a free object's link goes in its first word, unless that would overwrite its constructed state - then the
+	//link gets a word of its own after the object
+	uint64_t slot = (object_size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+	_link_offset = ctor ? slot : 0;
+	if (ctor) slot += sizeof(void *);
+	slot = (slot + align - 1) & ~(align - 1);
+
+	_object_size = slot;
+	_first_offset = (sizeof(Slab) + align - 1) & ~(align - 1);
+
+	_slab_order = 0;
+	if ((__page_size - _first_offset) / slot < SLAB_MIN_OBJECTS) _slab_order = 1;
+	_objects_per_slab = ((__page_size << _slab_order) - _first_offset) / slot;
+
+	_full_magazines = NULL;
+	_empty_magazines = NULL;
+	_nr_full_magazines = 0;
+	_nr_empty_magazines = 0;
+	_partial_slabs = NULL;
+	_empty_slabs = NULL;
+	_nr_empty_slabs = 0;
+	_nr_slabs = 0;
+	_nr_free_objects = 0;
+	_nr_depot_hits = 0;
+	_nr_slab_allocs = 0;
+
+	for (unsigned int cpu = 0; cpu < MAX_CPUS; cpu++) {
+		_cpu[cpu].loaded = NULL;
+		_cpu[cpu].previous = NULL;
+		_cpu[cpu].allocs = 0;
+		_cpu[cpu].frees = 0;
+		_cpu[cpu].hits = 0;
+	}
+
+	UniqueIRQLock l;
+	{
+		UniqueRawSpinLock sl(all_caches_lock);
+		_next_cache = all_caches;
+		all_caches = this;
+	}
+
+	_magazine_size = magazines ? slab_magazine_size : 0;
+	if (_magazine_size) setup_magazine_cache();
+}
+
+void *SlabCache::alloc()
+{
+	UniqueIRQLock l;
+	PerCPUMagazines& cpu = _cpu[current_cpu_id()];
+
+	if (_magazine_size) {
+		//the loaded magazine has objects, or the previous one is full - either way, no lock
+		if (!cpu.loaded || !cpu.loaded->rounds) {
+			Magazine *previous = cpu.previous;
+			if (previous && previous->rounds) {
+				cpu.previous = cpu.loaded;
+				cpu.loaded = previous;
+			}
+		}
+
+		if (cpu.loaded && cpu.loaded->rounds) {
+			cpu.allocs++;
+			cpu.hits++;
+			return cpu.loaded->objects[--cpu.loaded->rounds];
+		}
+	}
+
+	UniqueRawSpinLock sl(_lock);
+
+	//both magazines are empty - swap the older one for a full one from the depot
+	if (_magazine_size && _full_magazines) {
+		Magazine *full = _full_magazines;
+		_full_magazines = full->next;
+		_nr_full_magazines--;
+
+		if (cpu.previous) {
+			cpu.previous->next = _empty_magazines;
+			_empty_magazines = cpu.previous;
+			_nr_empty_magazines++;
+		}
+		cpu.previous = cpu.loaded;
+		cpu.loaded = full;
+
+		_nr_depot_hits++;
+		cpu.allocs++;
+		return full->objects[--full->rounds];
+	}
+
+	void *object = alloc_from_slabs();
+	if (object) {
+		_nr_slab_allocs++;
+		cpu.allocs++;
+	}
+	return object;
+}
+
+void SlabCache::free(void *object)
+{
+	assert(slab_of(object)->cache == this);
+
+	UniqueIRQLock l;
+	PerCPUMagazines& cpu = _cpu[current_cpu_id()];
+	cpu.frees++;
+
+	if (_magazine_size) {
+		//the loaded magazine has room, or the previous one is empty - either way, no lock
+		if (!cpu.loaded || cpu.loaded->rounds == _magazine_size) {
+			Magazine *previous = cpu.previous;
+			if (previous && !previous->rounds) {
+				cpu.previous = cpu.loaded;
+				cpu.loaded = previous;
+			}
+		}
+
+		if (cpu.loaded && cpu.loaded->rounds < _magazine_size) {
+			cpu.loaded->objects[cpu.loaded->rounds++] = object;
+			return;
+		}
+	}
+
+	UniqueRawSpinLock sl(_lock);
+
+	//both magazines are full - swap the older one for an empty one from the depot, or a new one
+	if (_magazine_size) {
+		Magazine *empty = _empty_magazines;
+		if (empty) {
+			_empty_magazines = empty->next;
+			_nr_empty_magazines--;
+		} else {
+			empty = new_magazine();
+		}
+
+		if (empty) {
+			if (cpu.previous) {
+				cpu.previous->next = _full_magazines;
+				_full_magazines = cpu.previous;
+				_nr_full_magazines++;
+			}
+			cpu.previous = cpu.loaded;
+			cpu.loaded = empty;
+			empty->objects[empty->rounds++] = object;
+
+			//a depot that has grown past its limit gives its oldest objects back to the slabs
+			if (_nr_full_magazines > SLAB_DEPOT_MAGAZINES) {
+				Magazine *full = _full_magazines;
+				_full_magazines = full->next;
+				_nr_full_magazines--;
+
+				flush_magazine(full);
+			}
+			return;
+		}
+	}
+
+	//no magazine to be had, so the object goes straight back to its slab
+	free_to_slabs(object);
+}
+
+uint64_t SlabCache::reap()
+{
+	uint64_t pages = 0;
+
+	UniqueIRQLock l;
+	UniqueRawSpinLock sl(_lock);
+
+	while (_full_magazines) {
+		Magazine *full = _full_magazines;
+		_full_magazines = full->next;
+		_nr_full_magazines--;
+
+		flush_magazine(full);
+	}
+
+	while (_empty_magazines) {
+		Magazine *empty = _empty_magazines;
+		_empty_magazines = empty->next;
+		_nr_empty_magazines--;
+
+		_magazine_cache.free(empty);
+	}
+
+	while (_empty_slabs) {
+		Slab *slab = _empty_slabs;
+		unlink_slab(_empty_slabs, slab);
+		_nr_empty_slabs--;
+
+		release_slab(slab);
+		pages += 1ULL << _slab_order;
+	}
+
+	return pages;
+}
+
+void SlabCache::get_stats(SlabCacheStats& stats) const
+{
+	stats.allocs = 0;
+	stats.frees = 0;
+	stats.magazine_hits = 0;
+	for (unsigned int cpu = 0; cpu < MAX_CPUS; cpu++) {
+		stats.allocs += __atomic_load_n(&_cpu[cpu].allocs, __ATOMIC_RELAXED);
+		stats.frees += __atomic_load_n(&_cpu[cpu].frees, __ATOMIC_RELAXED);
+		stats.magazine_hits += __atomic_load_n(&_cpu[cpu].hits, __ATOMIC_RELAXED);
+	}
+
+	UniqueIRQLock l;
+	UniqueRawSpinLock sl(_lock);
+
+	stats.depot_hits = _nr_depot_hits;
+	stats.slab_allocs = _nr_slab_allocs;
+	stats.nr_slabs = _nr_slabs;
+	stats.nr_pages = _nr_slabs << _slab_order;
+	stats.nr_free_objects = _nr_free_objects;
+	stats.object_size = _object_size;
+	stats.objects_per_slab = _objects_per_slab;
+}
+
+void SlabCache::dump() const
+{
+	SlabCacheStats stats;
+	get_stats(stats);
+
+	mm_log.messagef(LogLevel::DEBUG, "slab %s: size=%u per slab=%u slabs=%lu pages=%lu free=%lu", _name, stats.object_size,
+		stats.objects_per_slab, stats.nr_slabs, stats.nr_pages, stats.nr_free_objects);
+	mm_log.messagef(LogLevel::DEBUG, "  allocs=%lu frees=%lu magazine hits=%lu depot hits=%lu slab allocs=%lu", stats.allocs,
+		stats.frees, stats.magazine_hits, stats.depot_hits, stats.slab_allocs);
+}
+
+/**
+ * Returns the slab an object is in.
+ */
+SlabCache::Slab *SlabCache::slab_of(const void *object) const
+{
+	return (Slab *)((uintptr_t)object & ~((uintptr_t)(__page_size << _slab_order) - 1));
+}
+
+/**
+ * Takes an object off the slabs, growing the cache by a slab if none has a free object.  Called with the cache
+ * lock held.
+ * @return Returns the object, or NULL if a new slab was needed and there was no memory for one.
+ */
+void *SlabCache::alloc_from_slabs()
+{
+	Slab *slab = _partial_slabs;
+	if (!slab) {
+		slab = _empty_slabs;
+		if (slab) {
+			unlink_slab(_empty_slabs, slab);
+			_nr_empty_slabs--;
+		} else {
+			slab = grow();
+			if (!slab) return NULL;
+		}
+		push_slab(_partial_slabs, slab);
+	}
+
+	void *object = slab->free_objects;
+	slab->free_objects = link_of(object);
+	slab->nr_in_use++;
+	_nr_free_objects--;
+
+	if (slab->nr_in_use == _objects_per_slab) {
+		unlink_slab(_partial_slabs, slab);
+	}
+	return object;
+}
+
+/**
+ * Puts an object back on its slab, handing the slab back to the page allocator if that leaves it unused and the
+ * cache already has enough unused slabs.  Called with the cache lock held.
+ * @param object The object.
+ */
+void SlabCache::free_to_slabs(void *object)
+{
+	Slab *slab = slab_of(object);
+
+	if (slab->nr_in_use == _objects_per_slab) {
+		push_slab(_partial_slabs, slab);
+	}
+
+	link_of(object) = slab->free_objects;
+	slab->free_objects = object;
+	slab->nr_in_use--;
+	_nr_free_objects++;
+
+	if (slab->nr_in_use == 0) {
+		unlink_slab(_partial_slabs, slab);
+
+		if (_nr_empty_slabs < SLAB_KEEP_EMPTY) {
+			push_slab(_empty_slabs, slab);
+			_nr_empty_slabs++;
+		} else {
+			release_slab(slab);
+		}
+	}
+}
+
+/**
+ * Takes a new slab from the page allocator, and constructs its objects.  Called with the cache lock held.
+ * @return Returns the slab (on no list), or NULL if there was no memory.
+ */
+SlabCache::Slab *SlabCache::grow()
+{
+	PageDescriptor *pgd = sys.mm().pgalloc().alloc_pages(_slab_order);
+	if (!pgd) return NULL;
+
+	Slab *slab = (Slab *)sys.mm().pgalloc().pgd_to_kva(pgd);
+	slab->cache = this;
+	slab->prev = NULL;
+	slab->next = NULL;
+	slab->free_objects = NULL;
+	slab->nr_in_use = 0;
+
+	//chain the objects in reverse, so they are handed out in address order
+	uint8_t *objects = (uint8_t *)slab + _first_offset;
+	for (unsigned int i = _objects_per_slab; i > 0; i--) {
+		void *object = objects + ((i - 1) * _object_size);
+		if (_ctor) _ctor(object);
+
+		link_of(object) = slab->free_objects;
+		slab->free_objects = object;
+	}
+
+	_nr_slabs++;
+	_nr_free_objects += _objects_per_slab;
+	return slab;
+}
+
+/**
+ * Hands a slab with no objects in use back to the page allocator.  Called with the cache lock held.
+ * @param slab The slab, on no list.
+ */
+void SlabCache::release_slab(Slab *slab)
+{
+	_nr_slabs--;
+	_nr_free_objects -= _objects_per_slab;
+
+	sys.mm().pgalloc().free_pages(sys.mm().pgalloc().kva_to_pgd(slab), _slab_order);
+}
+
+void SlabCache::unlink_slab(Slab *&list, Slab *slab)
+{
+	if (slab->prev) {
+		slab->prev->next = slab->next;
+	} else {
+		list = slab->next;
+	}
+	if (slab->next) slab->next->prev = slab->prev;
+
+	slab->prev = NULL;
+	slab->next = NULL;
+}
+
+void SlabCache::push_slab(Slab *&list, Slab *slab)
+{
+	slab->prev = NULL;
+	slab->next = list;
+	if (list) list->prev = slab;
+	list = slab;
+}
+
+/**
+ * Allocates an empty magazine.  Called with the cache lock held - the magazine cache has a lock of its own, and
+ * never comes back to this one.
+ */
+SlabCache::Magazine *SlabCache::new_magazine()
+{
+	Magazine *magazine = (Magazine *)_magazine_cache.alloc();
+	if (magazine) {
+		magazine->next = NULL;
+		magazine->rounds = 0;
+	}
+	return magazine;
+}
+
+/**
+ * Gives a magazine's objects back to their slabs, and the magazine back to the magazine cache.  Called with the
+ * cache lock held.
+ */
+void SlabCache::flush_magazine(Magazine *magazine)
+{
+	while (magazine->rounds) {
+		free_to_slabs(magazine->objects[--magazine->rounds]);
+	}
+	_magazine_cache.free(magazine);
+}
+
+/**
+ * Sets the size class caches up, the first time one is needed.
+ */
+static void setup_size_classes()
+{
+	if (__atomic_load_n(&size_classes_ready, __ATOMIC_ACQUIRE)) return;
+
+	static RawSpinLock setup_lock;
+	UniqueIRQLock l;
+	UniqueRawSpinLock sl(setup_lock);
+
+	if (size_classes_ready) return;
+
+	for (unsigned int i = 0; i < ARRAY_SIZE(size_classes); i++) {
+		size_classes[i].init(size_class_names[i], size_class_sizes[i]);
+	}
+	__atomic_store_n(&size_classes_ready, true, __ATOMIC_RELEASE);
+}
+
+void *slab_alloc(size_t size)
+{
+	setup_size_classes();
+
+	for (unsigned int i = 0; i < ARRAY_SIZE(size_classes); i++) {
+		if (size <= size_class_sizes[i]) return size_classes[i].alloc();
+	}
+	return NULL;
+}
+
+void slab_free(void *object, size_t size)
+{
+	if (!object) return;
+
+	//the size picks the class, as it did when the object was allocated
+	for (unsigned int i = 0; i < ARRAY_SIZE(size_classes); i++) {
+		if (size <= size_class_sizes[i]) {
+			size_classes[i].free(object);
+			return;
+		}
+	}
+	assert(false);
+}
+
+uint64_t slab_reap_all()
+{
+	uint64_t pages = 0;
+	for (SlabCache *cache = __atomic_load_n(&all_caches, __ATOMIC_ACQUIRE); cache; cache = cache->next_cache()) {
+		pages += cache->reap();
+	}
+	return pages;
+}
+
+void slab_dump_all()
+{
+	for (SlabCache *cache = __atomic_load_n(&all_caches, __ATOMIC_ACQUIRE); cache; cache = cache->next_cache()) {
+		cache->dump();
+	}
+}
@@ -0,0 +1,175 @@
+/*
+ * Slab object caches, built on the page allocator
+ */
+
+#pragma once
+
+#include <infos/define.h>
+#include "smp.h"
+
+/* The most objects a magazine can hold - slab.magazine=<n> picks how many each one does. */
+#define SLAB_MAX_MAGAZINE	64
+
+/* The largest object the size classes serve - anything bigger should come from the page allocator. */
+#define SLAB_MAX_SIZE		1024
+
+/**
+ * A snapshot of a cache's counters, as filled in by SlabCache::get_stats.
+ */
+struct SlabCacheStats
+{
+	uint64_t allocs;			// objects handed out
+	uint64_t frees;				// objects given back
+	uint64_t magazine_hits;		// allocations served from a CPU's own magazines, without taking the cache lock
+	uint64_t depot_hits;		// allocations that swapped in a full magazine from the depot
+	uint64_t slab_allocs;		// allocations that went down to the slabs themselves
+	uint64_t nr_slabs;			// slabs the cache holds pages for
+	uint64_t nr_pages;
+	uint64_t nr_free_objects;	// objects on the slabs' free lists, i.e. not counting those held in magazines
+	uint32_t object_size;		// the size of each object's slot, with its alignment and free list link
+	uint32_t objects_per_slab;
+};
+
+/**
+ * A cache of objects of one size, carved out of order-0 or order-1 pages (slabs).  Freed objects go into the
+ * freeing CPU's magazines, which the next allocations on that CPU are served from without taking any lock;
+ * magazines are swapped whole with the cache's depot when a CPU runs out or fills up, and only when the depot
+ * has nothing to give do objects go back to, or come from, the slabs.
+ *
+ * A cache with a constructor runs it once on each object, when its slab is created, and expects objects to be
+ * freed in their constructed state - so a freed object can be handed out again as it is.
+ *
+ * Caches have no constructor of their own (call init), so they can be statics set up before the kernel has run
+ * any constructors.
+ */
+class SlabCache
+{
+public:
+	typedef void (*ctor_fn)(void *object);
+
+	/**
+	 * Sets the cache up.  No pages are taken until the first allocation.
+	 * @param name The name of the cache, for dumps.
+	 * @param object_size The size of each object, at most SLAB_MAX_SIZE.
+	 * @param align The alignment of each object, a power of two of at least the size of a pointer.
+	 * @param ctor A function that puts a new object into its constructed state, or NULL.
+	 * @param magazines Whether to cache freed objects in per-CPU magazines.
+	 */
+	void init(const char *name, size_t object_size, size_t align = sizeof(void *), ctor_fn ctor = NULL, bool magazines = true);
+
+	/**
+	 * Allocates an object.
+	 * @return Returns the object, or NULL if a new slab was needed and the page allocator had nothing to give.
+	 */
+	void *alloc();
+
+	/**
+	 * Frees an object back to the cache.  It must have come from this cache's alloc.
+	 * @param object The object.
+	 */
+	void free(void *object);
+
+	/**
+	 * Gives the cache's spare memory back to the page allocator: the objects in the depot's full magazines go
+	 * back to their slabs, and every slab with no objects in use is freed.  Magazines loaded on a CPU are kept.
+	 * @return Returns the number of pages freed.
+	 */
+	uint64_t reap();
+
+	/**
+	 * Takes a snapshot of the cache's counters.
+	 * @param stats Receives the counters.
+	 */
+	void get_stats(SlabCacheStats& stats) const;
+
+	/**
+	 * Logs the cache's counters.
+	 */
+	void dump() const;
+
+	const char *name() const { return _name; }
+
+	/** The next cache in the list of every cache set up, for slab_reap_all and slab_dump_all. */
+	SlabCache *next_cache() const { return _next_cache; }
+
+private:
+	struct Slab;
+	struct Magazine;
+
+	// Each CPU's two magazines: the one being used, and the one before it, which is either full or empty
+	struct PerCPUMagazines {
+		Magazine *loaded;
+		Magazine *previous;
+		uint64_t allocs, frees, hits;
+	} __aligned(64);
+
+	Slab *slab_of(const void *object) const;
+	void *&link_of(void *object) const { return *(void **)((uint8_t *)object + _link_offset); }
+
+	void *alloc_from_slabs();
+	void free_to_slabs(void *object);
+	Slab *grow();
+	void unlink_slab(Slab *&list, Slab *slab);
+	void push_slab(Slab *&list, Slab *slab);
+	void release_slab(Slab *slab);
+
+	Magazine *new_magazine();
+	void flush_magazine(Magazine *magazine);
+
+	static void setup_magazine_cache();
+
+	const char *_name;
+	ctor_fn _ctor;
+	uint32_t _object_size;		// the object's slot, with its alignment and, for a constructed cache, its link
+	uint32_t _link_offset;		// where a free object's free list link lives in its slot
+	uint32_t _first_offset;		// where the first object starts in a slab, after the slab header
+	uint32_t _objects_per_slab;
+	int _slab_order;
+	unsigned int _magazine_size;	// objects per magazine, or zero if the cache has no magazines
+
+	// The depot and the slabs are shared between CPUs, under this lock
+	mutable RawSpinLock _lock;
+	Magazine *_full_magazines;
+	Magazine *_empty_magazines;
+	unsigned int _nr_full_magazines;
+	unsigned int _nr_empty_magazines;
+	Slab *_partial_slabs;		// slabs with objects both free and in use
+	Slab *_empty_slabs;			// slabs with no objects in use
+	unsigned int _nr_empty_slabs;
+	uint64_t _nr_slabs;
+	uint64_t _nr_free_objects;
+	uint64_t _nr_depot_hits;
+	uint64_t _nr_slab_allocs;
+
+	PerCPUMagazines _cpu[MAX_CPUS];
+
+	SlabCache *_next_cache;
+
+	// The magazines themselves come from a cache with no magazines of its own
+	static SlabCache _magazine_cache;
+};
+
+/**
+ * Allocates an object of the given size from the smallest size class that fits it.
+ * @param size The size of the object, at most SLAB_MAX_SIZE.
+ * @return Returns the object, or NULL if the size is too large or memory ran out.
+ */
+extern void *slab_alloc(size_t size);
+
+/**
+ * Frees an object allocated with slab_alloc.
+ * @param object The object, or NULL.
+ * @param size The size it was allocated with.
+ */
+extern void slab_free(void *object, size_t size);
+
+/**
+ * Reaps every cache, e.g. when the page allocator is short of memory.
+ * @return Returns the number of pages freed.
+ */
+extern uint64_t slab_reap_all();
+
+/**
+ * Logs the counters of every cache.
+ */
+extern void slab_dump_all();
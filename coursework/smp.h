@@ -0,0 +1,99 @@
+/*
+ * SMP helpers shared by the coursework algorithms
+ */
+
+#pragma once
+
+#include <infos/define.h>
+
+/* The most CPUs any per-CPU structure in the coursework algorithms is sized for. */
+#define MAX_CPUS	16
+
+#ifndef HAVE_CURRENT_CPU_ID
+/* The CPU number given to each APIC ID, plus one - zero until that CPU first asks for its number. */
+inline uint8_t __cpu_id_of_apic_id[256];
+inline unsigned int __nr_cpu_ids;
+
+/**
+ * Returns a small number identifying the CPU we are running on.  The CPUs are numbered densely, in the order they
+ * first ask, from the initial APIC ID that CPUID reports - APIC IDs need not be dense, so using them directly
+ * could give two CPUs the same number.  CPUID is cheap under QEMU's TCG, but traps to the hypervisor under KVM, so
+ * a build for another environment can supply its own current_cpu_id() by defining HAVE_CURRENT_CPU_ID.
+ * The caller must not be able to migrate between asking and using the answer, e.g. by holding a
+ * UniqueIRQLock.
+ * @return Returns the CPU number, in the range [0, MAX_CPUS)
+ */
+static inline unsigned int current_cpu_id()
+{
+	uint32_t eax = 1, ebx, ecx = 0, edx;
+	asm volatile("cpuid" : "+a"(eax), "=b"(ebx), "+c"(ecx), "=d"(edx));
+
+	unsigned int apic_id = ebx >> 24;
+	unsigned int id = __atomic_load_n(&__cpu_id_of_apic_id[apic_id], __ATOMIC_RELAXED);
+	if (id) return id - 1;
+
+	//only this CPU ever writes its own entry, so just the count needs to be atomic
+	id = __atomic_fetch_add(&__nr_cpu_ids, 1, __ATOMIC_RELAXED);
+	assert(id < MAX_CPUS);
+
+	__atomic_store_n(&__cpu_id_of_apic_id[apic_id], id + 1, __ATOMIC_RELAXED);
+	return id;
+}
+#endif
+
+/**
+ * Reads the time stamp counter, e.g. to time events on one CPU against another's - QEMU keeps the CPUs' counters
+ * in step.
+ */
+static inline uint64_t read_tsc()
+{
+	uint32_t lo, hi;
+	asm volatile("rdtsc" : "=a"(lo), "=d"(hi));
+	return ((uint64_t)hi << 32) | lo;
+}
+
+/**
+ * A test-and-test-and-set spin lock, for state that is shared between CPUs.  It does not touch the
+ * interrupt flag, so take a UniqueIRQLock first if the state is also used from interrupt context.
+ */
+class RawSpinLock
+{
+public:
+	RawSpinLock() : _locked(0) { }
+
+	void lock()
+	{
+		while (__atomic_exchange_n(&_locked, 1, __ATOMIC_ACQUIRE)) {
+			//spin on a plain read, so waiting CPUs don't keep stealing the cache line
+			while (__atomic_load_n(&_locked, __ATOMIC_RELAXED)) {
+				asm volatile("pause");
+			}
+		}
+	}
+
+	bool try_lock()
+	{
+		return !__atomic_exchange_n(&_locked, 1, __ATOMIC_ACQUIRE);
+	}
+
+	void unlock()
+	{
+		__atomic_store_n(&_locked, 0, __ATOMIC_RELEASE);
+	}
+
+private:
+	uint32_t _locked;
+};
+
+/**
+ * Holds a RawSpinLock for the lifetime of the object.
+ */
+class UniqueRawSpinLock
+{
+public:
+	UniqueRawSpinLock(RawSpinLock& lock) : _lock(lock) { _lock.lock(); }
+	~UniqueRawSpinLock() { _lock.unlock(); }
+
+private:
+	RawSpinLock& _lock;
+};
@@ -0,0 +1,45 @@
+/*
+ * Copying to user space, for syscalls that are handed user pointers
+ */
+
+#pragma once
+
+#include <infos/define.h>
+#include <infos/util/string.h>
+
+/* The end of the user half of the address space - everything from here up (e.g. the kernel's direct map of
+ * physical memory) belongs to the kernel. */
+#define USER_SPACE_END	0x0000800000000000UL
+
+/**
+ * Returns TRUE if a range of addresses lies wholly in the user half of the address space.  Only the range is
+ * checked, not whether its pages are mapped.
+ * @param addr The first address of the range.
+ * @param size The number of bytes in the range.
+ */
+static inline bool user_range_ok(unsigned long addr, unsigned long size)
+{
+	return addr != 0 && addr < USER_SPACE_END && size <= USER_SPACE_END - addr;
+}
+
+/**
+ * Copies an object out to a buffer a syscall was given, so long as the buffer is in user space - so a user
+ * program can't have the kernel write over its own memory.
+ *
+ * The buffer's pages are not probed: a syscall has no way to walk the caller's page tables, and the kernel can't
+ * recover from faulting on its own accesses, so a buffer in user space that is not mapped faults the kernel.  Like
+ * every syscall that is handed a buffer (e.g. SYS_READ), the kernel relies on the caller's buffer being mapped -
+ * the user library's wrappers touch their buffers before making the syscall, so that a bad pointer faults the
+ * program instead.
+ * @param dst The user buffer.
+ * @param src The object to copy.
+ * @param size The number of bytes to copy.
+ * @return Returns TRUE if the object was copied, or FALSE if the buffer is not in user space.
+ */
+static inline bool copy_to_user(unsigned long dst, const void *src, unsigned long size)
+{
+	if (!user_range_ok(dst, size)) return false;
+
+	memcpy((void *)dst, src, size);
+	return true;
+}
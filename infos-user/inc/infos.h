@@ -51,6 +51,12 @@ enum class Syscall
 	SYS_PREAD = 19,
 	SYS_PWRITE = 20,
 	SYS_FUTEX_WAIT = 21,
+
+	SYS_GET_MEMINFO = 32,
+	SYS_PGALLOC_STRESS = 33,
+	SYS_PGALLOC_TRACE = 34,
+	SYS_GET_SCHEDSTAT = 35,
+	SYS_SCHED_SET_DEADLINE = 36,
 };
 
 enum SchedulingEntityPriority
@@ -179,6 +185,62 @@ struct tod
 extern int get_time_of_day(struct tod *t);
 extern uint64_t get_ticks();
 
+#define MEMINFO_MAX_ORDER 18
+
+struct meminfo
+{
+	uint64_t nr_pages, nr_free_pages, nr_cached_pages;
+	uint64_t splits, merges;
+	uint32_t max_order;
+	int32_t largest_free_order;
+	uint64_t free_blocks[MEMINFO_MAX_ORDER + 1];
+	uint64_t failed_allocs[MEMINFO_MAX_ORDER + 1];
+	uint32_t fragmentation[MEMINFO_MAX_ORDER + 1];
+	uint64_t exact_allocs, exact_pages_saved, exact_pages_live_saved;
+	uint64_t class_fallbacks[2];		// pinned, reclaimable
+	uint64_t pageblock_claims;
+	uint64_t lock_contentions;
+	uint32_t nr_regions;
+	uint64_t contig_allocs, contig_pages;
+};
+
+extern int get_meminfo(struct meminfo *mi);
+extern long pgalloc_stress(unsigned long iterations, unsigned long seed);
+
+#define PGALLOC_TRACE_DUMP	1	// write the allocation trace to the debug console
+#define PGALLOC_TRACE_RESET	2	// start the next dump after the records dumped so far
+
+extern long pgalloc_trace(unsigned long flags);
+
+#define SCHEDSTAT_CLASSES 4
+#define SCHEDSTAT_LATENCY_BUCKETS 40
+
+struct schedstat_class
+{
+	uint64_t picks, preemptions, boosts, wakeups;
+	uint64_t queue_length_sum, queue_length_max;
+	uint64_t latency[SCHEDSTAT_LATENCY_BUCKETS];	// bucket b counts wake-up latencies of [2^b, 2^(b+1)) TSC cycles
+};
+
+struct schedstat
+{
+	uint32_t nr_levels, nr_cpus;
+	uint64_t picks, idle_picks, migrations;
+	struct schedstat_class classes[SCHEDSTAT_CLASSES];	// REALTIME, INTERACTIVE, NORMAL, DAEMON
+};
+
+extern int get_schedstat(struct schedstat *ss);
+
+/*
+ * Reserves runtime_us of a CPU for the calling REALTIME thread in every period_us, each within deadline_us of its
+ * release (0 for the period).  Returns -1 if the reservation is not valid, or would overcommit every CPU.  Returns 1
+ * if it was admitted on another CPU than the thread is running on: it only starts once the thread next blocks (e.g.
+ * in usleep), and until then the thread runs as if it had none.  A runtime of 0 clears the reservation.  A
+ * reservation lapses if its thread stays blocked for 8 of its periods (e.g. once it has exited), after which the
+ * thread runs as if it had none until it reserves again.
+ */
+extern int sched_set_deadline(unsigned long runtime_us, unsigned long period_us, unsigned long deadline_us);
+
 #define va_start(v, l) __builtin_va_start(v, l)
 #define va_end(v) __builtin_va_end(v)
 #define va_arg(v, l) __builtin_va_arg(v, l)
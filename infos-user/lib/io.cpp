@@ -56,3 +56,41 @@ uint64_t get_ticks()
 {
 	return (uint64_t)syscall(Syscall::SYS_GET_TICKS);
 }
+
+/*
+ * Touches each page of a buffer the kernel is to fill in, so that if it is not mapped, the program faults here
+ * rather than the kernel faulting in the syscall.  Whatever an older kernel doesn't fill in is left zero.
+ */
+static void prefault(void *buffer, size_t size)
+{
+	volatile char *p = (volatile char *)buffer;
+	for (size_t i = 0; i < size; i += 0x1000) p[i] = 0;
+	if (size) p[size - 1] = 0;
+}
+
+int get_meminfo(struct meminfo *mi)
+{
+	prefault(mi, sizeof(*mi));
+	return (int)syscall(Syscall::SYS_GET_MEMINFO, (unsigned long)mi, sizeof(*mi));
+}
+
+long pgalloc_stress(unsigned long iterations, unsigned long seed)
+{
+	return (long)syscall(Syscall::SYS_PGALLOC_STRESS, iterations, seed);
+}
+
+long pgalloc_trace(unsigned long flags)
+{
+	return (long)syscall(Syscall::SYS_PGALLOC_TRACE, flags);
+}
+
+int get_schedstat(struct schedstat *ss)
+{
+	prefault(ss, sizeof(*ss));
+	return (int)syscall(Syscall::SYS_GET_SCHEDSTAT, (unsigned long)ss, sizeof(*ss));
+}
+
+int sched_set_deadline(unsigned long runtime_us, unsigned long period_us, unsigned long deadline_us)
+{
+	return (int)syscall(Syscall::SYS_SCHED_SET_DEADLINE, runtime_us, period_us, deadline_us);
+}
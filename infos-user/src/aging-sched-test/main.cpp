@@ -0,0 +1,148 @@
+/* SPDX-License-Identifier: MIT */
+
+#include <infos.h>
+
+/*
+ * Measures how long DAEMON threads wait for a CPU while REALTIME threads keep every CPU busy - boot with
+ * sched.algorithm=mq, and sched.aging=<n> to choose how many picks a waiting thread spends at each level before
+ * it is boosted (sched.aging=0 turns aging off, and the DAEMON threads should not run until the load stops).
+ *
+ *   /usr/aging-sched-test [<busy-threads> [<seconds>]]
+ *
+ * Starts busy-threads (default 4) REALTIME threads that spin for the given time (default 5 seconds), and two
+ * DAEMON threads that spin alongside them, noting the longest gap between two turns of their loop - i.e. the
+ * longest they waited to be run again.
+ */
+
+#define MAX_BUSY_THREADS 16
+#define NR_DAEMON_THREADS 2
+
+/* A gap between two turns of a DAEMON thread's loop longer than this is counted as a wait. */
+#define WAIT_THRESHOLD_US 1000
+
+static uint64_t start, end;
+
+struct busy_thread
+{
+	HTHREAD thread;
+	uint64_t loops;
+};
+
+struct daemon_thread
+{
+	HTHREAD thread;
+	uint64_t loops;
+	uint64_t first_run_us;
+	uint64_t max_wait_us;
+	uint64_t nr_waits;
+	uint64_t total_wait_us;
+};
+
+static void busy_thread_proc(void *arg)
+{
+	struct busy_thread *bt = (struct busy_thread *)arg;
+	volatile uint64_t x = 0;
+
+	// Only look at the clock now and then, so the thread is busy rather than making system calls.
+	while (get_ticks() < end) {
+		for (unsigned int i = 0; i < 4096; i++) x = x + i;
+		bt->loops++;
+	}
+
+	stop_thread(HTHREAD_SELF);
+}
+
+static void daemon_thread_proc(void *arg)
+{
+	struct daemon_thread *dt = (struct daemon_thread *)arg;
+
+	uint64_t prev = get_ticks();
+	dt->first_run_us = prev - start;
+
+	for (;;) {
+		uint64_t now = get_ticks();
+		uint64_t gap = now - prev;
+		prev = now;
+
+		if (gap > WAIT_THRESHOLD_US) {
+			dt->nr_waits++;
+			dt->total_wait_us += gap;
+		}
+		if (gap > dt->max_wait_us) dt->max_wait_us = gap;
+
+		if (now >= end) break;
+		dt->loops++;
+	}
+
+	stop_thread(HTHREAD_SELF);
+}
+
+static unsigned long parse_number(const char *&cmd, unsigned long def)
+{
+	while (*cmd == ' ') cmd++;
+	if (*cmd < '0' || *cmd > '9') return def;
+
+	unsigned long n = 0;
+	while (*cmd >= '0' && *cmd <= '9') {
+		n = (n * 10) + (*cmd++ - '0');
+	}
+	return n;
+}
+
+int main(const char *cmdline)
+{
+	const char *cmd = cmdline ? cmdline : "";
+	unsigned long nr_busy = parse_number(cmd, 4);
+	unsigned long seconds = parse_number(cmd, 5);
+
+	if (nr_busy < 1 || nr_busy > MAX_BUSY_THREADS || seconds == 0) {
+		printf("usage: aging-sched-test [<busy-threads (1-%u)> [<seconds>]]\n", MAX_BUSY_THREADS);
+		return 1;
+	}
+
+	printf("%lu REALTIME threads and %u DAEMON threads for %lu seconds\n", nr_busy, NR_DAEMON_THREADS, seconds);
+
+	static struct busy_thread busy[MAX_BUSY_THREADS];
+	static struct daemon_thread daemons[NR_DAEMON_THREADS];
+
+	start = get_ticks();
+	end = start + (seconds * 1000000);
+
+	// The DAEMON threads go first, so that they are queued before the load starts.
+	for (unsigned int i = 0; i < NR_DAEMON_THREADS; i++) {
+		daemons[i].thread = create_thread(daemon_thread_proc, &daemons[i], SchedulingEntityPriority::DAEMON);
+	}
+	for (unsigned long i = 0; i < nr_busy; i++) {
+		busy[i].thread = create_thread(busy_thread_proc, &busy[i], SchedulingEntityPriority::REALTIME);
+	}
+
+	uint64_t busy_loops = 0;
+	for (unsigned long i = 0; i < nr_busy; i++) {
+		join_thread(busy[i].thread);
+		busy_loops += busy[i].loops;
+	}
+	for (unsigned int i = 0; i < NR_DAEMON_THREADS; i++) {
+		join_thread(daemons[i].thread);
+	}
+
+	printf("REALTIME: %lu loops\n", busy_loops);
+	printf("thread     loops   first run (us)   max wait (us)   waits   mean wait (us)\n");
+
+	uint64_t max_wait = 0;
+	for (unsigned int i = 0; i < NR_DAEMON_THREADS; i++) {
+		struct daemon_thread *dt = &daemons[i];
+		uint64_t mean = dt->nr_waits ? dt->total_wait_us / dt->nr_waits : 0;
+
+		printf("DAEMON %u %9lu %16lu %15lu %7lu %16lu\n", i, dt->loops, dt->first_run_us, dt->max_wait_us,
+			dt->nr_waits, mean);
+		if (dt->max_wait_us > max_wait) max_wait = dt->max_wait_us;
+	}
+
+	if (max_wait >= seconds * 1000000) {
+		printf("DAEMON threads were starved until the load stopped\n");
+	} else {
+		printf("maximum DAEMON wait: %lu us\n", max_wait);
+	}
+
+	return 0;
+}
@@ -0,0 +1,249 @@
+/* SPDX-License-Identifier: MIT */
+
+#include <infos.h>
+
+/*
+ * Measures how well periodic REALTIME threads meet their deadlines as the load on the system goes up - boot with
+ * sched.algorithm=mq, which runs threads with deadline reservations (see sched_set_deadline) ahead of everything
+ * else, in deadline order.
+ *
+ *   /usr/edf-sched-test [<tasks> [<seconds> [<reserve (0/1)>]]]
+ *
+ * Starts the given number of periodic threads (default 4), each of which does 2ms of work every 20ms, with a
+ * reservation of 3ms in every 20ms unless <reserve> is 0.  They run for the given time (default 4 seconds) three
+ * times over: alone, then with 2 and 4 CPU-bound REALTIME threads (with no reservations) competing with them.  For
+ * each run, a thread counts the jobs that finished after their deadline, and the release jitter - how late after
+ * its release each job started.  Then it makes 10% reservations until one is refused, to show admission control.
+ */
+
+#define MAX_TASKS 8
+#define MAX_BACKGROUND 4
+#define MAX_ADMIT 64
+
+#define TASK_WORK_US 2000
+#define TASK_RUNTIME_US 3000
+#define TASK_PERIOD_US 20000
+
+#define ADMIT_RUNTIME_US 10000
+#define ADMIT_PERIOD_US 100000
+
+static unsigned long loops_per_ms;
+static uint64_t end;
+static volatile bool stop_background;
+static bool reserve;
+
+struct task
+{
+	HTHREAD thread;
+	bool admitted;
+	uint64_t jobs;
+	uint64_t misses;
+	uint64_t jitter_sum;
+	uint64_t jitter_max;
+};
+
+struct admit_thread
+{
+	HTHREAD thread;
+	volatile int state;		// 0 while the thread starts, 1 if its reservation was admitted, -1 if not
+};
+
+static volatile bool admit_done;
+
+static unsigned long work(unsigned long loops)
+{
+	volatile unsigned long x = 0;
+	for (unsigned long i = 0; i < loops; i++) {
+		x = x + i;
+	}
+	return x;
+}
+
+static void task_proc(void *arg)
+{
+	struct task *t = (struct task *)arg;
+
+	// A reservation admitted on another CPU starts when the thread first sleeps, before its first job.
+	t->admitted = reserve && sched_set_deadline(TASK_RUNTIME_US, TASK_PERIOD_US, 0) >= 0;
+
+	uint64_t release = get_ticks();
+	for (;;) {
+		release += TASK_PERIOD_US;
+		if (release >= end) break;
+
+		uint64_t now = get_ticks();
+		if (release > now) usleep(release - now);
+
+		uint64_t start = get_ticks();
+		uint64_t jitter = start > release ? start - release : 0;
+		t->jitter_sum += jitter;
+		if (jitter > t->jitter_max) t->jitter_max = jitter;
+
+		work((loops_per_ms * TASK_WORK_US) / 1000);
+
+		// The deadline is the end of the period.
+		if (get_ticks() > release + TASK_PERIOD_US) t->misses++;
+		t->jobs++;
+	}
+
+	if (t->admitted) sched_set_deadline(0, 0, 0);
+	stop_thread(HTHREAD_SELF);
+}
+
+static void background_proc(void *arg)
+{
+	while (!stop_background) {
+		work(1000);
+	}
+
+	stop_thread(HTHREAD_SELF);
+}
+
+static void admit_proc(void *arg)
+{
+	struct admit_thread *at = (struct admit_thread *)arg;
+
+	bool admitted = sched_set_deadline(ADMIT_RUNTIME_US, ADMIT_PERIOD_US, 0) >= 0;
+	at->state = admitted ? 1 : -1;
+
+	// Hold on to the reservation until every thread has tried, then give it back.
+	while (!admit_done) {
+		usleep(10000);
+	}
+
+	if (admitted) sched_set_deadline(0, 0, 0);
+	stop_thread(HTHREAD_SELF);
+}
+
+static unsigned long parse_number(const char *&cmd, unsigned long def)
+{
+	while (*cmd == ' ') cmd++;
+	if (*cmd < '0' || *cmd > '9') return def;
+
+	unsigned long n = 0;
+	while (*cmd >= '0' && *cmd <= '9') {
+		n = (n * 10) + (*cmd++ - '0');
+	}
+	return n;
+}
+
+static void calibrate()
+{
+	unsigned long loops = 100000;
+	for (;;) {
+		uint64_t start = get_ticks();
+		work(loops);
+		uint64_t elapsed_us = get_ticks() - start;
+
+		if (elapsed_us >= 10000) {
+			loops_per_ms = (loops * 1000) / elapsed_us;
+			return;
+		}
+		loops *= 2;
+	}
+}
+
+static void run(unsigned long nr_tasks, unsigned long nr_background, unsigned long seconds)
+{
+	static struct task tasks[MAX_TASKS];
+	static HTHREAD background[MAX_BACKGROUND];
+
+	stop_background = false;
+	for (unsigned long i = 0; i < nr_background; i++) {
+		background[i] = create_thread(background_proc, NULL, SchedulingEntityPriority::REALTIME);
+	}
+
+	end = get_ticks() + (seconds * 1000000);
+	for (unsigned long i = 0; i < nr_tasks; i++) {
+		tasks[i].admitted = false;
+		tasks[i].jobs = tasks[i].misses = 0;
+		tasks[i].jitter_sum = tasks[i].jitter_max = 0;
+		tasks[i].thread = create_thread(task_proc, &tasks[i], SchedulingEntityPriority::REALTIME);
+	}
+
+	for (unsigned long i = 0; i < nr_tasks; i++) {
+		join_thread(tasks[i].thread);
+	}
+
+	stop_background = true;
+	for (unsigned long i = 0; i < nr_background; i++) {
+		join_thread(background[i]);
+	}
+
+	uint64_t jobs = 0, misses = 0, jitter_sum = 0, jitter_max = 0;
+	unsigned long admitted = 0;
+	for (unsigned long i = 0; i < nr_tasks; i++) {
+		jobs += tasks[i].jobs;
+		misses += tasks[i].misses;
+		jitter_sum += tasks[i].jitter_sum;
+		if (tasks[i].jitter_max > jitter_max) jitter_max = tasks[i].jitter_max;
+		if (tasks[i].admitted) admitted++;
+	}
+
+	printf("%10lu %9lu %8lu %8lu %6lu.%lu%% %16lu %15lu\n", nr_background, admitted, jobs, misses,
+		jobs ? (misses * 100) / jobs : 0, jobs ? ((misses * 1000) / jobs) % 10 : 0,
+		jobs ? jitter_sum / jobs : 0, jitter_max);
+}
+
+static void admission()
+{
+	static struct admit_thread threads[MAX_ADMIT];
+
+	admit_done = false;
+
+	unsigned long nr_threads = 0, admitted = 0;
+	while (nr_threads < MAX_ADMIT) {
+		struct admit_thread *at = &threads[nr_threads++];
+		at->state = 0;
+		at->thread = create_thread(admit_proc, at, SchedulingEntityPriority::REALTIME);
+
+		while (!at->state) {
+			usleep(1000);
+		}
+
+		if (at->state < 0) break;
+		admitted++;
+	}
+
+	admit_done = true;
+	for (unsigned long i = 0; i < nr_threads; i++) {
+		join_thread(threads[i].thread);
+	}
+
+	printf("admission: %lu reservations of %u/%u us admitted", admitted, ADMIT_RUNTIME_US, ADMIT_PERIOD_US);
+	if (admitted < nr_threads) {
+		printf(", the next one refused\n");
+	} else {
+		printf(", none refused\n");
+	}
+}
+
+int main(const char *cmdline)
+{
+	const char *cmd = cmdline ? cmdline : "";
+	unsigned long nr_tasks = parse_number(cmd, 4);
+	unsigned long seconds = parse_number(cmd, 4);
+	reserve = parse_number(cmd, 1) != 0;
+
+	if (nr_tasks < 1 || nr_tasks > MAX_TASKS || seconds == 0) {
+		printf("usage: edf-sched-test [<tasks (1-%u)> [<seconds> [<reserve (0/1)>]]]\n", MAX_TASKS);
+		return 1;
+	}
+
+	calibrate();
+
+	printf("%lu periodic threads doing %uus of work every %uus", nr_tasks, TASK_WORK_US, TASK_PERIOD_US);
+	if (reserve) {
+		printf(", reserving %uus\n", TASK_RUNTIME_US);
+	} else {
+		printf(", with no reservations\n");
+	}
+
+	printf("background  admitted     jobs   missed  missed%%  mean jitter (us)  max jitter (us)\n");
+	for (unsigned long nr_background = 0; nr_background <= MAX_BACKGROUND; nr_background += 2) {
+		run(nr_tasks, nr_background, seconds);
+	}
+
+	admission();
+	return 0;
+}
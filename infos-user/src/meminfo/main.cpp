@@ -0,0 +1,128 @@
+/* SPDX-License-Identifier: MIT */
+
+#include <infos.h>
+
+/*
+ * Shows the page allocator statistics.
+ *
+ *   /usr/meminfo                          print the statistics once
+ *   /usr/meminfo <ms> <program> [args]    run a program, printing a line of statistics every <ms> while it runs
+ */
+
+static volatile bool terminate;
+static unsigned long interval_ms;
+static struct meminfo last;
+
+static void print_fragmentation(uint32_t thousandths)
+{
+	printf("%u.%03u", thousandths / 1000, thousandths % 1000);
+}
+
+static void print_table(const struct meminfo& mi)
+{
+	printf("pages: %lu, free: %lu, cached: %lu, largest free order: %d\n",
+		mi.nr_pages, mi.nr_free_pages, mi.nr_cached_pages, mi.largest_free_order);
+	printf("splits: %lu, merges: %lu\n", mi.splits, mi.merges);
+	printf("exact allocations: %lu, pages saved: %lu (%lu still in use)\n",
+		mi.exact_allocs, mi.exact_pages_saved, mi.exact_pages_live_saved);
+	printf("contiguous ranges: %lu, pages in use: %lu\n", mi.contig_allocs, mi.contig_pages);
+	printf("fallbacks: %lu pinned, %lu reclaimable, pageblock claims: %lu\n",
+		mi.class_fallbacks[0], mi.class_fallbacks[1], mi.pageblock_claims);
+	printf("regions: %u, lock contentions: %lu\n\n", mi.nr_regions, mi.lock_contentions);
+
+	printf("order      free blocks    failed allocs   fragmentation\n");
+	for (unsigned int order = 0; order <= mi.max_order && order <= MEMINFO_MAX_ORDER; order++) {
+		printf("%5u %16lu %16lu           ", order, mi.free_blocks[order], mi.failed_allocs[order]);
+		print_fragmentation(mi.fragmentation[order]);
+		printf("\n");
+	}
+}
+
+static void print_sample(uint64_t start)
+{
+	struct meminfo mi;
+	if (get_meminfo(&mi) < 0) return;
+
+	uint64_t failed = 0, last_failed = 0;
+	for (unsigned int order = 0; order <= MEMINFO_MAX_ORDER; order++) {
+		failed += mi.failed_allocs[order];
+		last_failed += last.failed_allocs[order];
+	}
+
+	// Fragmentation is shown against order 9 (2 MiB), the size of a large page.
+	printf("%8lu ms  free %9lu  cached %6lu  largest %2d  splits +%lu  merges +%lu  failed +%lu  frag9 ",
+		(get_ticks() - start) / 1000, mi.nr_free_pages, mi.nr_cached_pages, mi.largest_free_order,
+		mi.splits - last.splits, mi.merges - last.merges, failed - last_failed);
+	print_fragmentation(mi.fragmentation[9]);
+	printf("\n");
+
+	last = mi;
+}
+
+static void sampler_thread_proc(void *arg)
+{
+	uint64_t start = *(uint64_t *)arg;
+
+	while (!terminate) {
+		print_sample(start);
+		usleep(interval_ms * 1000);
+	}
+
+	print_sample(start);
+	stop_thread(HTHREAD_SELF);
+}
+
+int main(const char *cmdline)
+{
+	struct meminfo mi;
+	if (get_meminfo(&mi) < 0) {
+		printf("error: the page allocator does not report statistics\n");
+		return 1;
+	}
+
+	if (!cmdline || strlen(cmdline) == 0) {
+		print_table(mi);
+		return 0;
+	}
+
+	const char *cmd = cmdline;
+	interval_ms = 0;
+	while (*cmd >= '0' && *cmd <= '9') {
+		interval_ms = (interval_ms * 10) + (*cmd++ - '0');
+	}
+
+	if (interval_ms == 0 || *cmd != ' ') {
+		printf("usage: meminfo [<interval-ms> <program> [args]]\n");
+		return 1;
+	}
+
+	while (*cmd == ' ') cmd++;
+
+	char prog[64];
+	int n = 0;
+	while (*cmd && *cmd != ' ' && n < 63) {
+		prog[n++] = *cmd++;
+	}
+	prog[n] = 0;
+
+	if (*cmd) cmd++;
+
+	HPROC pcmd = exec(prog, cmd);
+	if (is_error(pcmd)) {
+		printf("error: unable to run command '%s'\n", prog);
+		return 1;
+	}
+
+	last = mi;
+	terminate = false;
+
+	uint64_t start = get_ticks();
+	HTHREAD sampler = create_thread(sampler_thread_proc, &start);
+
+	wait_proc(pcmd);
+
+	terminate = true;
+	join_thread(sampler);
+
+	return 0;
+}
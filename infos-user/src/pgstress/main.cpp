@@ -0,0 +1,98 @@
+/* SPDX-License-Identifier: MIT */
+
+#include <infos.h>
+
+/*
+ * Measures how page allocation scales with the number of CPUs allocating at once - boot with SMP=<n> ./run.sh
+ * (i.e. qemu -smp <n>), pgalloc.algorithm=buddy and pgalloc.stress=1.
+ *
+ *   /usr/pgstress [<max-threads> [<allocations-per-thread>]]
+ *
+ * For each thread count from 1 to max-threads (default 4), starts that many threads that each run the kernel's
+ * page allocator stress loop, and prints the total throughput against a single thread's.
+ */
+
+#define MAX_THREADS 16
+
+static unsigned long nr_allocations;
+
+struct stress_thread
+{
+	HTHREAD thread;
+	unsigned long seed;
+	long failed;
+};
+
+static void stress_thread_proc(void *arg)
+{
+	struct stress_thread *st = (struct stress_thread *)arg;
+
+	st->failed = pgalloc_stress(nr_allocations, st->seed);
+	stop_thread(HTHREAD_SELF);
+}
+
+static unsigned long parse_number(const char *&cmd, unsigned long def)
+{
+	while (*cmd == ' ') cmd++;
+	if (*cmd < '0' || *cmd > '9') return def;
+
+	unsigned long n = 0;
+	while (*cmd >= '0' && *cmd <= '9') {
+		n = (n * 10) + (*cmd++ - '0');
+	}
+	return n;
+}
+
+int main(const char *cmdline)
+{
+	const char *cmd = cmdline ? cmdline : "";
+	unsigned long max_threads = parse_number(cmd, 4);
+	nr_allocations = parse_number(cmd, 1000000);
+
+	if (max_threads < 1 || max_threads > MAX_THREADS || nr_allocations == 0) {
+		printf("usage: pgstress [<max-threads (1-%u)> [<allocations-per-thread>]]\n", MAX_THREADS);
+		return 1;
+	}
+
+	struct meminfo before, after;
+	if (get_meminfo(&before) < 0 || pgalloc_stress(1, 0) < 0) {
+		printf("error: the page allocator does not support the stress test (boot with pgalloc.stress=1)\n");
+		return 1;
+	}
+
+	printf("%u regions, %lu allocations per thread\n", before.nr_regions, nr_allocations);
+	printf("threads      allocs/s     scaling   lock contentions   failed\n");
+
+	static struct stress_thread threads[MAX_THREADS];
+	uint64_t single_rate = 0;
+
+	for (unsigned long n = 1; n <= max_threads; n++) {
+		get_meminfo(&before);
+		uint64_t start = get_ticks();
+
+		for (unsigned long t = 0; t < n; t++) {
+			threads[t].seed = t + 1;
+			threads[t].thread = create_thread(stress_thread_proc, &threads[t]);
+		}
+
+		long failed = 0;
+		for (unsigned long t = 0; t < n; t++) {
+			join_thread(threads[t].thread);
+			failed += threads[t].failed;
+		}
+
+		uint64_t elapsed_us = get_ticks() - start;
+		get_meminfo(&after);
+
+		if (elapsed_us == 0) elapsed_us = 1;
+		uint64_t rate = (nr_allocations * n * 1000000) / elapsed_us;
+		if (n == 1) single_rate = rate;
+
+		// Scaling is shown to two decimal places, as there is no floating point printf.
+		uint64_t scaling = (rate * 100) / single_rate;
+		printf("%7lu %13lu %8lu.%02lux %18lu %8ld\n", n, rate, scaling / 100, scaling % 100,
+			after.lock_contentions - before.lock_contentions, failed);
+	}
+
+	return 0;
+}
@@ -0,0 +1,64 @@
+/* SPDX-License-Identifier: MIT */
+
+#include <infos.h>
+
+/*
+ * Dumps the page allocator's event trace - boot with pgalloc.algorithm=buddy pgalloc.trace=<records>.
+ *
+ *   /usr/pgtrace                  write the events since the last dump to the debug console
+ *   /usr/pgtrace keep             write them, but include them again in the next dump
+ *   /usr/pgtrace reset            start the next dump from here, without writing anything
+ *   /usr/pgtrace <program> [args] start the next dump from here, run a program, then dump what it did
+ *
+ * The trace goes out in binary over QEMU's debug console, which run.sh connects to its standard output - so
+ * capture it with "./run.sh ... > capture", and replay it with tools/buddy-bench/buddy-bench -t capture.
+ */
+
+int main(const char *cmdline)
+{
+	const char *cmd = cmdline ? cmdline : "";
+	while (*cmd == ' ') cmd++;
+
+	unsigned long flags = PGALLOC_TRACE_DUMP | PGALLOC_TRACE_RESET;
+
+	if (strcmp(cmd, "keep") == 0) {
+		flags = PGALLOC_TRACE_DUMP;
+	} else if (strcmp(cmd, "reset") == 0) {
+		flags = PGALLOC_TRACE_RESET;
+	} else if (*cmd) {
+		if (pgalloc_trace(PGALLOC_TRACE_RESET) < 0) {
+			printf("error: page allocation tracing is off (boot with pgalloc.trace=<records>)\n");
+			return 1;
+		}
+
+		//split off the program name, and pass the rest on as its arguments
+		char program[128];
+		unsigned int n = 0;
+		while (cmd[n] && cmd[n] != ' ' && n < sizeof(program) - 1) {
+			program[n] = cmd[n];
+			n++;
+		}
+		program[n] = 0;
+
+		const char *args = cmd + n;
+		while (*args == ' ') args++;
+
+		HPROC proc = exec(program, *args ? args : NULL);
+		if (is_error(proc)) {
+			printf("error: unable to run %s\n", program);
+			return 1;
+		}
+		wait_proc(proc);
+	}
+
+	long records = pgalloc_trace(flags);
+	if (records < 0) {
+		printf("error: page allocation tracing is off (boot with pgalloc.trace=<records>)\n");
+		return 1;
+	}
+
+	if (flags & PGALLOC_TRACE_DUMP) {
+		printf("wrote %ld trace records to the debug console\n", records);
+	}
+	return 0;
+}
@@ -0,0 +1,175 @@
+/* SPDX-License-Identifier: MIT */
+
+#include <infos.h>
+
+/*
+ * Shows the scheduler statistics - boot with sched.algorithm=mq.
+ *
+ *   /usr/schedstat                     print the statistics since boot
+ *   /usr/schedstat <program> [args]    run a program, and print the statistics for the time it ran
+ *
+ * Wake-up latencies are kept in TSC cycles, which are converted to microseconds by timing the TSC against the
+ * system clock first.
+ */
+
+static const char *class_names[SCHEDSTAT_CLASSES] = { "REALTIME", "INTERACTIVE", "NORMAL", "DAEMON" };
+
+static inline uint64_t read_tsc()
+{
+	uint32_t lo, hi;
+	asm volatile("rdtsc" : "=a"(lo), "=d"(hi));
+	return ((uint64_t)hi << 32) | lo;
+}
+
+/* TSC cycles per microsecond. */
+static uint64_t tsc_per_us;
+
+static void calibrate_tsc()
+{
+	uint64_t ticks_start = get_ticks();
+	uint64_t tsc_start = read_tsc();
+
+	usleep(100000);
+
+	uint64_t elapsed_us = get_ticks() - ticks_start;
+	uint64_t elapsed_tsc = read_tsc() - tsc_start;
+
+	tsc_per_us = elapsed_us ? elapsed_tsc / elapsed_us : 0;
+	if (tsc_per_us == 0) tsc_per_us = 1;
+}
+
+/**
+ * Returns the upper bound of a latency bucket, in microseconds.
+ */
+static uint64_t bucket_limit_us(unsigned int bucket)
+{
+	return (2ULL << bucket) / tsc_per_us;
+}
+
+static uint64_t latency_samples(const struct schedstat_class& sc)
+{
+	uint64_t total = 0;
+	for (unsigned int b = 0; b < SCHEDSTAT_LATENCY_BUCKETS; b++) total += sc.latency[b];
+	return total;
+}
+
+/**
+ * Returns the bucket the given fraction (in thousandths) of a class's latencies fall within.
+ */
+static unsigned int latency_percentile(const struct schedstat_class& sc, uint64_t thousandths)
+{
+	uint64_t total = latency_samples(sc);
+	uint64_t target = (total * thousandths + 999) / 1000, seen = 0;
+	for (unsigned int b = 0; b < SCHEDSTAT_LATENCY_BUCKETS; b++) {
+		seen += sc.latency[b];
+		if (seen >= target && seen) return b;
+	}
+
+	return 0;
+}
+
+/**
+ * Takes the statistics in one snapshot away from those in a later one.
+ */
+static void subtract(struct schedstat& after, const struct schedstat& before)
+{
+	after.picks -= before.picks;
+	after.idle_picks -= before.idle_picks;
+	after.migrations -= before.migrations;
+
+	for (unsigned int cls = 0; cls < SCHEDSTAT_CLASSES; cls++) {
+		struct schedstat_class& a = after.classes[cls];
+		const struct schedstat_class& b = before.classes[cls];
+
+		a.picks -= b.picks;
+		a.preemptions -= b.preemptions;
+		a.boosts -= b.boosts;
+		a.wakeups -= b.wakeups;
+		a.queue_length_sum -= b.queue_length_sum;
+		for (unsigned int i = 0; i < SCHEDSTAT_LATENCY_BUCKETS; i++) a.latency[i] -= b.latency[i];
+	}
+}
+
+static void print_table(const struct schedstat& ss)
+{
+	printf("levels: %u, cpus: %u, picks: %lu, idle: %lu, migrations: %lu, tsc: %lu MHz\n\n", ss.nr_levels,
+		ss.nr_cpus, ss.picks, ss.idle_picks, ss.migrations, tsc_per_us);
+
+	// The mean run queue length is shown to two decimal places, as there is no floating point printf.
+	printf("class            picks  preemptions     boosts    wakeups   mean rq   max rq   p50 (us)   p99 (us)\n");
+	for (unsigned int cls = 0; cls < SCHEDSTAT_CLASSES; cls++) {
+		const struct schedstat_class& sc = ss.classes[cls];
+		uint64_t mean = ss.picks ? (sc.queue_length_sum * 100) / ss.picks : 0;
+
+		printf("%11s %10lu %12lu %10lu %10lu %6lu.%02lu %8lu ", class_names[cls], sc.picks, sc.preemptions,
+			sc.boosts, sc.wakeups, mean / 100, mean % 100, sc.queue_length_max);
+		if (latency_samples(sc)) {
+			printf("%10lu %10lu\n", bucket_limit_us(latency_percentile(sc, 500)),
+				bucket_limit_us(latency_percentile(sc, 990)));
+		} else {
+			printf("%10s %10s\n", "-", "-");
+		}
+	}
+
+	for (unsigned int cls = 0; cls < SCHEDSTAT_CLASSES; cls++) {
+		const struct schedstat_class& sc = ss.classes[cls];
+
+		bool header = false;
+		for (unsigned int b = 0; b < SCHEDSTAT_LATENCY_BUCKETS; b++) {
+			if (!sc.latency[b]) continue;
+
+			if (!header) {
+				printf("\n%s wake-up latency:\n", class_names[cls]);
+				header = true;
+			}
+			printf("  < %8lu us %10lu\n", bucket_limit_us(b), sc.latency[b]);
+		}
+	}
+}
+
+int main(const char *cmdline)
+{
+	struct schedstat before;
+	if (get_schedstat(&before) < 0) {
+		printf("error: the scheduler does not report statistics\n");
+		return 1;
+	}
+
+	calibrate_tsc();
+
+	if (!cmdline || strlen(cmdline) == 0) {
+		print_table(before);
+		return 0;
+	}
+
+	const char *cmd = cmdline;
+	while (*cmd == ' ') cmd++;
+
+	char prog[64];
+	int n = 0;
+	while (*cmd && *cmd != ' ' && n < 63) {
+		prog[n++] = *cmd++;
+	}
+	prog[n] = 0;
+
+	if (*cmd) cmd++;
+
+	get_schedstat(&before);
+
+	HPROC pcmd = exec(prog, cmd);
+	if (is_error(pcmd)) {
+		printf("error: unable to run command '%s'\n", prog);
+		return 1;
+	}
+
+	wait_proc(pcmd);
+
+	struct schedstat after;
+	get_schedstat(&after);
+	subtract(after, before);
+
+	printf("\n");
+	print_table(after);
+
+	return 0;
+}
@@ -0,0 +1,125 @@
+/* SPDX-License-Identifier: MIT */
+
+#include <infos.h>
+
+/*
+ * Measures how often CPU-bound threads of one priority are switched out - boot with sched.algorithm=mq, and run
+ * once with sched.timeslice=1,1,1,1 (a new pick on every scheduling event) and once with the default timeslices
+ * (or others) to compare the context switch rates.
+ *
+ *   /usr/slice-sched-test [<threads> [<seconds> [<priority (0-3)>]]]
+ *
+ * Starts the given number of threads (default 4) at the given priority (default 3, DAEMON), which each run a
+ * floating point loop like xsave-test's for the given time (default 5 seconds).  A thread notices it was switched
+ * out when the clock jumps between two turns of its loop, so it can count how often it was run again, and for how
+ * long it ran each time.
+ */
+
+#define MAX_THREADS 16
+
+/* A gap between two turns of a thread's loop longer than this means the thread was switched out. */
+#define SWITCH_THRESHOLD_US 500
+
+static uint64_t end;
+
+struct slice_thread
+{
+	HTHREAD thread;
+	uint64_t loops;
+	uint64_t switches;
+	uint64_t run_us;
+	uint64_t max_run_us;
+	double result;
+};
+
+static void slice_thread_proc(void *arg)
+{
+	struct slice_thread *st = (struct slice_thread *)arg;
+
+	uint64_t prev = get_ticks();
+	uint64_t run_start = prev;
+	double base = 1.0001;
+
+	for (;;) {
+		// A short turn of floating point work, so the thread's FPU state is live whenever it is switched out.
+		double result = base;
+		for (int i = 0; i < 256; i++) {
+			result = result * base;
+		}
+		st->result = result;
+		st->loops++;
+
+		uint64_t now = get_ticks();
+		if (now - prev > SWITCH_THRESHOLD_US) {
+			uint64_t ran = prev - run_start;
+			st->switches++;
+			st->run_us += ran;
+			if (ran > st->max_run_us) st->max_run_us = ran;
+			run_start = now;
+		}
+		prev = now;
+
+		if (now >= end) break;
+	}
+
+	st->run_us += prev - run_start;
+	stop_thread(HTHREAD_SELF);
+}
+
+static unsigned long parse_number(const char *&cmd, unsigned long def)
+{
+	while (*cmd == ' ') cmd++;
+	if (*cmd < '0' || *cmd > '9') return def;
+
+	unsigned long n = 0;
+	while (*cmd >= '0' && *cmd <= '9') {
+		n = (n * 10) + (*cmd++ - '0');
+	}
+	return n;
+}
+
+int main(const char *cmdline)
+{
+	const char *cmd = cmdline ? cmdline : "";
+	unsigned long nr_threads = parse_number(cmd, 4);
+	unsigned long seconds = parse_number(cmd, 5);
+	unsigned long priority = parse_number(cmd, SchedulingEntityPriority::DAEMON);
+
+	if (nr_threads < 1 || nr_threads > MAX_THREADS || seconds == 0 || priority > SchedulingEntityPriority::DAEMON) {
+		printf("usage: slice-sched-test [<threads (1-%u)> [<seconds> [<priority (0-3)>]]]\n", MAX_THREADS);
+		return 1;
+	}
+
+	printf("%lu CPU-bound threads at priority %lu for %lu seconds\n", nr_threads, priority, seconds);
+
+	static struct slice_thread threads[MAX_THREADS];
+
+	uint64_t start = get_ticks();
+	end = start + (seconds * 1000000);
+
+	for (unsigned long i = 0; i < nr_threads; i++) {
+		threads[i].thread = create_thread(slice_thread_proc, &threads[i], (SchedulingEntityPriority)priority);
+	}
+
+	for (unsigned long i = 0; i < nr_threads; i++) {
+		join_thread(threads[i].thread);
+	}
+
+	uint64_t elapsed_us = get_ticks() - start;
+	if (elapsed_us == 0) elapsed_us = 1;
+
+	uint64_t switches = 0, loops = 0;
+	printf("thread       loops   switches   mean run (us)   max run (us)\n");
+	for (unsigned long i = 0; i < nr_threads; i++) {
+		struct slice_thread *st = &threads[i];
+		uint64_t mean = st->run_us / (st->switches + 1);
+
+		printf("%6lu %11lu %10lu %15lu %14lu\n", i, st->loops, st->switches, mean, st->max_run_us);
+		switches += st->switches;
+		loops += st->loops;
+	}
+
+	printf("total: %lu loops, %lu switches, %lu switches/s\n", loops, switches, (switches * 1000000) / elapsed_us);
+
+	return 0;
+}
@@ -8,4 +8,4 @@ KERNEL=$INFOS_DIR/out/infos-kernel
 KERNEL_CMDLINE="boot-device=ata0 init=/usr/init pgalloc.debug=0 pgalloc.algorithm=simple objalloc.debug=0 sched.debug=0 sched.algorithm=cfs syslog=serial $*"
 QEMU=qemu-system-x86_64
 
-$QEMU -kernel $KERNEL -m 6G -debugcon stdio -hda $ROOTFS -append "$KERNEL_CMDLINE"
+$QEMU -kernel $KERNEL -m 6G -smp ${SMP:-1} -debugcon stdio -hda $ROOTFS -append "$KERNEL_CMDLINE"
@@ -0,0 +1,1035 @@
+/*
+ * Host benchmark and trace replay for the buddy page allocator
+ *
+ * Builds coursework/buddy.cpp for Linux against the InfOS shim in tools/shim, then drives it with a
+ * synthetic workload or a recorded trace, and reports per-order latency, fragmentation and free
+ * list lengths.  See usage() for the options.
+ *
+ * With -j, it instead runs the SYS_PGALLOC_STRESS loop on 1 to N threads at once (each thread acting as its own
+ * CPU), and reports how throughput scales - the host counterpart of /usr/pgstress under qemu -smp N.
+ *
+ * Trace files are text, one operation per line ('#' starts a comment):
+ *   a <id> <order> [c] allocate a block of 2^order pages, and call it <id> - of lifetime class c
+ *                      (0 pinned, the default, or 1 reclaimable)
+ *   e <id> <count> [c] allocate exactly <count> pages with allocate_pages_exact, and call them <id>
+ *   c <id> <count> [c] allocate <count> contiguous pages with allocate_contig_range, which may be more than a
+ *                      max-order block holds, and call them <id>
+ *   f <id>             free the block or pages called <id>
+ *   i <pfn> <count>    make <count> pages from <pfn> available
+ *   r <pfn> <count>    make <count> pages from <pfn> unavailable
+ * Ids are small non-negative integers, and may be reused once freed.  A trace that starts with an 'i' brings
+ * its own memory map, and -M is ignored.
+ *
+ * A trace can also be a capture of the kernel's debug console with allocation trace dumps in it (boot with
+ * pgalloc.trace=<records> and run /usr/pgtrace, under "./run.sh ... > capture").  The dumps are picked out of
+ * the capture and their events turned into the operations above, blocks being named by their pfns as they go;
+ * frees of blocks allocated before the trace began are left out, and bulk allocations and frees replay a block
+ * at a time.  -r writes such a trace back out as text.
+ */
+
+#include <thread>
+
+#define HAVE_CURRENT_CPU_ID
+static thread_local unsigned int bench_cpu;
+static inline unsigned int current_cpu_id() { return bench_cpu; }
+
+#include "../../coursework/buddy.cpp"
+
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
+#include <random>
+#include <chrono>
+#include <x86intrin.h>
+#include <unistd.h>
+
+struct Op
+{
+	enum Type { ALLOC, FREE, ALLOC_EXACT, ALLOC_CONTIG, INSERT_RANGE, REMOVE_RANGE } type;
+	uint32_t id;
+	int order;
+	int cls;
+	uint64_t pfn = 0;		// for ranges
+	uint64_t count = 0;		// for ranges, and exact and contiguous allocations, in pages
+};
+
+struct Options
+{
+	uint64_t memory_mib = 6144;
+	uint64_t nr_ops = 1000000;
+	uint64_t live_target = 16384;
+	uint64_t sample_interval = 1000;
+	unsigned int nr_threads = 0;
+	int fragmentation_order = 9;
+	unsigned int seed = 1;
+	const char *workload = "churn";
+	const char *memory_map = "pc";
+	const char *trace = NULL;
+	const char *record = NULL;
+	bool dump = false;
+};
+
+/* The share of allocations made at each order by the synthetic workloads, in percent. */
+static const int order_mix[][2] = { { 0, 60 }, { 1, 20 }, { 2, 10 }, { 3, 5 }, { 4, 3 }, { 9, 2 } };
+
+static int pick_order(std::mt19937& rng)
+{
+	int r = rng() % 100;
+	for (auto& mix : order_mix) {
+		if (r < mix[1]) return mix[0];
+		r -= mix[1];
+	}
+	return 0;
+}
+
+/**
+ * Builds an operation stream from a synthetic workload model.  Blocks are named by the slot they
+ * occupy in the live set, so ids stay small.
+ */
+class WorkloadGenerator
+{
+public:
+	WorkloadGenerator(const Options& opts) : _opts(opts), _rng(opts.seed) { }
+
+	bool generate(std::vector<Op>& ops)
+	{
+		if (strcmp(_opts.workload, "churn") == 0) {
+			churn(ops, _opts.nr_ops);
+		} else if (strcmp(_opts.workload, "fragment") == 0) {
+			fragment(ops);
+			churn(ops, _opts.nr_ops);
+		} else if (strcmp(_opts.workload, "lifo") == 0) {
+			lifo(ops);
+		} else if (strcmp(_opts.workload, "forkexit") == 0) {
+			forkexit(ops);
+		} else if (strcmp(_opts.workload, "soak") == 0) {
+			soak(ops);
+		} else {
+			return false;
+		}
+
+		drain(ops);
+		return true;
+	}
+
+private:
+	uint32_t emit_alloc(std::vector<Op>& ops, int order, int cls)
+	{
+		uint32_t id;
+		if (_free_ids.empty()) {
+			id = _next_id++;
+		} else {
+			id = _free_ids.back();
+			_free_ids.pop_back();
+		}
+
+		ops.push_back({ Op::ALLOC, id, order, cls });
+		return id;
+	}
+
+	void emit_free(std::vector<Op>& ops, uint32_t id)
+	{
+		ops.push_back({ Op::FREE, id, 0, 0 });
+		_free_ids.push_back(id);
+	}
+
+	void alloc(std::vector<Op>& ops, int order)
+	{
+		_live.push_back(emit_alloc(ops, order, 0));
+	}
+
+	void free_random(std::vector<Op>& ops)
+	{
+		size_t victim = _rng() % _live.size();
+		std::swap(_live[victim], _live.back());
+
+		emit_free(ops, _live.back());
+		_live.pop_back();
+	}
+
+	/* Random allocations and frees, holding the live set around its target size. */
+	void churn(std::vector<Op>& ops, uint64_t count)
+	{
+		for (uint64_t i = 0; i < count; i++) {
+			bool grow = _live.size() < _opts.live_target / 2 ||
+				(_live.size() < (_opts.live_target * 3) / 2 && (_rng() % 2));
+
+			if (grow || _live.empty()) {
+				alloc(ops, pick_order(_rng));
+			} else {
+				free_random(ops);
+			}
+		}
+	}
+
+	/* Allocates four times the live target in small blocks, then frees a random half of them. */
+	void fragment(std::vector<Op>& ops)
+	{
+		for (uint64_t i = 0; i < _opts.live_target * 4; i++) {
+			alloc(ops, _rng() % 4);
+		}
+
+		for (uint64_t i = 0; i < _opts.live_target * 2; i++) {
+			free_random(ops);
+		}
+	}
+
+	/* Batches of allocations freed in reverse order, like a burst of short-lived page tables. */
+	void lifo(std::vector<Op>& ops)
+	{
+		const unsigned int batch = 64;
+
+		for (uint64_t i = 0; i < _opts.nr_ops; i += batch * 2) {
+			for (unsigned int j = 0; j < batch; j++) {
+				alloc(ops, pick_order(_rng));
+			}
+
+			for (unsigned int j = 0; j < batch; j++) {
+				ops.push_back({ Op::FREE, _live.back(), 0, 0 });
+				_free_ids.push_back(_live.back());
+				_live.pop_back();
+			}
+		}
+	}
+
+	void free_id(std::vector<Op>& ops, uint32_t id)
+	{
+		auto it = std::find(_live.begin(), _live.end(), id);
+		std::swap(*it, _live.back());
+
+		emit_free(ops, id);
+		_live.pop_back();
+	}
+
+	/* Processes being created and torn down, a fixed number alive at once: each fork allocates page tables,
+	 * a kernel stack and a run of image and stack pages, and each exit frees the lot. */
+	void forkexit(std::vector<Op>& ops)
+	{
+		const unsigned int nr_processes = 32;
+		std::vector<std::vector<uint32_t>> processes;
+
+		while (ops.size() < _opts.nr_ops) {
+			if (processes.size() == nr_processes) {
+				size_t victim = _rng() % processes.size();
+				std::swap(processes[victim], processes.back());
+
+				for (uint32_t id : processes.back()) {
+					free_id(ops, id);
+				}
+				processes.pop_back();
+			}
+
+			std::vector<uint32_t> process;
+			auto take = [&](int order, unsigned int count) {
+				for (unsigned int i = 0; i < count; i++) {
+					alloc(ops, order);
+					process.push_back(_live.back());
+				}
+			};
+
+			take(0, 4 + (_rng() % 4));		// page tables
+			take(2, 1);						// kernel stack
+			take(0, 8 + (_rng() % 56));		// image, heap and user stack pages
+			take(1, _rng() % 3);			// the odd larger buffer
+			processes.push_back(process);
+		}
+	}
+
+	/* Hours of uptime, compressed: reclaimable memory comes and goes a job at a time (each job allocates a
+	 * few hundred small blocks, and frees them all when it ends), swinging between 60% and 85% of memory,
+	 * while pinned pages are allocated in between, build up slowly to 4% of memory, and are only rarely
+	 * freed.  Every 2000 operations an order 9 reclaimable block is asked for and given straight back, to see
+	 * if large blocks can still be had. */
+	void soak(std::vector<Op>& ops)
+	{
+		uint64_t pages = (_opts.memory_mib << 20) >> __page_bits;
+		uint64_t reclaimable_low = (pages * 60) / 100, reclaimable_high = (pages * 85) / 100;
+		uint64_t pinned_target = (pages * 4) / 100;
+		uint64_t reclaimable_pages = 0, pinned_pages = 0;
+
+		struct Job
+		{
+			std::vector<uint32_t> blocks;
+			uint64_t pages;
+		};
+
+		std::vector<Job> jobs;
+		std::vector<std::pair<uint32_t, int>> pinned;
+		bool growing = true;
+		uint64_t next_probe = 0;
+
+		auto pinned_op = [&]() {
+			//pinned pages mostly accumulate, with one in eight operations a free
+			if (pinned.empty() || (pinned_pages < pinned_target && _rng() % 8)) {
+				int order = (_rng() % 5 == 0) ? 1 : 0;
+				pinned.push_back({ emit_alloc(ops, order, 0), order });
+				pinned_pages += 1ULL << order;
+			} else {
+				size_t victim = _rng() % pinned.size();
+				std::swap(pinned[victim], pinned.back());
+
+				emit_free(ops, pinned.back().first);
+				pinned_pages -= 1ULL << pinned.back().second;
+				pinned.pop_back();
+			}
+		};
+
+		while (ops.size() < _opts.nr_ops) {
+			if (ops.size() >= next_probe) {
+				emit_free(ops, emit_alloc(ops, 9, 1));
+				next_probe += 2000;
+			}
+
+			if (reclaimable_pages >= reclaimable_high) growing = false;
+			if (reclaimable_pages <= reclaimable_low) growing = true;
+
+			//mostly move towards the current bound, with some churn the other way
+			if (jobs.empty() || (growing == (_rng() % 4 != 0))) {
+				Job job = { { }, 0 };
+				unsigned int nr_blocks = 64 + (_rng() % 448);
+
+				for (unsigned int i = 0; i < nr_blocks; i++) {
+					int order = pick_order(_rng) % 4;
+					job.blocks.push_back(emit_alloc(ops, order, 1));
+					job.pages += 1ULL << order;
+
+					if (_rng() % 64 == 0) pinned_op();
+				}
+
+				reclaimable_pages += job.pages;
+				jobs.push_back(job);
+			} else {
+				size_t victim = _rng() % jobs.size();
+				std::swap(jobs[victim], jobs.back());
+
+				for (uint32_t id : jobs.back().blocks) {
+					emit_free(ops, id);
+				}
+				reclaimable_pages -= jobs.back().pages;
+				jobs.pop_back();
+			}
+		}
+
+		for (auto& b : pinned) _live.push_back(b.first);
+		for (auto& job : jobs) {
+			for (uint32_t id : job.blocks) _live.push_back(id);
+		}
+	}
+
+	/* Frees whatever is still live, so every run ends with an empty heap. */
+	void drain(std::vector<Op>& ops)
+	{
+		while (!_live.empty()) {
+			free_random(ops);
+		}
+	}
+
+	const Options& _opts;
+	std::mt19937 _rng;
+	std::vector<uint32_t> _live;
+	std::vector<uint32_t> _free_ids;
+	uint32_t _next_id = 0;
+};
+
+/**
+ * Returns the order of the smallest block that holds count pages.
+ */
+static int order_for_pages(uint64_t count)
+{
+	int order = 0;
+	while ((1ULL << order) < count) {
+		order++;
+	}
+	return order;
+}
+
+/**
+ * Turns the events in the allocation trace dumps found in a debug console capture into operations.  Dumps are
+ * taken in the order they appear, so a run of dumps made with PGALLOC_TRACE_RESET replays as one trace.
+ * @param data The capture.
+ * @param ops Receives the operations.
+ * @param nr_pages Receives the number of pages the traced allocator managed.
+ * @return Returns FALSE if there is no whole dump in the capture.
+ */
+static bool decode_binary_trace(const std::vector<char>& data, std::vector<Op>& ops, uint64_t& nr_pages)
+{
+	std::unordered_map<uint64_t, uint32_t> live;	// pfn -> id of each block allocated in the trace so far
+	size_t last_contig[16];							// by CPU: the op of the last contiguous range allocated
+	std::vector<bool> exact;						// by id: whether the block came from allocate_pages_exact
+	std::vector<uint32_t> free_ids;
+	uint32_t next_id = 0;
+	uint64_t nr_dumps = 0, nr_dropped = 0, nr_skipped = 0, nr_unmatched = 0;
+
+	for (size_t& op : last_contig) op = SIZE_MAX;
+
+	auto new_id = [&]() {
+		if (free_ids.empty()) {
+			exact.push_back(false);
+			return next_id++;
+		}
+		uint32_t id = free_ids.back();
+		free_ids.pop_back();
+		return id;
+	};
+
+	auto free_block = [&](uint64_t pfn) {
+		auto it = live.find(pfn);
+		if (it == live.end()) {
+			nr_unmatched++;
+			return;
+		}
+		ops.push_back({ Op::FREE, it->second, 0, 0 });
+		free_ids.push_back(it->second);
+		live.erase(it);
+	};
+
+	auto alloc_block = [&](uint64_t pfn, Op op) {
+		//a free we never saw (its record was lost) shows up as the pfn being handed out again
+		if (pfn != NO_PFN && live.count(pfn)) free_block(pfn);
+
+		op.id = new_id();
+		exact[op.id] = (op.type == Op::ALLOC_EXACT);
+		ops.push_back(op);
+
+		//a block the traced allocator failed to find never gets freed, so its id is never reused
+		if (pfn != NO_PFN) live[pfn] = op.id;
+	};
+
+	size_t pos = 0;
+	while (true) {
+		auto magic = std::search(data.begin() + pos, data.end(), TRACE_MAGIC, TRACE_MAGIC + 8);
+		if (magic == data.end()) break;
+		pos = magic - data.begin();
+
+		BuddyTraceHeader header;
+		if (data.size() - pos < sizeof(header)) break;
+		memcpy(&header, &data[pos], sizeof(header));
+
+		uint64_t records_size = header.nr_records * sizeof(BuddyTraceRecord);
+		BuddyTraceTrailer trailer;
+		if (header.record_size != sizeof(BuddyTraceRecord) || header.max_order != MAX_ORDER ||
+				data.size() - pos - sizeof(header) < records_size + sizeof(trailer)) {
+			fprintf(stderr, "trace dump at byte %lu is cut short, or from an incompatible allocator - skipped\n", pos);
+			pos += 8;
+			continue;
+		}
+
+		memcpy(&trailer, &data[pos + sizeof(header) + records_size], sizeof(trailer));
+		if (memcmp(trailer.magic, TRACE_END_MAGIC, 8) != 0) {
+			fprintf(stderr, "trace dump at byte %lu has no end marker - skipped\n", pos);
+			pos += 8;
+			continue;
+		}
+
+		const char *record_data = &data[pos + sizeof(header)];
+		for (uint64_t i = 0; i < header.nr_records; i++) {
+			BuddyTraceRecord r;
+			memcpy(&r, record_data + (i * sizeof(r)), sizeof(r));
+
+			switch (r.event()) {
+			case TRACE_ALLOC:
+				alloc_block(r.pfn, { Op::ALLOC, 0, (int)r.arg(), r.cls() });
+				break;
+			case TRACE_ALLOC_EXACT:
+				alloc_block(r.pfn, { Op::ALLOC_EXACT, 0, order_for_pages(r.arg()), r.cls(), 0, r.arg() });
+				break;
+			case TRACE_ALLOC_CONTIG:
+				alloc_block(r.pfn, { Op::ALLOC_CONTIG, 0, MAX_ORDER, r.cls(), 0, r.arg() });
+				last_contig[r.cpu()] = ops.size() - 1;
+				break;
+			case TRACE_CONTIG_MORE:
+				//the rest of a range too large for one record, which the CPU recorded straight after the range's start
+				if (last_contig[r.cpu()] < ops.size()) ops[last_contig[r.cpu()]].count += r.arg();
+				break;
+			case TRACE_FREE:
+			case TRACE_FREE_EXACT:
+			case TRACE_FREE_CONTIG:
+				free_block(r.pfn);
+				break;
+			case TRACE_INSERT_RANGE:
+			case TRACE_REMOVE_RANGE:
+				ops.push_back({ r.event() == TRACE_INSERT_RANGE ? Op::INSERT_RANGE : Op::REMOVE_RANGE, 0, 0, 0, r.pfn, r.arg() });
+				break;
+			default:
+				//an empty record, overwritten while it was being dumped
+				break;
+			}
+		}
+
+		nr_pages = header.nr_pages;
+		nr_dropped += header.nr_dropped;
+		nr_skipped += trailer.nr_skipped;
+		nr_dumps++;
+		pos += sizeof(header) + records_size + sizeof(trailer);
+	}
+
+	if (!nr_dumps) return false;
+
+	fprintf(stderr, "%lu trace dumps: %lu operations, %lu records overwritten before dumping, %lu while dumping, "
+		"%lu frees of blocks allocated before the trace left out\n", nr_dumps, ops.size(), nr_dropped, nr_skipped, nr_unmatched);
+	return true;
+}
+
+static bool load_trace(const char *path, std::vector<Op>& ops, uint64_t& nr_pages)
+{
+	FILE *f = fopen(path, "r");
+	if (!f) {
+		perror(path);
+		return false;
+	}
+
+	//a capture with a binary dump in it is decoded as such, and anything else is read as text
+	std::vector<char> data;
+	char chunk[65536];
+	size_t n;
+	while ((n = fread(chunk, 1, sizeof(chunk), f)) > 0) {
+		data.insert(data.end(), chunk, chunk + n);
+	}
+
+	if (std::search(data.begin(), data.end(), TRACE_MAGIC, TRACE_MAGIC + 8) != data.end()) {
+		fclose(f);
+		if (decode_binary_trace(data, ops, nr_pages)) return true;
+
+		fprintf(stderr, "%s: no whole trace dump found\n", path);
+		return false;
+	}
+	rewind(f);
+
+	char line[128];
+	unsigned int lineno = 0;
+	while (fgets(line, sizeof(line), f)) {
+		lineno++;
+
+		char type;
+		unsigned long id;
+		long arg = 0;
+		int cls = 0;
+
+		if (line[0] == '#' || line[0] == '\n') continue;
+		int fields = sscanf(line, "%c %lu %ld %d", &type, &id, &arg, &cls);
+		bool cls_ok = cls >= 0 && cls < NR_ALLOC_CLASSES;
+
+		if (type == 'a' && fields >= 3 && arg >= 0 && arg <= MAX_ORDER && cls_ok) {
+			ops.push_back({ Op::ALLOC, (uint32_t)id, (int)arg, cls });
+		} else if (type == 'e' && fields >= 3 && arg > 0 && arg <= (1L << MAX_ORDER) && cls_ok) {
+			ops.push_back({ Op::ALLOC_EXACT, (uint32_t)id, order_for_pages(arg), cls, 0, (uint64_t)arg });
+		} else if (type == 'c' && fields >= 3 && arg > 0 && cls_ok) {
+			ops.push_back({ Op::ALLOC_CONTIG, (uint32_t)id, MAX_ORDER, cls, 0, (uint64_t)arg });
+		} else if (type == 'f' && fields >= 2) {
+			ops.push_back({ Op::FREE, (uint32_t)id, 0, 0 });
+		} else if ((type == 'i' || type == 'r') && fields >= 3 && arg > 0) {
+			ops.push_back({ type == 'i' ? Op::INSERT_RANGE : Op::REMOVE_RANGE, 0, 0, 0, id, (uint64_t)arg });
+		} else {
+			fprintf(stderr, "%s:%u: malformed trace line\n", path, lineno);
+			fclose(f);
+			return false;
+		}
+	}
+
+	fclose(f);
+	return true;
+}
+
+static bool record_trace(const char *path, const std::vector<Op>& ops)
+{
+	FILE *f = fopen(path, "w");
+	if (!f) {
+		perror(path);
+		return false;
+	}
+
+	for (const Op& op : ops) {
+		switch (op.type) {
+		case Op::ALLOC:
+			if (op.cls) {
+				fprintf(f, "a %u %d %d\n", op.id, op.order, op.cls);
+			} else {
+				fprintf(f, "a %u %d\n", op.id, op.order);
+			}
+			break;
+		case Op::ALLOC_EXACT:
+		case Op::ALLOC_CONTIG:
+			fprintf(f, "%c %u %lu %d\n", op.type == Op::ALLOC_EXACT ? 'e' : 'c', op.id, op.count, op.cls);
+			break;
+		case Op::FREE:
+			fprintf(f, "f %u\n", op.id);
+			break;
+		case Op::INSERT_RANGE:
+		case Op::REMOVE_RANGE:
+			fprintf(f, "%c %lu %lu\n", op.type == Op::INSERT_RANGE ? 'i' : 'r', op.pfn, op.count);
+			break;
+		}
+	}
+
+	fclose(f);
+	return true;
+}
+
+/**
+ * Converts TSC ticks into nanoseconds, by timing a short sleep against the host clock.
+ */
+static double tsc_ns_per_tick()
+{
+	auto start = std::chrono::steady_clock::now();
+	uint64_t tsc_start = __rdtsc();
+	std::this_thread::sleep_for(std::chrono::milliseconds(50));
+	uint64_t tsc_end = __rdtsc();
+	auto end = std::chrono::steady_clock::now();
+
+	return std::chrono::duration<double, std::nano>(end - start).count() / (double)(tsc_end - tsc_start);
+}
+
+/**
+ * Replays an operation stream against the allocator, and collects what it costs.
+ */
+class Replayer
+{
+public:
+	Replayer(BuddyPageAllocator& alloc, const Options& opts) : _alloc(alloc), _opts(opts) { }
+
+	bool run(const std::vector<Op>& ops)
+	{
+		_alloc.get_meminfo(_start_info);
+
+		for (uint64_t i = 0; i < ops.size(); i++) {
+			const Op& op = ops[i];
+
+			if (op.type == Op::INSERT_RANGE || op.type == Op::REMOVE_RANGE) {
+				PageAllocator& pgalloc = sys.mm().pgalloc();
+				if (op.pfn + op.count > pgalloc.nr_pages()) {
+					fprintf(stderr, "op %lu: page range %lx+%lx is outside the simulated memory\n", i, op.pfn, op.count);
+					return false;
+				}
+
+				if (op.type == Op::INSERT_RANGE) {
+					_alloc.insert_page_range(pgalloc.pfn_to_pgd(op.pfn), op.count);
+				} else {
+					_alloc.remove_page_range(pgalloc.pfn_to_pgd(op.pfn), op.count);
+				}
+			} else if (op.type != Op::FREE) {
+				if (op.id >= _blocks.size()) _blocks.resize(op.id + 1, Block());
+				if (_blocks[op.id].pgd) {
+					fprintf(stderr, "op %lu: id %u allocated twice\n", i, op.id);
+					return false;
+				}
+
+				uint64_t start = __rdtsc();
+				PageDescriptor *pgd;
+				if (op.type == Op::ALLOC_EXACT) {
+					pgd = _alloc.allocate_pages_exact(op.count, (BuddyAllocClass)op.cls);
+				} else if (op.type == Op::ALLOC_CONTIG) {
+					pgd = _alloc.allocate_contig_range(op.count, 0, (BuddyAllocClass)op.cls);
+				} else {
+					pgd = _alloc.allocate_pages(op.order, (BuddyAllocClass)op.cls);
+				}
+				uint64_t end = __rdtsc();
+
+				_alloc_ticks[op.order].push_back(end - start);
+
+				//track how often large allocations succeed over the course of the run
+				if (op.order >= _opts.fragmentation_order) {
+					unsigned int tenth = (i * 10) / ops.size();
+					_large_attempts[tenth]++;
+					if (!pgd) _large_failures[tenth]++;
+				}
+
+				if (!pgd) {
+					_failed[op.order]++;
+					continue;
+				}
+
+				if (sys.mm().pgalloc().pgd_to_pfn(pgd) & ((1ULL << op.order) - 1)) {
+					fprintf(stderr, "op %lu: order %d block is misaligned\n", i, op.order);
+					return false;
+				}
+
+				_blocks[op.id].pgd = pgd;
+				_blocks[op.id].order = op.order;
+				_blocks[op.id].exact_count = (op.type == Op::ALLOC_EXACT) ? op.count : 0;
+				_blocks[op.id].contig_count = (op.type == Op::ALLOC_CONTIG) ? op.count : 0;
+			} else {
+				if (op.id >= _blocks.size() || !_blocks[op.id].pgd) {
+					//the allocation failed (or the trace frees something it never had) - nothing to do
+					continue;
+				}
+
+				Block& b = _blocks[op.id];
+
+				uint64_t start = __rdtsc();
+				if (b.exact_count) {
+					_alloc.free_pages_exact(b.pgd, b.exact_count);
+				} else if (b.contig_count) {
+					_alloc.free_contig_range(b.pgd, b.contig_count);
+				} else {
+					_alloc.free_pages(b.pgd, b.order);
+				}
+				uint64_t end = __rdtsc();
+
+				_free_ticks[b.order].push_back(end - start);
+				b.pgd = NULL;
+			}
+
+			if (i % _opts.sample_interval == 0) {
+				sample();
+			}
+		}
+
+		sample();
+		return true;
+	}
+
+	void report() const
+	{
+		double ns = tsc_ns_per_tick();
+
+		printf("order    allocs   alloc ns/op   p50   p99      frees   free ns/op   p50   p99   failed\n");
+		for (int order = 0; order <= MAX_ORDER; order++) {
+			if (_alloc_ticks[order].empty() && _free_ticks[order].empty()) continue;
+
+			LatencySummary a = summarise(_alloc_ticks[order], ns);
+			LatencySummary f = summarise(_free_ticks[order], ns);
+
+			printf("%5d %9lu %13.1f %5.0f %5.0f %10lu %12.1f %5.0f %5.0f %8lu\n", order,
+				_alloc_ticks[order].size(), a.mean, a.p50, a.p99,
+				_free_ticks[order].size(), f.mean, f.p50, f.p99, _failed[order]);
+		}
+
+		BuddyMemInfo info;
+		_alloc.get_meminfo(info);
+		printf("\nsplits: %lu, merges: %lu, class fallbacks: %lu pinned, %lu reclaimable, pageblock claims: %lu\n",
+			info.splits - _start_info.splits, info.merges - _start_info.merges,
+			info.class_fallbacks[ALLOC_PINNED] - _start_info.class_fallbacks[ALLOC_PINNED],
+			info.class_fallbacks[ALLOC_RECLAIMABLE] - _start_info.class_fallbacks[ALLOC_RECLAIMABLE],
+			info.pageblock_claims - _start_info.pageblock_claims);
+
+		uint64_t large_attempts = 0;
+		for (uint64_t attempts : _large_attempts) large_attempts += attempts;
+
+		if (large_attempts) {
+			printf("\norder >= %d success rate, by tenth of the run:", _opts.fragmentation_order);
+			for (unsigned int tenth = 0; tenth < 10; tenth++) {
+				if (!_large_attempts[tenth]) {
+					printf("     -");
+				} else {
+					printf(" %4.0f%%", 100.0 * (_large_attempts[tenth] - _large_failures[tenth]) / _large_attempts[tenth]);
+				}
+			}
+			printf("\n");
+		}
+
+		printf("\npeak fragmentation: %.3f (share of free memory in blocks below order %d, over %lu samples)\n",
+			_peak_fragmentation, _opts.fragmentation_order, _nr_samples);
+
+		printf("\nfree list lengths   peak     final\n");
+		for (int order = 0; order <= MAX_ORDER; order++) {
+			printf("%17d %6lu %9lu\n", order, _peak_free_blocks[order], _alloc.nr_free_blocks(order));
+		}
+	}
+
+private:
+	struct Block
+	{
+		PageDescriptor *pgd = NULL;
+		int order = 0;
+		uint64_t exact_count = 0;	// the pages asked for, if allocated with allocate_pages_exact
+		uint64_t contig_count = 0;	// the pages asked for, if allocated with allocate_contig_range
+	};
+
+	struct LatencySummary
+	{
+		double mean, p50, p99;
+	};
+
+	static LatencySummary summarise(std::vector<uint64_t> ticks, double ns_per_tick)
+	{
+		LatencySummary s = { 0, 0, 0 };
+		if (ticks.empty()) return s;
+
+		std::sort(ticks.begin(), ticks.end());
+
+		double total = 0;
+		for (uint64_t t : ticks) total += t;
+
+		s.mean = (total / ticks.size()) * ns_per_tick;
+		s.p50 = ticks[ticks.size() / 2] * ns_per_tick;
+		s.p99 = ticks[(ticks.size() * 99) / 100] * ns_per_tick;
+		return s;
+	}
+
+	/* Records the free list lengths, and the unusable free space index: how much of the free memory is
+	 * in blocks too small to satisfy an allocation of the fragmentation order. */
+	void sample()
+	{
+		uint64_t free_pages = 0;
+		uint64_t unusable_pages = 0;
+
+		for (int order = 0; order <= MAX_ORDER; order++) {
+			uint64_t blocks = _alloc.nr_free_blocks(order);
+
+			free_pages += blocks << order;
+			if (order < _opts.fragmentation_order) unusable_pages += blocks << order;
+			if (blocks > _peak_free_blocks[order]) _peak_free_blocks[order] = blocks;
+		}
+
+		if (free_pages > 0) {
+			double fragmentation = (double)unusable_pages / (double)free_pages;
+			if (fragmentation > _peak_fragmentation) _peak_fragmentation = fragmentation;
+		}
+
+		_nr_samples++;
+	}
+
+	BuddyPageAllocator& _alloc;
+	const Options& _opts;
+
+	std::vector<Block> _blocks;
+	std::vector<uint64_t> _alloc_ticks[MAX_ORDER + 1];
+	std::vector<uint64_t> _free_ticks[MAX_ORDER + 1];
+	uint64_t _failed[MAX_ORDER + 1] = { };
+	uint64_t _large_attempts[10] = { };
+	uint64_t _large_failures[10] = { };
+	uint64_t _peak_free_blocks[MAX_ORDER + 1] = { };
+	uint64_t _nr_samples = 0;
+	double _peak_fragmentation = 0;
+	BuddyMemInfo _start_info;
+};
+
+/**
+ * Runs the stress loop behind SYS_PGALLOC_STRESS on 1 to opts.nr_threads threads at once, each thread standing in
+ * for a CPU, and reports the throughput at each thread count against a single thread.
+ */
+static void run_stress(BuddyPageAllocator& alloc, const Options& opts)
+{
+	printf("threads   allocs/s (total)   per thread   scaling   lock contentions   failed\n");
+
+	double single_rate = 0;
+	for (unsigned int n = 1; n <= opts.nr_threads; n++) {
+		BuddyMemInfo before, after;
+		alloc.get_meminfo(before);
+
+		std::vector<std::thread> threads;
+		std::vector<unsigned long> failed(n);
+
+		auto start = std::chrono::steady_clock::now();
+		for (unsigned int t = 0; t < n; t++) {
+			threads.emplace_back([&opts, &failed, t]() {
+				bench_cpu = t;
+				failed[t] = sys_pgalloc_stress(opts.nr_ops, opts.seed + t, 0, 0);
+			});
+		}
+		for (auto& thread : threads) thread.join();
+		auto end = std::chrono::steady_clock::now();
+
+		alloc.get_meminfo(after);
+
+		unsigned long total_failed = 0;
+		for (unsigned long f : failed) total_failed += f;
+
+		double rate = (double)(opts.nr_ops * n) / std::chrono::duration<double>(end - start).count();
+		if (n == 1) single_rate = rate;
+
+		printf("%7u %18.0f %12.0f %8.2fx %18lu %8lu\n", n, rate, rate / n, rate / single_rate,
+			after.lock_contentions - before.lock_contentions, total_failed);
+	}
+}
+
+typedef std::vector<std::pair<uint64_t, uint64_t>> MemoryMap;
+
+/**
+ * Lists the available regions of a memory map, as (first pfn, number of pages).  "flat" is one region covering
+ * everything; "pc" follows the map QEMU gives a PC with more than 3 GiB - conventional memory below the EBDA, then
+ * 1 MiB up to the 3 GiB PCI hole, then the remainder relocated above 4 GiB (so the simulated memory has to cover
+ * the hole too).  "trace" is the ranges the trace inserts, for a trace that brings its own memory map.
+ * @return Returns FALSE if the map name is unknown.
+ */
+static bool build_memory_map(const char *map, uint64_t nr_pages, const std::vector<Op>& ops, MemoryMap& regions)
+{
+	if (strcmp(map, "trace") == 0) {
+		for (const Op& op : ops) {
+			if (op.type == Op::INSERT_RANGE) regions.push_back(std::make_pair(op.pfn, op.count));
+		}
+		return true;
+	} else if (strcmp(map, "flat") == 0) {
+		regions.push_back(std::make_pair(0, nr_pages));
+		return true;
+	} else if (strcmp(map, "pc") == 0) {
+		const uint64_t low_end = 0x9f, high_start = 0x100, hole_start = (3ULL << 30) >> __page_bits, hole_end = (4ULL << 30) >> __page_bits;
+
+		regions.push_back(std::make_pair(0, std::min(low_end, nr_pages)));
+		if (nr_pages > high_start) {
+			regions.push_back(std::make_pair(high_start, std::min(hole_start, nr_pages) - high_start));
+		}
+		if (nr_pages > hole_end) {
+			regions.push_back(std::make_pair(hole_end, nr_pages - hole_end));
+		}
+		return true;
+	}
+
+	return false;
+}
+
+/**
+ * Marks each page descriptor with its type in a memory map, as the core does before the allocator is initialised.
+ */
+static void mark_memory_map(const MemoryMap& regions, uint64_t nr_pages)
+{
+	PageAllocator& pgalloc = sys.mm().pgalloc();
+
+	for (uint64_t pfn = 0; pfn < nr_pages; pfn++) {
+		pgalloc.pfn_to_pgd(pfn)->type = PageDescriptorType::RESERVED;
+	}
+
+	for (const auto& region : regions) {
+		for (uint64_t pfn = region.first; pfn < region.first + region.second; pfn++) {
+			pgalloc.pfn_to_pgd(pfn)->type = PageDescriptorType::AVAILABLE;
+		}
+	}
+}
+
+/**
+ * Hands the simulated memory to the allocator the way the core does: init, then one insert_page_range per
+ * available region - unless the map came from a trace, which inserts the ranges itself.
+ * @return Returns FALSE if the allocator failed to initialise.
+ */
+static bool load_memory_map(BuddyPageAllocator& alloc, const char *map, const MemoryMap& regions, uint64_t nr_pages)
+{
+	PageAllocator& pgalloc = sys.mm().pgalloc();
+
+	if (!alloc.init(pgalloc.page_descriptors(), nr_pages)) return false;
+
+	if (strcmp(map, "trace") != 0) {
+		for (const auto& region : regions) {
+			alloc.insert_page_range(pgalloc.pfn_to_pgd(region.first), region.second);
+		}
+	}
+	return true;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [options]\n"
+		"  -m MIB      size of the simulated physical memory (default 6144, as run.sh boots with)\n"
+		"  -n OPS      number of operations in a synthetic workload (default 1000000)\n"
+		"  -l BLOCKS   live set size the synthetic workloads hover around (default 16384)\n"
+		"  -w NAME     synthetic workload: churn, fragment, lifo, forkexit or soak (default churn)\n"
+		"  -j THREADS  instead of a workload, run the SYS_PGALLOC_STRESS loop (-n allocations per thread) on 1 to\n"
+		"              THREADS threads at once, and report how throughput scales\n"
+		"  -s SEED     random seed for the synthetic workloads (default 1)\n"
+		"  -M MAP      memory map to hand the allocator: flat, or pc (the 6 GiB QEMU layout, with its holes)\n"
+		"  -f ORDER    order the fragmentation index is measured against (default 9, i.e. 2 MiB)\n"
+		"  -t FILE     replay a trace file, or a debug console capture with allocation trace dumps in it, instead\n"
+		"              of a synthetic workload\n"
+		"  -r FILE     write the operations that are about to run out as a trace file\n"
+		"  -o ARG      pass a kernel command-line argument to the allocator, e.g. pgalloc.placement=lowest,\n"
+		"              pgalloc.grouping=off or pgalloc.regions=1\n"
+		"  -d          dump the allocator state at the end\n"
+		"  -v          show the allocator's log messages\n", prog);
+}
+
+int main(int argc, char **argv)
+{
+	Options opts;
+	int c;
+
+	while ((c = getopt(argc, argv, "m:M:n:l:w:j:s:f:t:r:o:dvh")) != -1) {
+		switch (c) {
+		case 'm': opts.memory_mib = strtoull(optarg, NULL, 0); break;
+		case 'M': opts.memory_map = optarg; break;
+		case 'n': opts.nr_ops = strtoull(optarg, NULL, 0); break;
+		case 'l': opts.live_target = strtoull(optarg, NULL, 0); break;
+		case 'w': opts.workload = optarg; break;
+		case 'j': opts.nr_threads = strtoul(optarg, NULL, 0); break;
+		case 's': opts.seed = strtoul(optarg, NULL, 0); break;
+		case 'f': opts.fragmentation_order = atoi(optarg); break;
+		case 't': opts.trace = optarg; break;
+		case 'r': opts.record = optarg; break;
+		case 'd': opts.dump = true; break;
+		case 'v': Log::verbose = true; break;
+		case 'o':
+			if (!CommandLine::apply(optarg)) {
+				fprintf(stderr, "unknown allocator argument: %s\n", optarg);
+				return 1;
+			}
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	std::vector<Op> ops;
+	uint64_t nr_pages = (opts.memory_mib << 20) >> __page_bits;
+
+	if (opts.nr_threads) {
+		//the stress loop makes its own operations
+	} else if (opts.trace) {
+		uint64_t trace_pages = 0;
+		if (!load_trace(opts.trace, ops, trace_pages)) return 1;
+
+		//a trace that starts with the memory map is replayed on as many pages as the traced allocator had
+		if (!ops.empty() && ops[0].type == Op::INSERT_RANGE) {
+			for (const Op& op : ops) {
+				if (op.type == Op::INSERT_RANGE) trace_pages = std::max(trace_pages, op.pfn + op.count);
+			}
+
+			opts.memory_map = "trace";
+			opts.memory_mib = (trace_pages << __page_bits) >> 20;
+			nr_pages = trace_pages;
+		}
+	} else {
+		WorkloadGenerator gen(opts);
+		if (!gen.generate(ops)) {
+			fprintf(stderr, "unknown workload: %s\n", opts.workload);
+			return 1;
+		}
+	}
+
+	if (opts.record && !record_trace(opts.record, ops)) return 1;
+
+	if (!sys.mm().pgalloc().init(nr_pages)) {
+		fprintf(stderr, "unable to reserve %lu MiB of host memory\n", opts.memory_mib);
+		return 1;
+	}
+
+	MemoryMap regions;
+	if (!build_memory_map(opts.memory_map, nr_pages, ops, regions)) {
+		fprintf(stderr, "unknown memory map: %s\n", opts.memory_map);
+		return 1;
+	}
+	mark_memory_map(regions, nr_pages);
+
+	BuddyPageAllocator *alloc = new BuddyPageAllocator();
+
+	auto init_start = std::chrono::steady_clock::now();
+	if (!load_memory_map(*alloc, opts.memory_map, regions, nr_pages)) {
+		fprintf(stderr, "allocator failed to initialise with the %s memory map\n", opts.memory_map);
+		return 1;
+	}
+	auto init_end = std::chrono::steady_clock::now();
+
+	if (opts.nr_threads) {
+		printf("%s: %lu MiB (%s map), %u regions, %lu allocations per thread, init %.2f ms\n\n", alloc->name(),
+			opts.memory_mib, opts.memory_map, alloc->nr_regions(), opts.nr_ops,
+			std::chrono::duration<double, std::milli>(init_end - init_start).count());
+
+		run_stress(*alloc, opts);
+		return 0;
+	}
+
+	printf("%s: %lu MiB (%s map), %lu ops (%s), init %.2f ms\n\n", alloc->name(), opts.memory_mib, opts.memory_map,
+		ops.size(), opts.trace ? opts.trace : opts.workload,
+		std::chrono::duration<double, std::milli>(init_end - init_start).count());
+
+	Replayer replayer(*alloc, opts);
+	if (!replayer.run(ops)) return 1;
+
+	replayer.report();
+
+	if (opts.dump) {
+		Log::verbose = true;
+		alloc->dump_state();
+	}
+
+	return 0;
+}
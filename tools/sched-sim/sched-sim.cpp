@@ -0,0 +1,434 @@
+/*
+ * Host simulator for the scheduling algorithms
+ *
+ * Builds coursework/sched-mq.cpp and coursework/sched-mlfq.cpp for Linux against the InfOS shim in tools/shim (on
+ * top of coursework/buddy.cpp and slab.cpp, which their run queue nodes come from), and replays workload models
+ * through each algorithm as a discrete-event simulation: every CPU takes a timer tick every -t microseconds, an
+ * entity that blocks gives its CPU up at once, and an entity that wakes is added on the CPU it last ran on, to be
+ * picked at a tick.  Entities are created on CPU 0, as a program's threads are.  The algorithms themselves take no
+ * simulated time.
+ *
+ * The workloads:
+ *   cpu       8 CPU-bound NORMAL entities
+ *   sleepers  8 INTERACTIVE entities running 200us every 5ms or so, against 4 CPU-bound NORMAL entities
+ *   mixed     prio-sched-test, with its sleeps scaled down: 10 REALTIME entities running 100us every 15ms or so,
+ *             3 INTERACTIVE tickers running 300us every 10ms, and 2 CPU-bound DAEMON entities
+ *
+ * For each algorithm and workload, it reports the share of the CPUs' time entities ran, the bursts of work the
+ * sleeping entities finished, and the context switches and migrations, each per second - and for each priority
+ * class, its share of the CPUs, the wake-up latency (from an entity waking to it running) at the 50th and 99th
+ * percentiles and at most, and Jain's fairness index over its entities' CPU time (1 is perfectly fair, 1/n is one
+ * entity taking everything).
+ */
+
+#include <stdint.h>
+
+#define HAVE_CURRENT_CPU_ID
+static unsigned int bench_cpu;
+static inline unsigned int current_cpu_id() { return bench_cpu; }
+
+#define HAVE_SCHED_CLOCK
+static uint64_t sim_now;
+static inline uint64_t sched_clock_us() { return sim_now; }
+
+#include "../../coursework/buddy.cpp"
+#include "../../coursework/slab.cpp"
+#include "../../coursework/sched-mq.cpp"
+#include "../../coursework/sched-mlfq.cpp"
+
+#include <vector>
+#include <queue>
+#include <random>
+#include <algorithm>
+#include <unistd.h>
+
+/* The burst of an entity that never blocks. */
+#define CPU_BOUND	(~0ULL)
+
+struct Options
+{
+	uint64_t memory_mib = 256;
+	uint64_t duration_ms = 10000;
+	uint64_t tick_us = 1000;
+	unsigned int nr_cpus = 1;
+	unsigned int seed = 1;
+	const char *algorithm = NULL;
+	const char *workload = NULL;
+};
+
+/**
+ * A group of entities that behave alike: each runs for burst_us, then sleeps for sleep_us - or for a time drawn
+ * from an exponential distribution with that mean, if random is set.
+ */
+struct EntityModel
+{
+	SchedulingEntityPriority::SchedulingEntityPriority priority;
+	unsigned int count;
+	uint64_t burst_us;
+	uint64_t sleep_us;
+	bool random;
+};
+
+struct Workload
+{
+	const char *name;
+	EntityModel models[4];
+};
+
+static const Workload workloads[] = {
+	{ "cpu", {
+		{ SchedulingEntityPriority::NORMAL, 8, CPU_BOUND, 0, false },
+	} },
+	{ "sleepers", {
+		{ SchedulingEntityPriority::INTERACTIVE, 8, 200, 5000, true },
+		{ SchedulingEntityPriority::NORMAL, 4, CPU_BOUND, 0, false },
+	} },
+	{ "mixed", {
+		{ SchedulingEntityPriority::REALTIME, 10, 100, 15000, true },
+		{ SchedulingEntityPriority::INTERACTIVE, 3, 300, 10000, false },
+		{ SchedulingEntityPriority::DAEMON, 2, CPU_BOUND, 0, false },
+	} },
+};
+
+static const char *class_names[SCHEDSTAT_CLASSES] = { "REALTIME", "INTERACTIVE", "NORMAL", "DAEMON" };
+
+struct SimEntity : SchedulingEntity
+{
+	SimEntity(const EntityModel& model) : SchedulingEntity(model.priority), model(model) { }
+
+	const EntityModel& model;
+	uint64_t remaining = 0;			// of the current burst
+	uint64_t woken_at = 0;
+	bool waiting = false;			// woken, and not yet run
+	int running_on = -1;
+	unsigned int last_cpu = 0;
+	bool has_run = false;
+
+	uint64_t cpu_time = 0;
+	uint64_t bursts = 0;
+};
+
+struct SimCPU
+{
+	SimEntity *running = NULL;
+	uint64_t since = 0;				// when the running entity was picked, or last charged
+	uint64_t generation = 0;		// bumped on every pick, so a stale burst end is ignored
+};
+
+enum EventType { TICK, BURST_END, WAKE };
+
+struct Event
+{
+	uint64_t time;
+	uint64_t seq;					// events at the same time happen in the order they were made
+	EventType type;
+	unsigned int cpu;
+	uint64_t generation;
+	SimEntity *entity;
+
+	bool operator>(const Event& other) const
+	{
+		return time != other.time ? time > other.time : seq > other.seq;
+	}
+};
+
+struct Result
+{
+	uint64_t cpu_time, bursts, switches, migrations;
+	struct {
+		unsigned int entities;
+		uint64_t cpu_time;
+		std::vector<uint64_t> latencies;
+		double fairness;
+	} classes[SCHEDSTAT_CLASSES];
+};
+
+/**
+ * Runs a workload through an algorithm, and returns what happened.
+ * @return Returns false if the algorithm picked an entity that was running on another CPU.
+ */
+static bool simulate(SchedulingAlgorithm *algorithm, const Workload& workload, const Options& opts, Result& result)
+{
+	std::priority_queue<Event, std::vector<Event>, std::greater<Event>> events;
+	uint64_t seq = 0;
+	auto post = [&](uint64_t time, EventType type, unsigned int cpu, SimEntity *entity, uint64_t generation) {
+		events.push(Event { time, seq++, type, cpu, generation, entity });
+	};
+
+	std::mt19937_64 rng(opts.seed);
+	auto sleep_time = [&](const EntityModel& model) -> uint64_t {
+		if (!model.random) return model.sleep_us;
+		std::exponential_distribution<double> dist(1.0 / model.sleep_us);
+		return 1 + (uint64_t)dist(rng);
+	};
+
+	std::vector<SimCPU> cpus(opts.nr_cpus);
+	std::vector<SimEntity *> entities;
+	uint64_t end = opts.duration_ms * 1000;
+	bool ok = true;
+
+	result = Result();
+	sim_now = 0;
+
+	auto charge = [&](SimCPU& cpu) {
+		SimEntity *entity = cpu.running;
+		if (!entity) return;
+
+		uint64_t ran = sim_now - cpu.since;
+		entity->cpu_time += ran;
+		if (entity->remaining != CPU_BOUND) entity->remaining -= std::min(ran, entity->remaining);
+		cpu.since = sim_now;
+	};
+
+	auto schedule = [&](unsigned int c) {
+		SimCPU& cpu = cpus[c];
+
+		bench_cpu = c;
+		SimEntity *next = (SimEntity *)algorithm->pick_next_entity();
+		SimEntity *prev = cpu.running;
+
+		if (next != prev) {
+			if (prev) prev->running_on = -1;
+			if (next) {
+				if (next->running_on >= 0) {
+					fprintf(stderr, "%s picked an entity on cpu %u that is running on cpu %d\n", algorithm->name(), c,
+						next->running_on);
+					ok = false;
+				}
+
+				result.switches++;
+				if (next->has_run && next->last_cpu != c) result.migrations++;
+			}
+		}
+
+		cpu.running = next;
+		cpu.since = sim_now;
+		cpu.generation++;
+		if (!next) return;
+
+		next->running_on = c;
+		next->last_cpu = c;
+		next->has_run = true;
+
+		if (next->waiting) {
+			result.classes[next->priority()].latencies.push_back(sim_now - next->woken_at);
+			next->waiting = false;
+		}
+
+		if (next->remaining != CPU_BOUND) post(sim_now + next->remaining, BURST_END, c, next, cpu.generation);
+	};
+
+	//every entity starts runnable, on CPU 0
+	bench_cpu = 0;
+	for (const EntityModel& model : workload.models) {
+		for (unsigned int i = 0; i < model.count; i++) {
+			SimEntity *entity = new SimEntity(model);
+			entity->remaining = model.burst_us;
+			entity->waiting = true;
+			entities.push_back(entity);
+			algorithm->add_to_runqueue(*entity);
+		}
+	}
+
+	//the CPUs' ticks are spread over a tick, as they are on real hardware
+	for (unsigned int c = 0; c < opts.nr_cpus; c++) {
+		post((c * opts.tick_us) / opts.nr_cpus, TICK, c, NULL, 0);
+	}
+
+	while (ok && !events.empty() && events.top().time < end) {
+		Event event = events.top();
+		events.pop();
+		sim_now = event.time;
+
+		switch (event.type) {
+		case TICK:
+			charge(cpus[event.cpu]);
+			schedule(event.cpu);
+			post(sim_now + opts.tick_us, TICK, event.cpu, NULL, 0);
+			break;
+
+		case BURST_END: {
+			SimCPU& cpu = cpus[event.cpu];
+			if (event.generation != cpu.generation) break;
+
+			//the burst is done, so the entity blocks, and the CPU picks another
+			SimEntity *entity = cpu.running;
+			charge(cpu);
+			entity->bursts++;
+			result.bursts++;
+
+			bench_cpu = event.cpu;
+			algorithm->remove_from_runqueue(*entity);
+			entity->running_on = -1;
+			cpu.running = NULL;
+
+			post(sim_now + sleep_time(entity->model), WAKE, 0, entity, 0);
+			schedule(event.cpu);
+			break;
+		}
+
+		case WAKE: {
+			SimEntity *entity = event.entity;
+			entity->remaining = entity->model.burst_us;
+			entity->woken_at = sim_now;
+			entity->waiting = true;
+
+			bench_cpu = entity->last_cpu;
+			algorithm->add_to_runqueue(*entity);
+			break;
+		}
+		}
+	}
+
+	sim_now = end;
+	for (SimCPU& cpu : cpus) {
+		charge(cpu);
+	}
+
+	for (unsigned int cls = 0; cls < SCHEDSTAT_CLASSES; cls++) {
+		double sum = 0, sum_sq = 0;
+		unsigned int n = 0;
+		for (SimEntity *entity : entities) {
+			if (entity->priority() != cls) continue;
+			sum += entity->cpu_time;
+			sum_sq += (double)entity->cpu_time * entity->cpu_time;
+			n++;
+		}
+
+		result.classes[cls].entities = n;
+		result.classes[cls].cpu_time = sum;
+		result.classes[cls].fairness = sum_sq > 0 ? (sum * sum) / (n * sum_sq) : 1;
+		result.cpu_time += sum;
+
+		std::sort(result.classes[cls].latencies.begin(), result.classes[cls].latencies.end());
+	}
+
+	//the algorithm is never freed (see SchedulerRegistry::create), but the entities can go
+	for (SimEntity *entity : entities) delete entity;
+
+	return ok;
+}
+
+static uint64_t percentile(const std::vector<uint64_t>& sorted, unsigned int p)
+{
+	if (sorted.empty()) return 0;
+	return sorted[std::min(sorted.size() - 1, (sorted.size() * p) / 100)];
+}
+
+static void report(const char *algorithm, const Workload& workload, const Options& opts, const Result& result)
+{
+	double seconds = opts.duration_ms / 1000.0;
+	double capacity = (double)opts.duration_ms * 1000 * opts.nr_cpus;
+
+	printf("%-6s %-9s %6.1f%% %10.0f %11.0f %13.0f\n", algorithm, workload.name, 100.0 * result.cpu_time / capacity,
+		result.bursts / seconds, result.switches / seconds, result.migrations / seconds);
+
+	for (unsigned int cls = 0; cls < SCHEDSTAT_CLASSES; cls++) {
+		const auto& stats = result.classes[cls];
+		if (!stats.entities) continue;
+
+		printf("         %-12s %8u %8.1f%% %8lu %8lu %8lu %8lu %9.3f\n", class_names[cls], stats.entities,
+			100.0 * stats.cpu_time / capacity, stats.latencies.size(), percentile(stats.latencies, 50),
+			percentile(stats.latencies, 99), stats.latencies.empty() ? 0 : stats.latencies.back(), stats.fairness);
+	}
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [options]\n"
+		"  -a NAME     simulate only one algorithm (default all those built in)\n"
+		"  -w NAME     replay only one workload: cpu, sleepers or mixed\n"
+		"  -c CPUS     number of CPUs (default 1)\n"
+		"  -d MS       simulated time for each workload (default 10000)\n"
+		"  -t US       timer tick (default 1000)\n"
+		"  -s SEED     random seed for the sleep times (default 1)\n"
+		"  -m MIB      size of the simulated physical memory (default 256)\n"
+		"  -o ARG      pass a kernel command-line argument to the algorithms, e.g. sched.aging=0\n"
+		"  -v          show the algorithms' log messages\n", prog);
+}
+
+int main(int argc, char **argv)
+{
+	Options opts;
+	int c;
+
+	while ((c = getopt(argc, argv, "a:w:c:d:t:s:m:o:vh")) != -1) {
+		switch (c) {
+		case 'a': opts.algorithm = optarg; break;
+		case 'w': opts.workload = optarg; break;
+		case 'c': opts.nr_cpus = strtoul(optarg, NULL, 0); break;
+		case 'd': opts.duration_ms = strtoull(optarg, NULL, 0); break;
+		case 't': opts.tick_us = strtoull(optarg, NULL, 0); break;
+		case 's': opts.seed = strtoul(optarg, NULL, 0); break;
+		case 'm': opts.memory_mib = strtoull(optarg, NULL, 0); break;
+		case 'v': Log::verbose = true; break;
+		case 'o':
+			if (!CommandLine::apply(optarg)) {
+				fprintf(stderr, "unknown scheduler argument: %s\n", optarg);
+				return 1;
+			}
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (opts.nr_cpus < 1 || opts.nr_cpus > MAX_CPUS || opts.duration_ms < 1 || opts.tick_us < 1) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	uint64_t nr_pages = (opts.memory_mib << 20) >> __page_bits;
+	if (!sys.mm().pgalloc().init(nr_pages)) {
+		fprintf(stderr, "unable to reserve %lu MiB of host memory\n", opts.memory_mib);
+		return 1;
+	}
+
+	BuddyPageAllocator *alloc = new BuddyPageAllocator();
+	if (!alloc->init(sys.mm().pgalloc().page_descriptors(), nr_pages)) {
+		fprintf(stderr, "allocator failed to initialise\n");
+		return 1;
+	}
+	alloc->insert_page_range(sys.mm().pgalloc().pfn_to_pgd(0), nr_pages);
+	sys.mm().pgalloc().set_algorithm(alloc);
+
+	//an instance of each algorithm, just for its name
+	std::vector<const char *> names;
+	for (unsigned int i = 0; i < SchedulerRegistry::count(); i++) {
+		names.push_back(SchedulerRegistry::create(i)->name());
+	}
+
+	if (opts.algorithm && std::find_if(names.begin(), names.end(),
+		[&](const char *name) { return strcmp(name, opts.algorithm) == 0; }) == names.end()) {
+		fprintf(stderr, "no algorithm called %s is built in - only", opts.algorithm);
+		for (const char *name : names) fprintf(stderr, " %s", name);
+		fprintf(stderr, "\n");
+		return 1;
+	}
+
+	printf("%u CPUs, %lu ms per workload, %lu us ticks\n\n", opts.nr_cpus, opts.duration_ms, opts.tick_us);
+	printf("algo   workload     util   bursts/s  switches/s  migrations/s\n");
+	printf("         class        entities  cpu share  wakeups  p50 (us)  p99 (us)  max (us)  fairness\n");
+
+	bool ok = true;
+	for (const Workload& workload : workloads) {
+		if (opts.workload && strcmp(opts.workload, workload.name) != 0) continue;
+
+		printf("\n");
+		for (unsigned int i = 0; i < names.size(); i++) {
+			if (opts.algorithm && strcmp(opts.algorithm, names[i]) != 0) continue;
+
+			//a fresh instance for every run, so no run sees another's state
+			SchedulingAlgorithm *algorithm = SchedulerRegistry::create(i);
+			algorithm->init();
+
+			Result result;
+			if (!simulate(algorithm, workload, opts, result)) ok = false;
+			report(names[i], workload, opts, result);
+		}
+	}
+
+	return ok ? 0 : 1;
+}
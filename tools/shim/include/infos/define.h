@@ -0,0 +1,20 @@
+/*
+ * Host shim: the InfOS basic definitions used by the coursework algorithms.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#define __page_bits	12
+#define __page_size	(1UL << __page_bits)
+
+#define __aligned(_v)	__attribute__((aligned(_v)))
+#define __packed	__attribute__((packed))
+
+#define ARRAY_SIZE(_arr) (sizeof(_arr) / sizeof(_arr[0]))
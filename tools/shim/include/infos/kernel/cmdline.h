@@ -0,0 +1,65 @@
+/*
+ * Host shim: kernel command-line arguments.  Handlers register themselves at start-up, and the host
+ * program passes "name=value" strings to CommandLine::apply.
+ */
+
+#pragma once
+
+#include <infos/define.h>
+
+namespace infos
+{
+	namespace kernel
+	{
+		class CommandLine
+		{
+		public:
+			typedef void (*handler_fn)(const char *value);
+
+			struct Registration
+			{
+				Registration(const char *name, handler_fn handler)
+				{
+					assert(nr_args < ARRAY_SIZE(args));
+					args[nr_args].name = name;
+					args[nr_args].handler = handler;
+					nr_args++;
+				}
+			};
+
+			/**
+			 * Runs the handler registered for a "name=value" argument.
+			 * @return Returns false if no handler matches.
+			 */
+			static bool apply(const char *arg)
+			{
+				const char *eq = strchr(arg, '=');
+				size_t name_len = eq ? (size_t)(eq - arg) : strlen(arg);
+
+				for (unsigned int i = 0; i < nr_args; i++) {
+					if (strlen(args[i].name) == name_len && strncmp(args[i].name, arg, name_len) == 0) {
+						args[i].handler(eq ? eq + 1 : "");
+						return true;
+					}
+				}
+
+				return false;
+			}
+
+		private:
+			struct Argument
+			{
+				const char *name;
+				handler_fn handler;
+			};
+
+			static inline Argument args[32];
+			static inline unsigned int nr_args;
+		};
+	}
+}
+
+#define RegisterCmdLineArgument(_name, _match) \
+	static void __cmdline_arg_##_name(const char *value); \
+	static ::infos::kernel::CommandLine::Registration __cmdline_reg_##_name(_match, __cmdline_arg_##_name); \
+	static void __cmdline_arg_##_name(const char *value)
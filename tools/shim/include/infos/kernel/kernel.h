@@ -0,0 +1,43 @@
+/*
+ * Host shim: the kernel object, which here only owns the memory manager and the syscall table, and tells the
+ * time from the host's monotonic clock.
+ */
+
+#pragma once
+
+#include <infos/mm/mm.h>
+#include <infos/kernel/syscall.h>
+#include <time.h>
+
+namespace infos
+{
+	namespace kernel
+	{
+		/* The time since boot, in nanoseconds - as count() on the kernel's duration gives it. */
+		struct HostRuntime
+		{
+			uint64_t ns;
+			uint64_t count() const { return ns; }
+		};
+
+		class Kernel
+		{
+		public:
+			HostRuntime runtime() const
+			{
+				struct timespec ts;
+				clock_gettime(CLOCK_MONOTONIC, &ts);
+				return HostRuntime { ((uint64_t)ts.tv_sec * 1000000000ULL) + ts.tv_nsec };
+			}
+
+			mm::MemoryManager& mm() { return _mm; }
+			SyscallManager& syscalls() { return _syscalls; }
+
+		private:
+			mm::MemoryManager _mm;
+			SyscallManager _syscalls;
+		};
+
+		inline Kernel sys;
+	}
+}
@@ -0,0 +1,39 @@
+/*
+ * Host shim: kernel logging.  Messages are printed to stderr when the log is switched on with
+ * Log::verbose, and dropped otherwise.
+ */
+
+#pragma once
+
+#include <infos/define.h>
+#include <stdarg.h>
+
+namespace infos
+{
+	namespace kernel
+	{
+		namespace LogLevel
+		{
+			enum LogLevel { DEBUG, INFO, WARNING, ERROR, FATAL };
+		}
+
+		class Log
+		{
+		public:
+			static inline bool verbose;
+
+			void messagef(LogLevel::LogLevel, const char *fmt, ...)
+			{
+				if (!verbose) return;
+
+				va_list args;
+				va_start(args, fmt);
+				vfprintf(stderr, fmt, args);
+				fputc('\n', stderr);
+				va_end(args);
+			}
+		};
+
+		inline Log syslog;
+	}
+}
@@ -0,0 +1,80 @@
+/*
+ * Host shim: scheduling entities and algorithms.  There is no scheduler core on the host - a host program (e.g.
+ * tools/sched-sim) makes the algorithms itself, from what RegisterScheduler registers, and calls them as the
+ * kernel would on each scheduling event.
+ */
+
+#pragma once
+
+#include <infos/define.h>
+
+namespace infos
+{
+	namespace kernel
+	{
+		namespace SchedulingEntityPriority
+		{
+			enum SchedulingEntityPriority { REALTIME = 0, INTERACTIVE = 1, NORMAL = 2, DAEMON = 3 };
+		}
+
+		class SchedulingEntity
+		{
+		public:
+			SchedulingEntity(SchedulingEntityPriority::SchedulingEntityPriority priority) : _priority(priority) { }
+			virtual ~SchedulingEntity() { }
+
+			SchedulingEntityPriority::SchedulingEntityPriority priority() const { return _priority; }
+
+		private:
+			SchedulingEntityPriority::SchedulingEntityPriority _priority;
+		};
+
+		class SchedulingAlgorithm
+		{
+		public:
+			virtual ~SchedulingAlgorithm() { }
+
+			virtual const char *name() const = 0;
+			virtual void init() { }
+
+			virtual void add_to_runqueue(SchedulingEntity& entity) = 0;
+			virtual void remove_from_runqueue(SchedulingEntity& entity) = 0;
+			virtual SchedulingEntity *pick_next_entity() = 0;
+		};
+
+		/**
+		 * The algorithms built into the host program, in the order they were registered.
+		 */
+		class SchedulerRegistry
+		{
+		public:
+			typedef SchedulingAlgorithm *(*factory_fn)();
+
+			struct Registration
+			{
+				Registration(factory_fn factory)
+				{
+					assert(nr_factories < ARRAY_SIZE(factories));
+					factories[nr_factories++] = factory;
+				}
+			};
+
+			static unsigned int count() { return nr_factories; }
+
+			/**
+			 * Makes a new instance of a registered algorithm, which is never freed - its caches may still be on the
+			 * slab allocator's list.
+			 * @param index The algorithm's index, in [0, count()).
+			 */
+			static SchedulingAlgorithm *create(unsigned int index) { return factories[index](); }
+
+		private:
+			static inline factory_fn factories[8];
+			static inline unsigned int nr_factories;
+		};
+	}
+}
+
+#define RegisterScheduler(_class) \
+	static ::infos::kernel::SchedulingAlgorithm *__sched_create_##_class() { return new _class(); } \
+	static ::infos::kernel::SchedulerRegistry::Registration __sched_reg_##_class(__sched_create_##_class)
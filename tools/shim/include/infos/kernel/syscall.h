@@ -0,0 +1,39 @@
+/*
+ * Host shim: the syscall table, which the host tools can call into directly.
+ */
+
+#pragma once
+
+#include <infos/define.h>
+
+namespace infos
+{
+	namespace kernel
+	{
+		class SyscallManager
+		{
+		public:
+			typedef unsigned long (*syscallfn)(unsigned long, unsigned long, unsigned long, unsigned long);
+
+			static const int MAX_SYSCALLS = 64;
+
+			bool RegisterSyscall(int nr, syscallfn fn)
+			{
+				if (nr < 0 || nr >= MAX_SYSCALLS) return false;
+
+				_table[nr] = fn;
+				return true;
+			}
+
+			unsigned long InvokeSyscall(int nr, unsigned long a1 = 0, unsigned long a2 = 0, unsigned long a3 = 0, unsigned long a4 = 0)
+			{
+				if (nr < 0 || nr >= MAX_SYSCALLS || !_table[nr]) return (unsigned long)-1;
+
+				return _table[nr](a1, a2, a3, a4);
+			}
+
+		private:
+			syscallfn _table[MAX_SYSCALLS] = { };
+		};
+	}
+}
@@ -0,0 +1,29 @@
+/*
+ * Host shim: kernel threads.  There are no threads of the kernel's own on the host - the one thread is whatever
+ * is running the host program.  A thread is a scheduling entity, as in the kernel, so the scheduling algorithms
+ * can be handed one.
+ */
+
+#pragma once
+
+#include <infos/define.h>
+#include <infos/kernel/sched.h>
+
+namespace infos
+{
+	namespace kernel
+	{
+		class Thread : public SchedulingEntity
+		{
+		public:
+			Thread(SchedulingEntityPriority::SchedulingEntityPriority priority = SchedulingEntityPriority::NORMAL)
+				: SchedulingEntity(priority) { }
+
+			static Thread& current()
+			{
+				static Thread host_thread;
+				return host_thread;
+			}
+		};
+	}
+}
@@ -0,0 +1,47 @@
+/*
+ * Host shim: the memory manager.
+ */
+
+#pragma once
+
+#include <infos/mm/page-allocator.h>
+#include <infos/kernel/log.h>
+#include <sys/mman.h>
+
+namespace infos
+{
+	namespace mm
+	{
+		class MemoryManager
+		{
+		public:
+			PageAllocator& pgalloc() { return _pgalloc; }
+
+		private:
+			PageAllocator _pgalloc;
+		};
+
+		inline kernel::Log mm_log;
+
+		inline bool PageAllocator::init(uint64_t nr_pages)
+		{
+			_nr_pages = nr_pages;
+			_page_descriptors = new PageDescriptor[nr_pages]();
+
+			// the host has no memory map, so all of it is available unless a host program marks it otherwise
+			for (uint64_t pfn = 0; pfn < nr_pages; pfn++) {
+				_page_descriptors[pfn].type = PageDescriptorType::AVAILABLE;
+			}
+
+			_algorithm = NULL;
+
+			// reserve an extra max-order block's worth, and start at the first boundary in it
+			const uint64_t align = 1ULL << (__page_bits + 18);
+			void *memory = mmap(NULL, (nr_pages << __page_bits) + align, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+			if (memory == MAP_FAILED) return false;
+
+			_memory = (uint8_t *)(((uintptr_t)memory + align - 1) & ~(align - 1));
+			return true;
+		}
+	}
+}
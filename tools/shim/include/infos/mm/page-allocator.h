@@ -0,0 +1,76 @@
+/*
+ * Host shim: page descriptors, the page allocation algorithm interface, and the page allocator core.
+ * Physical memory is a host mapping of the requested size, reserved lazily, so only pages the
+ * allocator actually touches (e.g. for its metadata) use host memory.  The mapping is aligned to the largest
+ * block, as the kernel's direct map is, so blocks are aligned in virtual memory as well as physical.
+ */
+
+#pragma once
+
+#include <infos/define.h>
+
+namespace infos
+{
+	namespace mm
+	{
+		typedef uint64_t pfn_t;
+
+		namespace PageDescriptorType
+		{
+			enum PageDescriptorType { INVALID = 0, RESERVED = 1, AVAILABLE = 2, ALLOCATED = 3 };
+		}
+
+		struct PageDescriptor
+		{
+			PageDescriptor *next_free;
+			PageDescriptorType::PageDescriptorType type;
+		};
+
+		class PageAllocatorAlgorithm
+		{
+		public:
+			virtual ~PageAllocatorAlgorithm() { }
+
+			virtual bool init(PageDescriptor *page_descriptors, uint64_t nr_page_descriptors) = 0;
+			virtual PageDescriptor *allocate_pages(int order) = 0;
+			virtual void free_pages(PageDescriptor *pgd, int order) = 0;
+			virtual void insert_page_range(PageDescriptor *start, uint64_t count) = 0;
+			virtual void remove_page_range(PageDescriptor *start, uint64_t count) = 0;
+			virtual const char *name() const = 0;
+			virtual void dump_state() const = 0;
+		};
+
+		class PageAllocator
+		{
+		public:
+			/**
+			 * Sets up the page descriptors and the memory backing them.
+			 * @return Returns false if the host could not reserve that much memory.
+			 */
+			bool init(uint64_t nr_pages);
+
+			pfn_t pgd_to_pfn(const PageDescriptor *pgd) const { return pgd - _page_descriptors; }
+			PageDescriptor *pfn_to_pgd(pfn_t pfn) const { return &_page_descriptors[pfn]; }
+			void *pgd_to_kva(const PageDescriptor *pgd) const { return _memory + (pgd_to_pfn(pgd) << __page_bits); }
+			PageDescriptor *kva_to_pgd(const void *kva) const { return &_page_descriptors[((const uint8_t *)kva - _memory) >> __page_bits]; }
+
+			PageDescriptor *alloc_pages(int order) { return _algorithm->allocate_pages(order); }
+			void free_pages(PageDescriptor *pgd, int order) { _algorithm->free_pages(pgd, order); }
+
+			/** Host only: the algorithm alloc_pages and free_pages go to, as the kernel's command line would pick. */
+			void set_algorithm(PageAllocatorAlgorithm *algorithm) { _algorithm = algorithm; }
+
+			PageDescriptor *page_descriptors() const { return _page_descriptors; }
+			uint64_t nr_pages() const { return _nr_pages; }
+
+		private:
+			PageDescriptor *_page_descriptors;
+			uint64_t _nr_pages;
+			uint8_t *_memory;
+			PageAllocatorAlgorithm *_algorithm;
+		};
+	}
+}
+
+/* The host program instantiates the algorithm itself. */
+#define RegisterPageAllocator(_class)
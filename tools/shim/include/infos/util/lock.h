@@ -0,0 +1,20 @@
+/*
+ * Host shim: kernel locks.  There are no interrupts on the host, so UniqueIRQLock does nothing.
+ */
+
+#pragma once
+
+#include <infos/define.h>
+
+namespace infos
+{
+	namespace util
+	{
+		class UniqueIRQLock
+		{
+		public:
+			UniqueIRQLock() { }
+			~UniqueIRQLock() { }
+		};
+	}
+}
@@ -0,0 +1,14 @@
+/*
+ * Host shim: kernel maths helpers (the coursework algorithms use compiler builtins instead).
+ */
+
+#pragma once
+
+#include <infos/define.h>
+
+namespace infos
+{
+	namespace util
+	{
+	}
+}
@@ -0,0 +1,7 @@
+/*
+ * Host shim: the kernel's snprintf is the C library's.
+ */
+
+#pragma once
+
+#include <infos/define.h>
@@ -0,0 +1,7 @@
+/*
+ * Host shim: kernel string routines are the C library's.
+ */
+
+#pragma once
+
+#include <infos/define.h>
@@ -0,0 +1,297 @@
+/*
+ * Host benchmark for the slab object caches
+ *
+ * Builds coursework/slab.cpp, on top of coursework/buddy.cpp, for Linux against the InfOS shim in tools/shim, and
+ * times small kernel-object allocations made from the size classes (slab_alloc) against the same allocations
+ * made a page at a time from the buddy allocator, which is what a kernel without an object cache is left with.
+ *
+ * The workloads, each run on every thread at once (each thread acting as its own CPU):
+ *   lifo    bursts of 1 to 64 objects of one size, freed in the reverse order
+ *   random  a live set of objects of one size, a random one freed and replaced each step
+ *   thread  a live set of threads, each made of a 256 byte thread, a 128 byte context and a 32 byte run queue
+ *           node - the oldest torn down and a new one created each step
+ *
+ * With -j, each workload is run on 1 to N threads, and the throughput of both allocators reported against a single
+ * thread's.  The magazine, depot and slab columns say where the slab allocations were served from; run with
+ * -o slab.magazine=0 to see the caches without their magazines.
+ */
+
+#include <thread>
+
+#define HAVE_CURRENT_CPU_ID
+static thread_local unsigned int bench_cpu;
+static inline unsigned int current_cpu_id() { return bench_cpu; }
+
+#include "../../coursework/buddy.cpp"
+#include "../../coursework/slab.cpp"
+
+#include <vector>
+#include <random>
+#include <chrono>
+#include <unistd.h>
+
+struct Options
+{
+	uint64_t memory_mib = 1024;
+	uint64_t nr_ops = 1000000;
+	uint64_t live_target = 1024;
+	uint32_t object_size = 128;
+	unsigned int nr_threads = 1;
+	unsigned int seed = 1;
+	const char *workload = NULL;
+};
+
+/* The sizes of the objects a thread is made of, in the thread workload. */
+static const uint32_t thread_objects[] = { 256, 128, 32 };
+
+/**
+ * Where objects come from: the slab size classes, or a page each from the page allocator.
+ */
+struct SlabSource
+{
+	static void *alloc(size_t size) { return slab_alloc(size); }
+	static void free(void *object, size_t size) { slab_free(object, size); }
+};
+
+struct PageSource
+{
+	static void *alloc(size_t)
+	{
+		PageDescriptor *pgd = sys.mm().pgalloc().alloc_pages(0);
+		return pgd ? sys.mm().pgalloc().pgd_to_kva(pgd) : NULL;
+	}
+
+	static void free(void *object, size_t) { sys.mm().pgalloc().free_pages(sys.mm().pgalloc().kva_to_pgd(object), 0); }
+};
+
+/**
+ * Runs one thread's share of a workload, and returns the number of allocations that failed.  Every object is
+ * written to when it is allocated, as a kernel object would be, and checked when it is freed.
+ */
+template<typename Source>
+static uint64_t run_workload(const Options& opts, const char *workload, unsigned int thread)
+{
+	std::mt19937 rng(opts.seed + thread);
+	uint64_t failed = 0;
+
+	auto take = [&](size_t size) -> void * {
+		void *object = Source::alloc(size);
+		if (object) {
+			*(uint64_t *)object = (uintptr_t)object;
+		} else {
+			failed++;
+		}
+		return object;
+	};
+
+	auto give = [&](void *object, size_t size) {
+		if (!object) return;
+		assert(*(uint64_t *)object == (uintptr_t)object);
+		Source::free(object, size);
+	};
+
+	if (strcmp(workload, "lifo") == 0) {
+		void *burst[64];
+		uint64_t done = 0;
+		while (done < opts.nr_ops) {
+			unsigned int n = 1 + (rng() % 64);
+			for (unsigned int i = 0; i < n; i++) burst[i] = take(opts.object_size);
+			for (unsigned int i = n; i > 0; i--) give(burst[i - 1], opts.object_size);
+			done += n;
+		}
+	} else if (strcmp(workload, "random") == 0) {
+		std::vector<void *> live(opts.live_target);
+		for (auto& object : live) object = take(opts.object_size);
+
+		for (uint64_t i = 0; i < opts.nr_ops; i++) {
+			void *&slot = live[rng() % live.size()];
+			give(slot, opts.object_size);
+			slot = take(opts.object_size);
+		}
+
+		for (auto object : live) give(object, opts.object_size);
+	} else {
+		const unsigned int per_thread = ARRAY_SIZE(thread_objects);
+		std::vector<void *> live(opts.live_target * per_thread);
+		for (uint64_t i = 0; i < live.size(); i++) live[i] = take(thread_objects[i % per_thread]);
+
+		uint64_t oldest = 0;
+		for (uint64_t i = 0; i < opts.nr_ops; i += per_thread) {
+			for (unsigned int o = 0; o < per_thread; o++) {
+				give(live[(oldest * per_thread) + o], thread_objects[o]);
+			}
+			for (unsigned int o = 0; o < per_thread; o++) {
+				live[(oldest * per_thread) + o] = take(thread_objects[o]);
+			}
+			oldest = (oldest + 1) % opts.live_target;
+		}
+
+		for (uint64_t i = 0; i < live.size(); i++) give(live[i], thread_objects[i % per_thread]);
+	}
+
+	return failed;
+}
+
+/**
+ * Runs a workload on n threads at once, and returns the total allocation rate, in allocations per second.
+ */
+template<typename Source>
+static double run_threads(const Options& opts, const char *workload, unsigned int n, uint64_t& failed)
+{
+	std::vector<std::thread> threads;
+	std::vector<uint64_t> thread_failed(n);
+
+	auto start = std::chrono::steady_clock::now();
+	for (unsigned int t = 0; t < n; t++) {
+		threads.emplace_back([&opts, &thread_failed, workload, t]() {
+			bench_cpu = t;
+			thread_failed[t] = run_workload<Source>(opts, workload, t);
+		});
+	}
+	for (auto& thread : threads) thread.join();
+	auto end = std::chrono::steady_clock::now();
+
+	for (uint64_t f : thread_failed) failed += f;
+	return (double)(opts.nr_ops * n) / std::chrono::duration<double>(end - start).count();
+}
+
+/**
+ * Adds up the counters of the size class caches.
+ */
+static void size_class_stats(SlabCacheStats& total)
+{
+	memset(&total, 0, sizeof(total));
+	for (unsigned int i = 0; i < ARRAY_SIZE(size_classes); i++) {
+		SlabCacheStats stats;
+		size_classes[i].get_stats(stats);
+
+		total.allocs += stats.allocs;
+		total.frees += stats.frees;
+		total.magazine_hits += stats.magazine_hits;
+		total.depot_hits += stats.depot_hits;
+		total.slab_allocs += stats.slab_allocs;
+		total.nr_pages += stats.nr_pages;
+	}
+}
+
+static void run_workloads(const Options& opts)
+{
+	static const char *workloads[] = { "lifo", "random", "thread" };
+
+	printf("workload threads  slab allocs/s  scaling  page allocs/s  scaling  speedup  magazine   depot    slab  failed\n");
+
+	for (const char *workload : workloads) {
+		if (opts.workload && strcmp(opts.workload, workload) != 0) continue;
+
+		double slab_single = 0, page_single = 0;
+		for (unsigned int n = 1; n <= opts.nr_threads; n++) {
+			SlabCacheStats before, after;
+			uint64_t failed = 0;
+
+			size_class_stats(before);
+			double slab_rate = run_threads<SlabSource>(opts, workload, n, failed);
+			size_class_stats(after);
+
+			double page_rate = run_threads<PageSource>(opts, workload, n, failed);
+
+			if (n == 1) {
+				slab_single = slab_rate;
+				page_single = page_rate;
+			}
+
+			double allocs = (double)(after.allocs - before.allocs);
+			if (allocs == 0) allocs = 1;
+
+			printf("%-8s %7u %14.0f %7.2fx %14.0f %7.2fx %7.2fx %8.1f%% %6.1f%% %6.1f%% %7lu\n", workload, n, slab_rate,
+				slab_rate / slab_single, page_rate, page_rate / page_single, slab_rate / page_rate,
+				100.0 * (after.magazine_hits - before.magazine_hits) / allocs,
+				100.0 * (after.depot_hits - before.depot_hits) / allocs,
+				100.0 * (after.slab_allocs - before.slab_allocs) / allocs, failed);
+		}
+	}
+
+	//with every object freed, reaping should leave only what the CPUs' loaded magazines pin
+	SlabCacheStats stats;
+	size_class_stats(stats);
+	uint64_t reaped = slab_reap_all();
+
+	printf("\nreap: %lu of %lu slab pages freed\n", reaped, stats.nr_pages);
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [options]\n"
+		"  -m MIB      size of the simulated physical memory (default 1024)\n"
+		"  -n OPS      allocations per thread in each workload (default 1000000)\n"
+		"  -l OBJECTS  live set size of the random and thread workloads (default 1024)\n"
+		"  -S BYTES    object size for the lifo and random workloads (default 128, at most 1024)\n"
+		"  -w NAME     run only one workload: lifo, random or thread\n"
+		"  -j THREADS  run each workload on 1 to THREADS threads at once (default 1)\n"
+		"  -s SEED     random seed (default 1)\n"
+		"  -o ARG      pass a kernel command-line argument to the allocators, e.g. slab.magazine=0\n"
+		"  -d          dump the caches at the end\n"
+		"  -v          show the allocators' log messages\n", prog);
+}
+
+int main(int argc, char **argv)
+{
+	Options opts;
+	bool dump = false;
+	int c;
+
+	while ((c = getopt(argc, argv, "m:n:l:S:w:j:s:o:dvh")) != -1) {
+		switch (c) {
+		case 'm': opts.memory_mib = strtoull(optarg, NULL, 0); break;
+		case 'n': opts.nr_ops = strtoull(optarg, NULL, 0); break;
+		case 'l': opts.live_target = strtoull(optarg, NULL, 0); break;
+		case 'S': opts.object_size = strtoul(optarg, NULL, 0); break;
+		case 'w': opts.workload = optarg; break;
+		case 'j': opts.nr_threads = strtoul(optarg, NULL, 0); break;
+		case 's': opts.seed = strtoul(optarg, NULL, 0); break;
+		case 'd': dump = true; break;
+		case 'v': Log::verbose = true; break;
+		case 'o':
+			if (!CommandLine::apply(optarg)) {
+				fprintf(stderr, "unknown allocator argument: %s\n", optarg);
+				return 1;
+			}
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (opts.nr_threads < 1 || opts.nr_threads > MAX_CPUS || opts.object_size < 1 || opts.object_size > SLAB_MAX_SIZE ||
+		opts.live_target < 1) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	uint64_t nr_pages = (opts.memory_mib << 20) >> __page_bits;
+	if (!sys.mm().pgalloc().init(nr_pages)) {
+		fprintf(stderr, "unable to reserve %lu MiB of host memory\n", opts.memory_mib);
+		return 1;
+	}
+
+	BuddyPageAllocator *alloc = new BuddyPageAllocator();
+	if (!alloc->init(sys.mm().pgalloc().page_descriptors(), nr_pages)) {
+		fprintf(stderr, "allocator failed to initialise\n");
+		return 1;
+	}
+	alloc->insert_page_range(sys.mm().pgalloc().pfn_to_pgd(0), nr_pages);
+	sys.mm().pgalloc().set_algorithm(alloc);
+
+	printf("slab over %s: %lu MiB, %lu allocations per thread, %u objects per magazine\n\n", alloc->name(),
+		opts.memory_mib, opts.nr_ops, slab_magazine_size);
+
+	run_workloads(opts);
+
+	if (dump) {
+		Log::verbose = true;
+		slab_dump_all();
+	}
+
+	return 0;
+}